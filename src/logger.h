@@ -1,41 +1,86 @@
 #ifndef __LOGGER_H__
 #define __LOGGER_H__
 
+// Messages above that level are compiled out, see RADIUS_LOG_LEVEL
+// in config. All of them are compiled in by default.
+#ifndef RADIUS_LOG_LEVEL
+#define RADIUS_LOG_LEVEL NGX_LOG_DEBUG
+#endif
+
+// At most one message a second per limit, the rest are counted and
+// the count is reported with the next message, see LOG_LIMITED.
+typedef struct {
+    time_t last;
+    ngx_uint_t suppressed;
+} log_limit_t;
+
 #define CONF_LOG(severity, cf, err, fmt, ...) \
     ngx_conf_log_error(severity, cf, err,     \
                        "%s: " fmt,            \
-                       __FUNCTION__, ##__VA_ARGS__);
+                       __FUNCTION__, ##__VA_ARGS__)
 
 #define CONF_LOG_EMERG(cf, err, fmt, ...) \
-    CONF_LOG(NGX_LOG_EMERG, cf, err, fmt, ##__VA_ARGS__);
+    CONF_LOG(NGX_LOG_EMERG, cf, err, fmt, ##__VA_ARGS__)
+
+// The level is checked before anything is formatted
+#define LOG(severity, log, err, fmt, ...)                          \
+    do {                                                           \
+        if ((severity) <= RADIUS_LOG_LEVEL                         \
+            && (log)->log_level >= (severity))                     \
+        {                                                          \
+            ngx_log_error_core(severity, log, err,                 \
+                               "%s: " fmt,                         \
+                               __FUNCTION__, ##__VA_ARGS__);       \
+        }                                                          \
+    } while (0)
 
-#define LOG(severity, log, err, fmt, ...) \
-    ngx_log_error(severity, log, err,     \
-                  "%s: " fmt,             \
-                  __FUNCTION__, ##__VA_ARGS__);
+#define LOG_LIMITED(severity, limit, log, err, fmt, ...)           \
+    do {                                                           \
+        if ((severity) <= RADIUS_LOG_LEVEL                         \
+            && (log)->log_level >= (severity))                     \
+        {                                                          \
+            if ((limit)->last == ngx_time()) {                     \
+                (limit)->suppressed++;                             \
+                break;                                             \
+            }                                                      \
+            (limit)->last = ngx_time();                            \
+            ngx_log_error_core(severity, log, err,                 \
+                               "%s: " fmt ", suppressed: %ui",     \
+                               __FUNCTION__, ##__VA_ARGS__,        \
+                               (limit)->suppressed);               \
+            (limit)->suppressed = 0;                               \
+        }                                                          \
+    } while (0)
 
 #define LOG_EMERG(log, err, fmt, ...) \
-    LOG(NGX_LOG_EMERG, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_EMERG, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_ALERT(log, err, fmt, ...) \
-    LOG(NGX_LOG_ALERT, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_ALERT, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_CRIT(log, err, fmt, ...) \
-    LOG(NGX_LOG_CRIT, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_CRIT, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_ERR(log, err, fmt, ...) \
-    LOG(NGX_LOG_ERR, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_ERR, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_WARN(log, err, fmt, ...) \
-    LOG(NGX_LOG_WARN, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_WARN, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_NOTICE(log, err, fmt, ...) \
-    LOG(NGX_LOG_NOTICE, log, err, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_NOTICE, log, err, fmt, ##__VA_ARGS__)
 
 #define LOG_INFO(log, fmt, ...) \
-    LOG(NGX_LOG_INFO, log, 0, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_INFO, log, 0, fmt, ##__VA_ARGS__)
 
 #define LOG_DEBUG(log, fmt, ...) \
-    LOG(NGX_LOG_DEBUG, log, 0, fmt, ##__VA_ARGS__);
+    LOG(NGX_LOG_DEBUG, log, 0, fmt, ##__VA_ARGS__)
+
+// Per source rate limited, for errors an attacker can trigger
+#define LOG_ERR_LIMITED(limit, log, err, fmt, ...) \
+    LOG_LIMITED(NGX_LOG_ERR, limit, log, err, fmt, ##__VA_ARGS__)
+
+#define LOG_NOTICE_LIMITED(limit, log, err, fmt, ...) \
+    LOG_LIMITED(NGX_LOG_NOTICE, limit, log, err, fmt, ##__VA_ARGS__)
 
 #endif // __LOGGER_H__
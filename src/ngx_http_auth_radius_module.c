@@ -2,30 +2,282 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
+#if (NGX_LINUX)
+#include <linux/errqueue.h>
+#endif
 #include "logger.h"
 #include "radius_lib.h"
+#include "radius_md5.h"
+#include "radius_probes.h"
+#include "radius_rand.h"
 
 #define RADIUS_DEFAULT_PORT 1812
+// https://www.rfc-editor.org/rfc/rfc6614#section-2.1
+#define RADIUS_TLS_DEFAULT_PORT 2083
+// https://www.rfc-editor.org/rfc/rfc5176#section-3
+#define RADIUS_DYNAUTH_DEFAULT_PORT 3799
+
+#define RADIUS_CACHE_L2_DEFAULT_PORT 11211
+// Lookups in flight per worker, the rest go to the Radius servers
+#define RADIUS_CACHE_L2_PENDING 256
+// Commands not written yet, the rest are skipped
+#define RADIUS_CACHE_L2_OUT 16384
+#define RADIUS_CACHE_L2_IN 4096
+// Time the second tier is skipped after an error
+#define RADIUS_CACHE_L2_DOWN 5000
+// "radius:" and the hex of the key
+#define RADIUS_CACHE_L2_KEY_LEN (sizeof("radius:") - 1 + 32)
+// "radius:u:" and the hex of the user key, see revoke_radius_cache_l2
+#define RADIUS_CACHE_L2_USER_KEY_LEN (sizeof("radius:u:") - 1 + 32)
+
+#define RADIUS_CACHE_SNAPSHOT_MAGIC 0x52435332
+// Entries read at once when loading
+#define RADIUS_CACHE_SNAPSHOT_BATCH 256
+
+// Events recorded per request by radius_slow_log, the last one is
+// overwritten once full
+#define RADIUS_TRACE_EVENTS 32
+// Slow requests kept per worker by default
+#define RADIUS_SLOW_LOG_ENTRIES 16
+
+// Replies after which the baseline RTT of the adaptive concurrency
+// limit is re-measured, see update_radius_limit
+#define RADIUS_LIMIT_EPOCH 256
+// Slack of the RTT over twice the baseline, in microseconds, as the
+// event loop time is in milliseconds
+#define RADIUS_LIMIT_RTT_SLACK 1000
+
+// Virtual time of a request of weight 1, see grant_radius_slots
+#define RADIUS_QOS_SCALE 1000000
+
+// Packets created at once at the end of an event loop iteration,
+// see flush_radius_pkgs
+#define RADIUS_ENCODE_BATCH 64
+
+// Accounting-Requests in flight per server by default, see
+// radius_acct_chan_t
+#define RADIUS_ACCT_WINDOW 32
+// Records read back from the spill file at once, see replay_radius_acct
+#define RADIUS_ACCT_REPLAY_BATCH 64
+// Spill file header and records that don't start with it are dropped
+#define RADIUS_ACCT_MAGIC 0x52414331
+#define RADIUS_ACCT_USER_MAX 253
+#define RADIUS_ACCT_SESSION_MAX 64
+
+typedef enum {
+    RADIUS_TRANSPORT_UDP,
+    RADIUS_TRANSPORT_TCP,
+    RADIUS_TRANSPORT_TLS
+} radius_transport_t;
+
+typedef struct {
+    struct sockaddr *sockaddr;
+    socklen_t socklen;
+    ngx_str_t name;
+    // The peer is skipped by select_radius_peer until then,
+    // see mark_radius_peer_down
+    ngx_msec_t down_until;
+    // Smooth weighted round-robin, see pick_radius_peer
+    ngx_uint_t weight;
+    ngx_int_t current_weight;
+    // Set through radius_api, see sync_radius_state
+    uint8_t drained:1;
+    uint8_t added:1;
+} radius_peer_t;
+
+// Set of addresses a server URL resolves to. The set is replaced as
+// a whole on re-resolution and freed when neither the server nor
+// any request slot refers to it anymore.
+typedef struct {
+    ngx_uint_t refs;
+    // NULL for the set parsed at configuration time, never freed
+    ngx_pool_t *pool;
+    ngx_uint_t nelts;
+    // The first nbase peers come from the URL, the rest are added
+    // through radius_api
+    ngx_uint_t nbase;
+    radius_peer_t *elts;
+} radius_peers_t;
 
 struct radius_server_s;
+struct radius_req_s;
+struct ngx_http_auth_radius_ctx_s;
+
+// Persistent TCP or TLS connection shared by the requests of a server,
+// see RFC 6613. Requests are pipelined and replies are matched by the
+// Identifier, which is the index of the request slot.
+typedef struct {
+    struct radius_server_s *rs;
+    radius_peers_t *peers;
+    radius_peer_t *peer;
+    ngx_connection_t *conn;
+    uint8_t connected:1;
+    // Requests waiting for a reply
+    ngx_uint_t pending;
+    // Requests not completely written yet
+    struct radius_req_s *send_head;
+    struct radius_req_s *send_tail;
+    size_t sent;
+    u_char in[RADIUS_PKG_MAX];
+    size_t in_len;
+} radius_stream_t;
+
 typedef struct radius_req_s {
     uint8_t id;
     uint8_t buf[RADIUS_PKG_MAX];
     uint8_t auth[AUTH_BUF_SIZE];
     uint8_t active:1;
     uint8_t accepted:1;
+    // Queued to be created and sent, see flush_radius_pkgs
+    uint8_t encoding:1;
+    // Time the slot was released, see radius_idle_handler
+    ngx_msec_t last_used;
     struct radius_server_s *rs;
+    // Peer the connection is currently connected to
+    radius_peers_t *peers;
+    radius_peer_t *peer;
     ngx_connection_t *conn;
-    ngx_http_request_t *http_req;
+    // Time of the last send, see update_radius_server_stats
+    ngx_msec_t sent_at;
+    // Stream transports only, conn is NULL then
+    radius_stream_t *stream;
+    size_t len;
+    struct radius_req_s *send_next;
+    ngx_event_t timer;
+    struct ngx_http_auth_radius_ctx_s *ctx;
     struct radius_req_s *next;
 } radius_req_t;
 
+// QoS class of the locations, see radius_qos_class. Class 0 is the
+// "default" one of the locations without radius_qos.
+typedef struct {
+    ngx_str_t name;
+    ngx_uint_t weight;
+    // Requests waiting for a slot of a server at most, 0 if unlimited
+    ngx_uint_t queue;
+    uint8_t defined:1;
+} radius_class_t;
+
+// Requests of a class waiting for a slot of a server and their metrics
+typedef struct {
+    ngx_queue_t waiting;
+    ngx_uint_t nwaiting;
+    // Virtual finish time of the last request queued
+    uint64_t finish;
+    ngx_uint_t queued;
+    ngx_uint_t granted;
+    ngx_uint_t rejected;
+    // Total wait of the granted requests
+    ngx_msec_t wait_time;
+} radius_qos_t;
+
+// Accounting event, see record_radius_acct. Spilled to disk as is,
+// so the server is referred to by its name hash.
+typedef struct {
+    uint32_t magic;
+    uint32_t server;
+    uint8_t status;
+    uint8_t user_len;
+    uint8_t session_len;
+    u_char user[RADIUS_ACCT_USER_MAX];
+    u_char session[RADIUS_ACCT_SESSION_MAX];
+    uint32_t session_time;
+    uint64_t input_octets;
+    uint64_t output_octets;
+    time_t recorded;
+} radius_acct_rec_t;
+
+// Start of the spill file, the records before read are sent already
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t read;
+} radius_acct_spill_hdr_t;
+
+struct radius_acct_queue_s;
+
+// Accounting-Request in flight, retransmitted as is
+typedef struct {
+    struct radius_acct_chan_s *chan;
+    uint8_t id;
+    uint8_t active:1;
+    ngx_uint_t tries;
+    radius_acct_rec_t rec;
+    uint8_t auth[AUTH_BUF_SIZE];
+    size_t len;
+    uint8_t buf[RADIUS_PKG_MAX];
+    ngx_event_t timer;
+} radius_acct_slot_t;
+
+// Dedicated socket of the accounting of a server in a worker. The
+// Identifier is the index of the slot, records are sent in order as
+// slots become free, see radius_acct_handler.
+typedef struct radius_acct_chan_s {
+    struct radius_server_s *rs;
+    struct radius_acct_queue_s *q;
+    ngx_connection_t *conn;
+    // Peer to connect to, the next one after a record fails
+    ngx_uint_t peer_idx;
+    radius_acct_slot_t *slots;
+    ngx_uint_t nslots;
+    ngx_uint_t nactive;
+    ngx_uint_t next;
+} radius_acct_chan_t;
+
+typedef enum {
+    RADIUS_ACCT_DROP_OLDEST,
+    RADIUS_ACCT_SPILL
+} radius_acct_overflow_t;
+
+// Records waiting to be sent by a worker, see radius_accounting_queue
+typedef struct radius_acct_queue_s {
+    uint8_t configured:1;
+    ngx_uint_t size;
+    ngx_uint_t overflow;
+    ngx_str_t spill_path;
+    off_t spill_max;
+    ngx_uint_t retries;
+    ngx_msec_t timeout;
+    ngx_uint_t window;
+    radius_acct_rec_t *ring;
+    ngx_uint_t head;
+    ngx_uint_t count;
+    // Once the ring overflows, records are appended to the file until
+    // it is read back, so they are sent in order
+    ngx_file_t spill;
+    off_t spill_read;
+    off_t spill_write;
+    ngx_event_t ev;
+    ngx_uint_t recorded;
+    ngx_uint_t sent;
+    ngx_uint_t acked;
+    ngx_uint_t retried;
+    ngx_uint_t failed;
+    ngx_uint_t dropped;
+    ngx_uint_t spilled;
+    log_limit_t log_limit;
+} radius_acct_queue_t;
+
 typedef struct radius_server_s {
     uint8_t id;
     ngx_str_t name;
+    // Key of the server in the shared state, see radius_state_entry_t
+    uint32_t hash;
+    // Set through radius_api, no new requests are sent
+    uint8_t drained:1;
     ngx_str_t url;
-    struct sockaddr *sockaddr;
-    socklen_t socklen;
+    ngx_str_t host;
+    in_port_t port;
+    radius_peers_t *peers;
+    // Round-robin position of the next request among peers
+    ngx_uint_t peer_idx;
+    ngx_msec_t fail_timeout;
+    // Periodic re-resolution of the host, 0 if disabled
+    ngx_msec_t resolve_interval;
+    ngx_resolver_t *resolver;
+    ngx_msec_t resolver_timeout;
+    ngx_event_t resolve_ev;
     ngx_str_t secret;
     ngx_str_t nas_id;
     ngx_msec_t auth_timeout;
@@ -35,21 +287,411 @@ typedef struct radius_server_s {
     // Effectively, the number of concurrent requests that can be
     // processed without rescheduling. See ngx_http_auth_radius_handler.
     uint8_t req_queue_size;
+    // Adaptive concurrency, see update_radius_limit. Requests allowed
+    // in flight, up to req_queue_size, 0 if the option is off
+    ngx_uint_t limit;
+    uint8_t adaptive:1;
+    ngx_uint_t inflight;
+    // Replies since the limit was last raised
+    ngx_uint_t limit_acks;
+    // Replies to requests sent before the last cut don't cut again
+    ngx_msec_t limit_cut_at;
+    // Baseline RTT in microseconds, the minimum over the previous
+    // RADIUS_LIMIT_EPOCH replies
+    ngx_uint_t rtt_min;
+    ngx_uint_t rtt_min_next;
+    ngx_uint_t rtt_min_samples;
+    // Per class, see radius_qos_class, NULL if no classes are defined
+    radius_qos_t *qos;
+    ngx_uint_t nwaiting;
+    // Slots kept for the requests granted one, see grant_radius_slots
+    ngx_uint_t ngranted;
+    uint64_t vtime;
     radius_req_t *req_queue;
+    // Free slots are kept as a stack, so the most recently used sockets
+    // are reused first and the rest become idle.
     radius_req_t *req_free_list;
-    radius_req_t *req_last_list;
+    // Sockets are created on first use and closed after idle_timeout,
+    // keeping at least min_sockets open.
+    ngx_msec_t idle_timeout;
+    ngx_uint_t min_sockets;
+    ngx_uint_t nconns;
+    ngx_event_t idle_ev;
+    // Local addresses and source ports of the sockets, NULL and 0 for
+    // the ones of the system, see bind_radius_socket
+    ngx_array_t *bind; // [ngx_addr_t]
+    in_port_t source_port;
+    ngx_uint_t source_ports;
+    // Outlier detection, see eject_radius_outliers.
+    // EWMA of the reply time, in microseconds
+    ngx_uint_t rtt;
+    // EWMA of the failed requests, in 1/1000
+    ngx_uint_t errors;
+    ngx_uint_t samples;
+    ngx_msec_t ejected_until;
+    // Start of the slow start after an ejection, 0 if none
+    ngx_msec_t recovered_at;
+    // Errors caused by the received packets, see LOG_LIMITED
+    log_limit_t log_limit;
+    radius_transport_t transport;
+    // Explicit port in the URL, see RADIUS_TLS_DEFAULT_PORT
+    uint8_t has_port:1;
+    ngx_uint_t nstreams;
+    radius_stream_t *streams;
+    // Accounting, see radius_accounting. The port is the url one + 1
+    // by default, the channel is created by each worker
+    uint8_t accounting:1;
+    in_port_t acct_port;
+    radius_acct_chan_t *acct;
+#if (NGX_HTTP_SSL)
+    ngx_str_t tls_certificate;
+    ngx_str_t tls_certificate_key;
+    ngx_str_t tls_trusted_certificate;
+    ngx_flag_t tls_verify;
+    ngx_ssl_t *ssl;
+    // Resumed on reconnect
+    ngx_ssl_session_t *ssl_session;
+#endif
 } radius_server_t;
 
+// Listener of the Disconnect and CoA requests, see radius_dynauth_listen.
+// Every worker has its own socket bound to the address.
+typedef struct {
+    ngx_addr_t addr;
+    ngx_connection_t *conn;
+    ngx_uint_t received;
+    ngx_uint_t acked;
+    ngx_uint_t naked;
+    ngx_uint_t invalid;
+    ngx_uint_t evicted;
+    // Requests from unknown addresses
+    log_limit_t log_limit;
+} radius_dynauth_t;
+
+// Events of the timeline of a request, see radius_trace_names
+typedef enum {
+    RADIUS_TRACE_WAKE = 0,
+    RADIUS_TRACE_QUEUE,
+    RADIUS_TRACE_GRANT,
+    RADIUS_TRACE_RESCHEDULE,
+    RADIUS_TRACE_SLOT,
+    RADIUS_TRACE_ENQUEUE,
+    RADIUS_TRACE_SEND,
+    RADIUS_TRACE_TIMEOUT,
+    RADIUS_TRACE_RETRANSMIT,
+    RADIUS_TRACE_REPLY,
+    RADIUS_TRACE_PARSE,
+    RADIUS_TRACE_REFUSED,
+    RADIUS_TRACE_FAILOVER,
+    RADIUS_TRACE_L2,
+    RADIUS_TRACE_COMPLETE,
+    RADIUS_TRACE_ABORT
+} radius_trace_event_e;
+
+typedef struct {
+    // Since the start of the request, in milliseconds
+    uint32_t at;
+    uint8_t event;
+    // Server id, which starts at 1, 0 if none
+    uint8_t server;
+    // Identifier, -1 if no slot
+    int16_t ident;
+    // Event specific, see the RADIUS_TRACE call sites
+    int32_t arg;
+} radius_trace_event_t;
+
+// Timeline of a request, recorded as it goes and kept if slower than
+// the radius_slow_log threshold, see finish_radius_trace
+typedef struct {
+    ngx_msec_t start;
+    ngx_atomic_uint_t connection;
+    ngx_uint_t requests;
+    ngx_uint_t n;
+    ngx_uint_t dropped;
+    radius_trace_event_t events[RADIUS_TRACE_EVENTS];
+} radius_trace_t;
+
+// Ring of the slowest recent requests of a worker, see radius_slow_log
+typedef struct {
+    ngx_msec_t threshold;
+    ngx_uint_t size;
+    // Next entry to overwrite
+    ngx_uint_t next;
+    ngx_uint_t recorded;
+    radius_trace_t *ring;
+} radius_slow_log_t;
+
 typedef struct {
     ngx_array_t *servers; // [radius_server_t]
+    // Time given to requests in flight to complete
+    // once the worker is shutting down gracefully
+    ngx_msec_t shutdown_timeout;
+    ngx_event_t shutdown_ev;
+    // Runtime changes shared by the workers, see sync_radius_state
+    ngx_shm_zone_t *state;
+    ngx_atomic_uint_t state_generation;
+    ngx_pool_t *state_pool;
+    struct radius_state_entry_s *entries;
+    ngx_uint_t nentries;
+    ngx_array_t *caches; // [ngx_shm_zone_t *]
+    ngx_array_t *limits; // [ngx_shm_zone_t *]
+    ngx_array_t *classes; // [radius_class_t]
+    // NULL if no location has radius_accounting
+    radius_acct_queue_t *acct;
+    // NULL if there is no radius_dynauth_listen
+    radius_dynauth_t *dynauth;
+    // NULL if there is no radius_slow_log
+    radius_slow_log_t *slow_log;
+    // Requests to send, see send_radius_pkg
+    radius_req_t *encode[RADIUS_ENCODE_BATCH];
+    ngx_uint_t nencode;
+    ngx_event_t encode_ev;
 } ngx_http_auth_radius_main_conf_t;
 
+// Runtime change made through radius_api. Entries are keyed by the
+// server name hash and the address, an entry without an address
+// applies to the server itself.
+typedef struct radius_state_entry_s {
+    uint32_t server;
+    socklen_t socklen;
+    ngx_sockaddr_t sockaddr;
+    ngx_uint_t weight;
+    uint8_t drained:1;
+    uint8_t added:1;
+} radius_state_entry_t;
+
+typedef struct {
+    ngx_atomic_t generation;
+    ngx_uint_t nentries;
+    ngx_uint_t capacity;
+    radius_state_entry_t *entries;
+} radius_state_shctx_t;
+
+typedef struct {
+    radius_state_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} radius_state_zone_t;
+
 typedef enum {
     NONE,
     AUTH,
     HEALTH
 } radius_req_type_t;
 
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    // Least recently used nodes are at the tail
+    ngx_queue_t queue;
+    ngx_atomic_t passed;
+    ngx_atomic_t limited;
+} radius_limit_shctx_t;
+
+typedef struct {
+    u_char color;
+    u_char type;
+    u_short len;
+    ngx_queue_t queue;
+    ngx_msec_t last;
+    // Requests over the rate, in 1/1000 of a request
+    ngx_uint_t excess;
+    u_char data[1];
+} radius_limit_node_t;
+
+typedef struct {
+    radius_limit_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    // Requests per 1000 seconds
+    ngx_uint_t rate;
+    // Requests, in 1/1000 of a request
+    ngx_uint_t burst;
+} radius_limit_zone_t;
+
+typedef enum {
+    RADIUS_LIMIT_USER,
+    RADIUS_LIMIT_ADDR
+} radius_limit_key_t;
+
+typedef struct {
+    ngx_shm_zone_t *shm_zone;
+    radius_limit_key_t key;
+} radius_limit_t;
+
+// Two generations of a Bloom filter of rejected credentials. Lookups
+// check both, inserts go to the current one, which becomes the old one
+// when it's full or ttl old. The old one is cleared and reused.
+typedef struct {
+    ngx_atomic_t hits;
+    ngx_atomic_t rechecks;
+    ngx_atomic_t inserts;
+    u_char salt[16];
+    ngx_uint_t current;
+    ngx_uint_t count;
+    time_t started;
+    uintptr_t *bits[2];
+} radius_filter_shctx_t;
+
+typedef struct {
+    radius_filter_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    // Bits per generation
+    uint32_t nbits;
+    ngx_uint_t hashes;
+    ngx_uint_t capacity;
+    // False positive rate per generation, in 1/1000000
+    ngx_uint_t fp;
+    time_t ttl;
+} radius_filter_zone_t;
+
+typedef struct {
+    ngx_shm_zone_t *shm_zone;
+    time_t valid;
+    // Window before expiration when a hit triggers a background refresh
+    time_t refresh;
+    // Period after expiration an accept is still honoured
+    // if no server answers
+    time_t stale;
+} radius_cache_conf_t;
+
+typedef struct {
+    // Reply time over the mean of the other servers, in 1/10
+    ngx_uint_t latency;
+    // Failed requests, in 1/1000
+    ngx_uint_t errors;
+    ngx_msec_t time;
+    ngx_msec_t slow_start;
+} radius_outlier_conf_t;
+
+// Point of a server on the consistent hashing ring, see build_radius_ring
+typedef struct {
+    uint32_t hash;
+    uint8_t idx;
+} radius_ring_point_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    // Least recently used nodes are at the tail
+    ngx_queue_t queue;
+    // Nodes by user name, see evict_radius_cache_user
+    ngx_rbtree_t users;
+    ngx_rbtree_node_t users_sentinel;
+    u_char salt[16];
+    ngx_atomic_t hits;
+    ngx_atomic_t misses;
+    ngx_atomic_t stale;
+    ngx_atomic_t refreshes;
+    // Last save of the snapshot, see save_radius_cache_snapshot
+    time_t snapshot_at;
+    // The salt of a saved zone is derived from it and the snapshot key
+    u_char nonce[16];
+} radius_cache_shctx_t;
+
+// Snapshot of a cache zone, a header and the entries, most recently
+// used first. In the byte order of the host, it's for the same node.
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    u_char nonce[16];
+} radius_cache_snapshot_hdr_t;
+
+typedef struct {
+    u_char key[16];
+    uint32_t user;
+    uint32_t reserved;
+    int64_t expires;
+    int64_t stale_until;
+} radius_cache_snapshot_rec_t;
+
+// Only accepts are cached, keyed by a salted hash of the credentials
+typedef struct {
+    u_char color;
+    ngx_queue_t queue;
+    time_t expires;
+    time_t stale_until;
+    // Until when a background refresh is in flight, 0 if none
+    time_t refreshing;
+    // Keyed by a salted hash of the user name, see radius_cache_user
+    ngx_rbtree_node_t user_node;
+    u_char key[16];
+} radius_cache_node_t;
+
+// Lookup waiting for its reply, replies come in order
+typedef struct {
+    // NULL once answered or if the request is gone
+    struct ngx_http_auth_radius_ctx_s *ctx;
+    ngx_msec_t sent_at;
+} radius_cache_l2_lookup_t;
+
+// Second tier of a cache zone, shared by the nodes, see
+// check_radius_cache_l2. memcached text protocol over a connection per
+// worker: lookups are pipelined, stores don't wait for a reply.
+typedef struct {
+    ngx_addr_t addr;
+    // Same on every node, so they compute the same keys
+    ngx_str_t salt;
+    ngx_msec_t timeout;
+    ngx_connection_t *conn;
+    uint8_t connected:1;
+    // Values read for the oldest lookup: the entry, its expiry and
+    // revocation generation, and the one of the user
+    uint8_t found:1;
+    time_t expires;
+    uint32_t entry_gen;
+    uint32_t gen;
+    ngx_msec_t down_until;
+    // Deadline of the oldest lookup or of the connect
+    ngx_event_t timer;
+    radius_cache_l2_lookup_t lookups[RADIUS_CACHE_L2_PENDING];
+    ngx_uint_t head;
+    ngx_uint_t npending;
+    u_char out[RADIUS_CACHE_L2_OUT];
+    size_t out_len;
+    size_t out_sent;
+    u_char in[RADIUS_CACHE_L2_IN];
+    size_t in_len;
+    ngx_uint_t hits;
+    ngx_uint_t misses;
+    ngx_uint_t errors;
+    log_limit_t log_limit;
+} radius_cache_l2_t;
+
+typedef struct {
+    radius_cache_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    // NULL if the zone has no second tier
+    radius_cache_l2_t *l2;
+    // Empty if the zone isn't saved
+    ngx_str_t snapshot;
+    // Hash of the snapshot_key file, never saved
+    u_char snapshot_key[16];
+    time_t snapshot_interval;
+    ngx_event_t snapshot_ev;
+} radius_cache_zone_t;
+
+// Attribute of radius_attribute whose value is a variable, see
+// encode_radius_attrs. The constant attributes before it and its own
+// header are encoded at configuration time into head.
+typedef struct {
+    ngx_str_t head;
+    ngx_http_complex_value_t *value;
+    radius_attr_encode_pt encode;
+    size_t len_min;
+    size_t len_max;
+    // Length octets of the header, back from the value, and what they
+    // add to its length. Both are the same octet but for a
+    // Vendor-Specific attribute, so nothing depends on the kind.
+    uint8_t len_at[2];
+    uint8_t len_add[2];
+} radius_attr_op_t;
+
+// The last op has no value, only the trailing constant attributes
+typedef struct {
+    ngx_array_t ops; // [radius_attr_op_t]
+    // Encoded attributes at most
+    size_t size;
+} radius_attr_prog_t;
+
 typedef struct {
     radius_req_type_t type;
     union {
@@ -62,31 +704,119 @@ typedef struct {
         } health;
     };
     ngx_array_t *server_ptrs; // [radius_server_t *]
+    // Hash of the server names salting the reject filter fingerprints
+    uint32_t servers_hash;
+    // Consistent hashing of the user name over server_ptrs
+    ngx_flag_t affinity;
+    ngx_array_t *ring; // [radius_ring_point_t]
+    radius_outlier_conf_t *outlier;
+    ngx_array_t *limits; // [radius_limit_t]
+    ngx_uint_t limit_status;
+    ngx_shm_zone_t *reject_filter;
+    ngx_uint_t reject_recheck;
+    radius_cache_conf_t *cache;
+    // Index in the main conf classes
+    ngx_uint_t qos;
+    // Server the accounting records are sent to, NULL if off
+    radius_server_t *acct;
+    ngx_flag_t acct_start;
+    // Attributes added to the Access-Requests, see radius_attribute
+    radius_attr_prog_t *attrs;
 } ngx_http_auth_radius_loc_conf_t;
 
-typedef struct {
+typedef struct ngx_http_auth_radius_ctx_s {
     // Read-only
     radius_req_type_t type;
+    // NULL for background refreshes, see start_radius_refresh
+    ngx_http_request_t *r;
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    ngx_log_t *log;
+    // Own pool of background refreshes
+    ngx_pool_t *pool;
     ngx_str_t user;
     ngx_str_t passwd;
+    // Encoded radius_attribute of the location
+    ngx_str_t attrs;
     // Read-write
     uint8_t rs_idx;
+    // Order to try server_ptrs in, NULL for the configured one
+    uint8_t *rs_order;
+    // Position of the current peer in the server peers rotation
+    // that starts at peer_first
+    ngx_uint_t peer_first;
+    ngx_uint_t peer_tries;
     ngx_msec_t timeout;
     uint8_t retries;
     radius_req_t *req;
+    // Fingerprint of the credentials in the reject filter
+    u_char fingerprint[16];
+    // Key of the credentials in the cache
+    u_char cache_key[16];
+    uint8_t filtered:1;
+    uint8_t cached:1;
     uint8_t done:1;
     uint8_t accepted:1;
     uint8_t timedout:1;
     uint8_t connection_refused:1;
     uint8_t internal_error:1;
+    uint8_t shutdown:1;
+    // Waiting for a slot of qos_rs, or granted one, see wait_radius_slot
+    uint8_t qos_waiting:1;
+    uint8_t qos_granted:1;
+    uint8_t qos_cleanup:1;
+    radius_server_t *qos_rs;
+    ngx_queue_t qos_link;
+    uint64_t qos_finish;
+    ngx_msec_t qos_since;
+    // Accepted with radius_accounting, the Stop record is made at the
+    // log phase, see ngx_http_auth_radius_log_handler
+    uint8_t acct_started:1;
+    // Waiting for the second tier of the cache, or accepted from it
+    uint8_t l2_waiting:1;
+    uint8_t l2_hit:1;
+    uint8_t l2_cleanup:1;
+    // The second tier answered, with the revocation generation of the
+    // user and the expiry of the entry if found
+    uint8_t l2_answered:1;
+    uint32_t l2_gen;
+    time_t l2_expires;
+    radius_cache_l2_lookup_t *l2_lookup;
+    // NULL without radius_slow_log and for background refreshes
+    radius_trace_t *trace;
 } ngx_http_auth_radius_ctx_t;
 
+// Costs a test when the request isn't traced
+#define RADIUS_TRACE(ctx, event, rs, ident, arg)                      \
+    do {                                                              \
+        if ((ctx)->trace) {                                           \
+            record_radius_trace((ctx)->trace, event, rs, ident, arg); \
+        }                                                             \
+    } while (0)
+
+// Slots may be released already
+#define RADIUS_TRACE_REQ(req, event, arg)                            \
+    do {                                                             \
+        if ((req)->ctx && (req)->ctx->trace) {                       \
+            record_radius_trace((req)->ctx->trace, event, (req)->rs, \
+                                (req)->id, arg);                     \
+        }                                                            \
+    } while (0)
+
+static const char *radius_trace_names[] = {
+    "wake", "queue", "grant", "reschedule", "slot", "enqueue", "send",
+    "timeout", "retransmit", "reply", "parse", "refused", "failover",
+    "l2", "complete", "abort"
+};
+
 static ngx_int_t
 ngx_http_auth_radius_init(ngx_conf_t *cf);
 
 static void *
 ngx_http_auth_radius_create_main_conf(ngx_conf_t *cf);
 
+static char *
+ngx_http_auth_radius_init_main_conf(ngx_conf_t *cf, void *conf);
+
 static void *
 ngx_http_auth_radius_create_loc_conf(ngx_conf_t *cf);
 
@@ -105,6 +835,9 @@ ngx_http_auth_radius_set_radius_server(ngx_conf_t *cf,
                                        ngx_command_t *cmd,
                                        void *conf);
 
+static ngx_int_t
+init_radius_server_streams(ngx_conf_t *cf, radius_server_t *rs);
+
 static char *
 ngx_http_auth_radius_set_radius_servers(ngx_conf_t *cf,
                                         ngx_command_t *cmd,
@@ -120,6 +853,107 @@ ngx_http_auth_radius_set_radius_health(ngx_conf_t *cf,
                                        ngx_command_t *cmd,
                                        void *conf);
 
+static char *
+ngx_http_auth_radius_set_radius_limit_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_limit(ngx_conf_t *cf,
+                                      ngx_command_t *cmd,
+                                      void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_reject_filter_zone(ngx_conf_t *cf,
+                                                   ngx_command_t *cmd,
+                                                   void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_reject_filter(ngx_conf_t *cf,
+                                              ngx_command_t *cmd,
+                                              void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_cache_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_affinity(ngx_conf_t *cf,
+                                         ngx_command_t *cmd,
+                                         void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_state_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_api(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+
+static ngx_int_t
+build_radius_ring(ngx_conf_t *cf, ngx_http_auth_radius_loc_conf_t *lcf);
+
+static char *
+ngx_http_auth_radius_set_radius_outlier_ejection(ngx_conf_t *cf,
+                                                 ngx_command_t *cmd,
+                                                 void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_cache(ngx_conf_t *cf,
+                                      ngx_command_t *cmd,
+                                      void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_qos_class(ngx_conf_t *cf,
+                                          ngx_command_t *cmd,
+                                          void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_qos(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+
+static ngx_conf_num_bounds_t ngx_http_auth_radius_status_bounds = {
+    ngx_conf_check_num_bounds, 400, 599
+};
+
+// Tags of the shared zones, one per kind, so that ngx_shared_memory_add
+// rejects a zone of one kind used as another in any order
+static ngx_uint_t radius_limit_zone_tag;
+static ngx_uint_t radius_filter_zone_tag;
+static ngx_uint_t radius_cache_zone_tag;
+
+static char *
+ngx_http_auth_radius_set_radius_accounting_queue(ngx_conf_t *cf,
+                                                 ngx_command_t *cmd,
+                                                 void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_accounting(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf);
+
+static radius_acct_queue_t *
+get_radius_acct_queue(ngx_conf_t *cf, ngx_http_auth_radius_main_conf_t *mcf);
+
+static char *
+ngx_http_auth_radius_set_radius_attribute(ngx_conf_t *cf,
+                                          ngx_command_t *cmd,
+                                          void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_dynauth_listen(ngx_conf_t *cf,
+                                               ngx_command_t *cmd,
+                                               void *conf);
+
+static char *
+ngx_http_auth_radius_set_radius_slow_log(ngx_conf_t *cf,
+                                         ngx_command_t *cmd,
+                                         void *conf);
+
 static ngx_int_t
 ngx_http_auth_radius_init_servers(ngx_cycle_t *cycle);
 
@@ -135,6 +969,139 @@ static ngx_command_t ngx_http_auth_radius_commands[] = {
       0,
       NULL },
 
+    { ngx_string("radius_shutdown_timeout"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_auth_radius_main_conf_t, shutdown_timeout),
+      NULL },
+
+    { ngx_string("radius_limit_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE23,
+      ngx_http_auth_radius_set_radius_limit_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("radius_limit"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+      ngx_http_auth_radius_set_radius_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_limit_status"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_auth_radius_loc_conf_t, limit_status),
+      &ngx_http_auth_radius_status_bounds },
+
+    { ngx_string("radius_reject_filter_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+      ngx_http_auth_radius_set_radius_reject_filter_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("radius_reject_filter"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+      ngx_http_auth_radius_set_radius_reject_filter,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_cache_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_auth_radius_set_radius_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("radius_cache"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+      ngx_http_auth_radius_set_radius_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_affinity"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_auth_radius_set_radius_affinity,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_outlier_ejection"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+      ngx_http_auth_radius_set_radius_outlier_ejection,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_qos_class"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+      ngx_http_auth_radius_set_radius_qos_class,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_qos"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_auth_radius_set_radius_qos,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_dynauth_listen"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_http_auth_radius_set_radius_dynauth_listen,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_slow_log"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+      ngx_http_auth_radius_set_radius_slow_log,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_accounting_queue"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_auth_radius_set_radius_accounting_queue,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_accounting"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+      ngx_http_auth_radius_set_radius_accounting,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_attribute"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+      ngx_http_auth_radius_set_radius_attribute,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_state_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_http_auth_radius_set_radius_state_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("radius_api"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_auth_radius_set_radius_api,
+      0,
+      0,
+      NULL },
+
     { ngx_string("radius_servers"),
       NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
       ngx_http_auth_radius_set_radius_servers,
@@ -170,7 +1137,7 @@ static ngx_http_module_t ngx_http_auth_radius_module_ctx = {
     NULL,                                    /* preconfiguration */
     ngx_http_auth_radius_init,               /* postconfiguration */
     ngx_http_auth_radius_create_main_conf,   /* create main configuration */
-    NULL,                                    /* init main configuration */
+    ngx_http_auth_radius_init_main_conf,     /* init main configuration */
     NULL,                                    /* create server configuration */
     NULL,                                    /* merge server configuration */
     ngx_http_auth_radius_create_loc_conf,    /* create location configuration */
@@ -207,988 +1174,8673 @@ destroy_radius_servers(ngx_array_t* servers, ngx_log_t *log);
 static ngx_connection_t *
 create_radius_connection(struct sockaddr *sockaddr,
                          socklen_t socklen,
+                         radius_server_t *rs,
+                         ngx_uint_t slot,
                          ngx_log_t *log);
 
+static ngx_addr_t *
+select_radius_source(radius_server_t *rs, int family, ngx_uint_t slot);
+
+static ngx_int_t
+bind_radius_socket(radius_server_t *rs,
+                   ngx_socket_t s,
+                   int family,
+                   ngx_uint_t slot,
+                   ngx_uint_t fixed_port,
+                   ngx_log_t *log);
+
 static void
 close_radius_connection(ngx_connection_t *c);
 
+static radius_peer_t *
+select_radius_peer(radius_server_t *rs,
+                   ngx_http_auth_radius_ctx_t *ctx);
+
 static ngx_int_t
-select_radius_server(ngx_http_request_t *r,
-                     const ngx_array_t *server_ptrs,
-                     ngx_http_auth_radius_ctx_t *ctx);
+connect_radius_req(radius_req_t *req,
+                   radius_peers_t *peers,
+                   radius_peer_t *peer,
+                   ngx_log_t *log);
+
+static void
+mark_radius_peer_down(radius_req_t *req, ngx_log_t *log);
+
+static void
+complete_radius_req(radius_req_t *req);
 
 static ngx_int_t
-send_radius_request(ngx_http_request_t *r,
-                    ngx_http_auth_radius_ctx_t *ctx,
-                    radius_req_t *req);
+attach_radius_stream(radius_req_t *req,
+                     radius_peers_t *peers,
+                     radius_peer_t *peer,
+                     ngx_log_t *log);
 
 static ngx_int_t
-set_realm(ngx_http_request_t *r, const ngx_str_t *realm);
+open_radius_stream(radius_stream_t *stream,
+                   radius_peers_t *peers,
+                   radius_peer_t *peer,
+                   ngx_log_t *log);
 
-static radius_req_t *
-acquire_radius_req(radius_server_t* rs);
+static void
+close_radius_stream(radius_stream_t *stream);
 
 static void
-release_radius_req(radius_req_t *req);
+fail_radius_stream(radius_stream_t *stream,
+                   ngx_uint_t timedout,
+                   ngx_log_t *log);
 
-static int
-send_radius_pkg(radius_req_t *req,
-                const ngx_str_t *user,
-                const ngx_str_t *passwd,
-                ngx_msec_t timeout,
-                ngx_log_t *log);
-static int
-recv_radius_pkg(radius_req_t *req,
-                radius_server_t *rs,
-                ngx_log_t *log);
+static void
+queue_radius_stream(radius_stream_t *stream, radius_req_t *req);
 
 static ngx_int_t
-ngx_http_auth_radius_handler(ngx_http_request_t *r)
-{
-    ngx_log_t *log = r->connection->log;
+flush_radius_stream(radius_stream_t *stream);
 
-    ngx_http_auth_radius_loc_conf_t *lcf;
-    lcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_radius_module);
+static void
+radius_stream_connected(radius_stream_t *stream);
 
-    if (lcf->type == NONE) {
-        return NGX_DECLINED;
-    }
+static void
+radius_stream_write_handler(ngx_event_t *ev);
 
-    if (lcf->server_ptrs == NULL) {
-        LOG_ERR(log, 0, "no servers defined for location r: 0x%xl", r);
-        return NGX_HTTP_SERVICE_UNAVAILABLE;
-    }
+static void
+radius_stream_read_handler(ngx_event_t *ev);
 
-    ngx_http_auth_radius_ctx_t *ctx;
-    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_radius_module);
+static void
+radius_stream_timeout_handler(ngx_event_t *ev);
 
-    if (ctx == NULL) {
-        if (lcf->type == AUTH) {
-            // No Auth request sent yet
-            LOG_INFO(log, "started auth r: 0x%xl", r);
+static void
+dispatch_radius_stream_pkg(radius_stream_t *stream,
+                           const u_char *buf,
+                           size_t len,
+                           ngx_log_t *log);
 
-            // Parse credentials
-            ngx_int_t rc = ngx_http_auth_basic_user(r);
-            if (rc == NGX_ERROR) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            } else if (rc == NGX_DECLINED) {
-                return set_realm(r, &lcf->auth.realm);
-            }
-        } else {
-            // No Health request sent yet
-            LOG_INFO(log, "started health r: 0x%xl", r);
-        }
+#if (NGX_HTTP_SSL)
+static void
+radius_stream_handshake_handler(ngx_connection_t *c);
 
-        // Create and store context
-        ctx = ngx_pcalloc(r->pool, sizeof(*ctx));
-        if (ctx == NULL) {
-            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed r: 0x%xl", r);
+static void
+radius_stream_save_session(ngx_connection_t *c);
+#endif
+
+static void
+release_radius_peers(radius_peers_t *peers);
+
+static void
+close_radius_req(radius_req_t *req);
+
+static void
+radius_idle_handler(ngx_event_t *ev);
+
+static void
+start_radius_shutdown(ngx_log_t *log);
+
+static void
+radius_shutdown_handler(ngx_event_t *ev);
+
+static void
+radius_resolve_timer_handler(ngx_event_t *ev);
+
+static void
+radius_resolve_handler(ngx_resolver_ctx_t *ctx);
+
+static radius_peers_t *
+create_radius_peers(radius_server_t *rs,
+                    ngx_addr_t *addrs,
+                    ngx_uint_t naddrs,
+                    ngx_log_t *log);
+
+static ngx_uint_t
+pick_radius_peer(radius_server_t *rs, radius_peers_t *peers);
+
+static void
+sync_radius_state(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static ngx_int_t
+update_radius_state(ngx_http_auth_radius_main_conf_t *mcf,
+                    radius_state_entry_t *change,
+                    ngx_uint_t remove);
+
+static ngx_int_t
+init_radius_state_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static void
+flush_radius_cache(ngx_shm_zone_t *shm_zone);
+
+static ngx_int_t
+ngx_http_auth_radius_api_handler(ngx_http_request_t *r);
+
+static ngx_int_t
+send_radius_api_state(ngx_http_request_t *r,
+                      ngx_http_auth_radius_main_conf_t *mcf);
+
+static ngx_int_t
+select_radius_server(ngx_http_request_t *r,
+                     const ngx_array_t *server_ptrs,
+                     ngx_http_auth_radius_ctx_t *ctx);
+
+static ngx_int_t
+order_radius_servers(ngx_http_auth_radius_loc_conf_t *lcf,
+                     ngx_http_auth_radius_ctx_t *ctx,
+                     ngx_pool_t *pool);
+
+static radius_server_t *
+current_radius_server(const ngx_array_t *server_ptrs,
+                      ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+eject_radius_outliers(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+update_radius_server_stats(radius_req_t *req);
+
+static void
+update_radius_limit(radius_req_t *req, ngx_uint_t rtt);
+
+static void
+send_radius_request(ngx_http_auth_radius_ctx_t *ctx,
+                    radius_req_t *req);
+
+static ngx_int_t
+set_realm(ngx_http_request_t *r, const ngx_str_t *realm);
+
+static ngx_int_t
+check_radius_limits(ngx_http_request_t *r,
+                    ngx_http_auth_radius_loc_conf_t *lcf);
+
+static ngx_int_t
+lookup_radius_limit(radius_limit_zone_t *lz,
+                    radius_limit_key_t type,
+                    const ngx_str_t *key);
+
+static void
+expire_radius_limit(radius_limit_zone_t *lz, ngx_uint_t n);
+
+static ngx_int_t
+init_radius_limit_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static void
+radius_limit_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel);
+
+static ngx_int_t
+check_radius_reject_filter(ngx_http_request_t *r,
+                           ngx_http_auth_radius_loc_conf_t *lcf,
+                           ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+insert_radius_reject_filter(ngx_http_auth_radius_loc_conf_t *lcf,
+                            ngx_http_auth_radius_ctx_t *ctx);
+
+static ngx_int_t
+init_radius_filter_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static ngx_int_t
+check_radius_cache(ngx_http_auth_radius_loc_conf_t *lcf,
+                   ngx_http_auth_radius_ctx_t *ctx);
+
+static ngx_int_t
+check_radius_cache_stale(ngx_http_auth_radius_loc_conf_t *lcf,
+                         ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+update_radius_cache(ngx_http_auth_radius_loc_conf_t *lcf,
+                    ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+start_radius_refresh(ngx_http_auth_radius_loc_conf_t *lcf,
+                     ngx_http_auth_radius_ctx_t *rctx);
+
+static void
+finish_radius_refresh(ngx_http_auth_radius_ctx_t *ctx);
+
+static ngx_int_t
+init_radius_cache_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static void
+radius_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel);
+
+static radius_req_t *
+acquire_radius_req(radius_server_t* rs);
+
+static ngx_int_t
+acquire_radius_slot(radius_server_t *rs,
+                    ngx_http_auth_radius_ctx_t *ctx,
+                    radius_req_t **reqp);
+
+static ngx_uint_t
+radius_slots_available(radius_server_t *rs);
+
+static void
+grant_radius_slots(radius_server_t *rs);
+
+static void
+radius_qos_cleanup(void *data);
+
+static void
+release_radius_req(radius_req_t *req);
+
+static void
+send_radius_pkg(radius_req_t *req,
+                ngx_msec_t timeout,
+                ngx_log_t *log);
+
+static void
+radius_encode_handler(ngx_event_t *ev);
+
+static void
+flush_radius_pkgs(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static void
+transmit_radius_pkg(radius_req_t *req, size_t len, ngx_log_t *log);
+
+static void
+fail_radius_send(radius_req_t *req, ngx_err_t err, ngx_log_t *log);
+
+static int
+recv_radius_pkg(radius_req_t *req,
+                radius_server_t *rs,
+                ngx_log_t *log);
+
+static int
+parse_radius_reply(radius_req_t *req,
+                   const uint8_t *buf,
+                   size_t len,
+                   ngx_log_t *log);
+
+static int
+check_radius_reply(radius_req_t *req,
+                   int rc,
+                   size_t len,
+                   ngx_log_t *log);
+
+static ngx_err_t
+recv_radius_errqueue(radius_req_t *req, ngx_log_t *log);
+
+static void
+handle_radius_reply(radius_req_t *req,
+                    int rc,
+                    ngx_err_t err,
+                    ngx_log_t *log);
+
+static ngx_int_t
+encode_radius_attrs(ngx_http_request_t *r,
+                    radius_attr_prog_t *prog,
+                    ngx_pool_t *pool,
+                    ngx_str_t *out);
+
+static ngx_int_t
+ngx_http_auth_radius_log_handler(ngx_http_request_t *r);
+
+static void
+start_radius_acct(ngx_http_request_t *r, ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+record_radius_acct(ngx_http_request_t *r,
+                   ngx_http_auth_radius_ctx_t *ctx,
+                   uint8_t status);
+
+static void
+push_radius_acct(radius_acct_queue_t *q,
+                 const radius_acct_rec_t *rec,
+                 ngx_log_t *log);
+
+static void
+spill_radius_acct(radius_acct_queue_t *q,
+                  const radius_acct_rec_t *recs,
+                  ngx_uint_t n,
+                  ngx_log_t *log);
+
+static void
+replay_radius_acct(radius_acct_queue_t *q, ngx_log_t *log);
+
+static void
+reset_radius_acct_spill(radius_acct_queue_t *q, ngx_log_t *log);
+
+static void
+radius_acct_handler(ngx_event_t *ev);
+
+static void
+send_radius_acct(radius_acct_slot_t *slot, ngx_log_t *log);
+
+static ngx_int_t
+connect_radius_acct(radius_acct_chan_t *chan, ngx_log_t *log);
+
+static void
+release_radius_acct_slot(radius_acct_slot_t *slot);
+
+static void
+radius_acct_read_handler(ngx_event_t *ev);
+
+static void
+radius_acct_timeout_handler(ngx_event_t *ev);
+
+static ngx_int_t
+init_radius_acct(ngx_http_auth_radius_main_conf_t *mcf, ngx_cycle_t *cycle);
+
+static void
+open_radius_acct_spill(radius_acct_queue_t *q, ngx_cycle_t *cycle);
+
+static void
+destroy_radius_acct(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static ngx_int_t
+init_radius_dynauth(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static void
+destroy_radius_dynauth(ngx_http_auth_radius_main_conf_t *mcf);
+
+static void
+radius_dynauth_read_handler(ngx_event_t *ev);
+
+static radius_server_t *
+find_radius_dynauth_client(ngx_http_auth_radius_main_conf_t *mcf,
+                           struct sockaddr *sockaddr,
+                           socklen_t socklen,
+                           ngx_uint_t *next);
+
+static ngx_uint_t
+evict_radius_cache_user(ngx_shm_zone_t *shm_zone, const ngx_str_t *user);
+
+static ngx_int_t
+check_radius_cache_l2(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+store_radius_cache_l2(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx);
+
+static void
+radius_cache_l2_key(radius_cache_l2_t *l2,
+                    ngx_http_auth_radius_loc_conf_t *lcf,
+                    ngx_http_auth_radius_ctx_t *ctx,
+                    u_char *key);
+
+static void
+radius_cache_l2_user_key(radius_cache_l2_t *l2,
+                         const ngx_str_t *user,
+                         u_char *key);
+
+static void
+revoke_radius_cache_l2(radius_cache_l2_t *l2,
+                       const ngx_str_t *user,
+                       ngx_log_t *log);
+
+static u_char *
+reserve_radius_cache_l2(radius_cache_l2_t *l2, size_t len, ngx_log_t *log);
+
+static ngx_int_t
+open_radius_cache_l2(radius_cache_l2_t *l2, ngx_log_t *log);
+
+static void
+close_radius_cache_l2(radius_cache_l2_t *l2);
+
+static void
+fail_radius_cache_l2(radius_cache_l2_t *l2, ngx_log_t *log);
+
+static void
+complete_radius_cache_l2(radius_cache_l2_t *l2, ngx_uint_t answered);
+
+static void
+arm_radius_cache_l2_timer(radius_cache_l2_t *l2);
+
+static void
+radius_cache_l2_write_handler(ngx_event_t *ev);
+
+static void
+radius_cache_l2_read_handler(ngx_event_t *ev);
+
+static ngx_int_t
+parse_radius_cache_l2(radius_cache_l2_t *l2);
+
+static ngx_int_t
+parse_radius_cache_l2_value(radius_cache_l2_t *l2,
+                            u_char *key,
+                            u_char *data,
+                            size_t len);
+
+static void
+radius_cache_l2_timeout_handler(ngx_event_t *ev);
+
+static void
+radius_cache_l2_cleanup(void *data);
+
+static void
+init_radius_caches(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static void
+destroy_radius_caches(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log);
+
+static void
+radius_cache_snapshot_handler(ngx_event_t *ev);
+
+static void
+save_radius_cache_snapshot(ngx_shm_zone_t *shm_zone,
+                           time_t min_age,
+                           ngx_log_t *log);
+
+static void
+load_radius_cache_snapshot(ngx_shm_zone_t *shm_zone);
+
+static ngx_int_t
+read_radius_cache_snapshot_key(ngx_conf_t *cf,
+                               ngx_str_t *path,
+                               u_char *key);
+
+static void
+derive_radius_cache_salt(radius_cache_zone_t *cz);
+
+static ngx_int_t
+start_radius_trace(ngx_http_request_t *r,
+                   ngx_http_auth_radius_ctx_t *ctx,
+                   radius_slow_log_t *sl);
+
+static void
+record_radius_trace(radius_trace_t *trace,
+                    ngx_uint_t event,
+                    radius_server_t *rs,
+                    ngx_int_t ident,
+                    ngx_int_t arg);
+
+static void
+finish_radius_trace(void *data);
+
+static ngx_int_t
+send_radius_slow_log(ngx_http_request_t *r,
+                     ngx_http_auth_radius_main_conf_t *mcf);
+
+static ngx_int_t
+ngx_http_auth_radius_handler(ngx_http_request_t *r)
+{
+    ngx_log_t *log = r->connection->log;
+
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_radius_module);
+
+    if (lcf->type == NONE) {
+        return NGX_DECLINED;
+    }
+
+    if (lcf->server_ptrs == NULL) {
+        LOG_ERR(log, 0, "no servers defined for location r: 0x%xl", r);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_auth_radius_module);
+    sync_radius_state(mcf, log);
+
+    ngx_http_auth_radius_ctx_t *ctx;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_radius_module);
+
+    if (ctx == NULL && ngx_exiting) {
+        // Let the client retry on a new worker
+        LOG_INFO(log, "shutting down, declined r: 0x%xl", r);
+        start_radius_shutdown(log);
+        r->keepalive = 0;
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (ctx) {
+        RADIUS_TRACE(ctx, RADIUS_TRACE_WAKE, NULL, -1, ctx->done);
+    }
+
+    if (ctx == NULL) {
+        if (lcf->type == AUTH) {
+            // No Auth request sent yet
+            LOG_INFO(log, "started auth r: 0x%xl", r);
+
+            // Parse credentials
+            ngx_int_t rc = ngx_http_auth_basic_user(r);
+            if (rc == NGX_ERROR) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            } else if (rc == NGX_DECLINED) {
+                return set_realm(r, &lcf->auth.realm);
+            }
+
+            // Can't be sent, no server would accept them either
+            if (r->headers_in.user.len > RADIUS_USER_MAX
+                || r->headers_in.passwd.len > RADIUS_PASSWD_MAX)
+            {
+                LOG_INFO(log, "credentials too long r: 0x%xl", r);
+                return set_realm(r, &lcf->auth.realm);
+            }
+
+            // Before any slot is acquired
+            rc = check_radius_limits(r, lcf);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        } else {
+            // No Health request sent yet
+            LOG_INFO(log, "started health r: 0x%xl", r);
+        }
+
+        // Create and store context
+        ctx = ngx_pcalloc(r->pool, sizeof(*ctx));
+        if (ctx == NULL) {
+            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed r: 0x%xl", r);
+            return NGX_ERROR;
+        }
+
+        ctx->type = lcf->type;
+        ctx->r = r;
+        ctx->lcf = lcf;
+        ctx->log = log;
+        if (ctx->type == AUTH) {
+            ctx->user = r->headers_in.user;
+            ctx->passwd = r->headers_in.passwd;
+        } else {
+            ctx->user = lcf->health.user;
+            ctx->passwd = lcf->health.passwd;
+        }
+
+        if ((ctx->type == AUTH && lcf->ring) || lcf->outlier) {
+            if (order_radius_servers(lcf, ctx, r->pool) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ctx->type == AUTH && lcf->cache) {
+            if (check_radius_cache(lcf, ctx) == NGX_OK) {
+                LOG_INFO(log, "accepted from cache r: 0x%xl", r);
+                start_radius_acct(r, ctx);
+                return NGX_OK;
+            }
+        }
+
+        if (ctx->type == AUTH && lcf->reject_filter) {
+            if (check_radius_reject_filter(r, lcf, ctx) == NGX_DECLINED) {
+                LOG_INFO(log, "rejected by filter r: 0x%xl", r);
+                return set_realm(r, &lcf->auth.realm);
+            }
+        }
+
+        if (lcf->attrs
+            && encode_radius_attrs(r, lcf->attrs, r->pool,
+                                   &ctx->attrs) != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        // Cache hits and filtered requests aren't traced
+        if (mcf->slow_log
+            && start_radius_trace(r, ctx, mcf->slow_log) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_auth_radius_module);
+
+        if (ctx->type == AUTH && lcf->cache
+            && check_radius_cache_l2(lcf, ctx) == NGX_AGAIN)
+        {
+            return NGX_AGAIN;
+        }
+    }
+
+    if (ctx->l2_waiting) {
+        return NGX_AGAIN;
+    }
+
+    if (ctx->done) {
+        if (ctx->internal_error) {
+            LOG_INFO(log, "internal error r: 0x%xl", r);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (ctx->shutdown) {
+            LOG_INFO(log, "shutdown timedout r: 0x%xl", r);
+            r->keepalive = 0;
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        if (ctx->timedout || ctx->connection_refused) {
+            if (ctx->timedout) {
+                LOG_INFO(log, "timedout r: 0x%xl", r);
+            } else {
+                LOG_INFO(log, "connection refused r: 0x%xl", r);
+            }
+            // Try the rest of the server addresses first
+            radius_server_t *rs = current_radius_server(lcf->server_ptrs, ctx);
+            RADIUS_PROBE(failover, r, NULL, rs, -1, 0, ctx->timedout);
+            RADIUS_TRACE(ctx, RADIUS_TRACE_FAILOVER, rs, -1, ctx->timedout);
+            ctx->peer_tries++;
+            if (ctx->peer_tries < rs->peers->nelts) {
+                LOG_INFO(log, "try next server address r: 0x%xl", r);
+                return select_radius_server(r, lcf->server_ptrs, ctx);
+            }
+            ctx->peer_tries = 0;
+            ctx->rs_idx++;
+            if (ctx->rs_idx >= lcf->server_ptrs->nelts) {
+                LOG_INFO(log, "no more servers r: 0x%xl", r);
+                if (ctx->cached && check_radius_cache_stale(lcf, ctx) == NGX_OK) {
+                    LOG_NOTICE(log, 0, "accepted from stale cache r: 0x%xl", r);
+                    start_radius_acct(r, ctx);
+                    return NGX_OK;
+                }
+                return NGX_HTTP_SERVICE_UNAVAILABLE;
+            } else {
+                LOG_INFO(log, "try next server r: 0x%xl", r);
+                return select_radius_server(r, lcf->server_ptrs, ctx);
+            }
+        }
+
+        if (lcf->type == HEALTH) {
+            // Whatever accepted or rejected
+            LOG_INFO(log, "healthy r: 0x%xl", r);
+            return NGX_OK;
+        }
+
+        if (!ctx->accepted) {
+            LOG_INFO(log, "rejected r: 0x%xl", r);
+            if (ctx->filtered) {
+                insert_radius_reject_filter(lcf, ctx);
+            }
+            if (ctx->cached) {
+                update_radius_cache(lcf, ctx);
+            }
+            return set_realm(r, &lcf->auth.realm);
+        }
+
+        if (ctx->cached) {
+            update_radius_cache(lcf, ctx);
+        }
+
+        if (ctx->l2_hit) {
+            LOG_INFO(log, "accepted from l2 cache r: 0x%xl", r);
+        } else {
+            LOG_INFO(log, "accepted r: 0x%xl", r);
+        }
+        start_radius_acct(r, ctx);
+        return NGX_OK;
+    }
+
+    return select_radius_server(r, lcf->server_ptrs, ctx);
+}
+
+// Runs the program of the radius_attribute of a location. The
+// attributes whose value is empty or invalid are left out.
+static ngx_int_t
+encode_radius_attrs(ngx_http_request_t *r,
+                    radius_attr_prog_t *prog,
+                    ngx_pool_t *pool,
+                    ngx_str_t *out)
+{
+    u_char *p = ngx_pnalloc(pool, prog->size);
+    if (p == NULL) {
+        LOG_ERR(r->connection->log, ngx_errno, "ngx_pnalloc failed");
+        return NGX_ERROR;
+    }
+    out->data = p;
+
+    radius_attr_op_t *op;
+    for (op = prog->ops.elts; ; op++) {
+        p = ngx_cpymem(p, op->head.data, op->head.len);
+        if (op->value == NULL) {
+            break;
+        }
+
+        ngx_str_t value;
+        if (ngx_http_complex_value(r, op->value, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ssize_t n = op->encode(p, &value, op->len_max);
+        if (n < (ssize_t) op->len_min) {
+            LOG_DEBUG(r->connection->log,
+                      "attribute value \"%V\" left out r: 0x%xl",
+                      &value, r);
+            // The header ends the head
+            p -= op->len_at[1] + 1;
+            continue;
+        }
+
+        p[-op->len_at[0]] = n + op->len_add[0];
+        p[-op->len_at[1]] = n + op->len_add[1];
+        p += n;
+    }
+
+    out->len = p - out->data;
+    return NGX_OK;
+}
+
+// The timeline is recorded in the request pool, it's only looked at
+// once the request is finalized, see finish_radius_trace
+static ngx_int_t
+start_radius_trace(ngx_http_request_t *r,
+                   ngx_http_auth_radius_ctx_t *ctx,
+                   radius_slow_log_t *sl)
+{
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    radius_trace_t *trace = ngx_palloc(r->pool, sizeof(radius_trace_t));
+    if (trace == NULL) {
+        LOG_ERR(ctx->log, ngx_errno, "ngx_palloc failed r: 0x%xl", r);
+        return NGX_ERROR;
+    }
+
+    trace->start = ngx_current_msec;
+    trace->connection = r->connection->number;
+    trace->requests = r->connection->requests;
+    trace->n = 0;
+    trace->dropped = 0;
+    ctx->trace = trace;
+
+    cln->handler = finish_radius_trace;
+    cln->data = ctx;
+
+    return NGX_OK;
+}
+
+static void
+record_radius_trace(radius_trace_t *trace,
+                    ngx_uint_t event,
+                    radius_server_t *rs,
+                    ngx_int_t ident,
+                    ngx_int_t arg)
+{
+    radius_trace_event_t *e;
+    if (trace->n == RADIUS_TRACE_EVENTS) {
+        // The end of the timeline is kept
+        trace->dropped++;
+        e = &trace->events[RADIUS_TRACE_EVENTS - 1];
+    } else {
+        e = &trace->events[trace->n++];
+    }
+
+    e->at = ngx_current_msec - trace->start;
+    e->event = event;
+    e->server = rs ? rs->id : 0;
+    e->ident = ident;
+    e->arg = arg;
+}
+
+// Logs the timeline of a request slower than the threshold and keeps
+// it in the ring of the worker, see radius_api "?slow". The time is
+// the one of the last event, the request may be finalized much later.
+static void
+finish_radius_trace(void *data)
+{
+    ngx_http_auth_radius_ctx_t *ctx = data;
+    radius_trace_t *trace = ctx->trace;
+
+    if (!ctx->done) {
+        // Finalized before the auth completed
+        record_radius_trace(trace, RADIUS_TRACE_ABORT, NULL, -1, 0);
+    }
+    if (trace->n == 0) {
+        return;
+    }
+
+    ngx_msec_t elapsed = trace->events[trace->n - 1].at;
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+    radius_slow_log_t *sl = mcf->slow_log;
+    if (elapsed < sl->threshold) {
+        return;
+    }
+
+    sl->ring[sl->next] = *trace;
+    sl->next = (sl->next + 1) % sl->size;
+    sl->recorded++;
+
+    u_char buf[NGX_MAX_ERROR_STR];
+    u_char *p = buf, *last = buf + sizeof(buf);
+    radius_server_t *rss = mcf->servers->elts;
+    ngx_uint_t i;
+    for (i = 0; i < trace->n; i++) {
+        radius_trace_event_t *e = &trace->events[i];
+        p = ngx_slprintf(p, last, "%s+%uDms %s", i ? ", " : "",
+                         e->at, radius_trace_names[e->event]);
+        if (e->server) {
+            p = ngx_slprintf(p, last, " %V", &rss[e->server - 1].name);
+        }
+        if (e->ident >= 0) {
+            p = ngx_slprintf(p, last, "#%d", (int) e->ident);
+        }
+        p = ngx_slprintf(p, last, " (%D)", e->arg);
+    }
+
+    LOG_WARN(ctx->log, 0, "slow auth %Mms, connection: %uA, request: %ui, "
+             "dropped events: %ui, timeline: %*s",
+             elapsed, trace->connection, trace->requests, trace->dropped,
+             (size_t) (p - buf), buf);
+}
+
+static ngx_int_t
+ngx_http_auth_radius_init(ngx_conf_t *cf)
+{
+    ngx_http_core_main_conf_t *cmcf;
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    ngx_http_handler_pt *h;
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_auth_radius_handler;
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+
+    if (mcf->acct) {
+        h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+        if (h == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+            return NGX_ERROR;
+        }
+
+        *h = ngx_http_auth_radius_log_handler;
+    }
+
+    if (mcf->servers == NULL) {
+        return NGX_OK;
+    }
+
+    // The resolver is only known after the http block is merged
+    ngx_http_core_loc_conf_t *clcf;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    size_t i;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        radius_server_t *rs = &rss[i];
+        if (rs->resolve_interval == 0) {
+            continue;
+        }
+
+        if (clcf->resolver == NULL || clcf->resolver->connections.nelts == 0) {
+            CONF_LOG_EMERG(cf, 0,
+                           "no resolver defined to resolve \"%V\"",
+                           &rs->host);
+            return NGX_ERROR;
+        }
+
+        rs->resolver = clcf->resolver;
+        // The http level itself is never merged, the default is the
+        // one of ngx_http_core_module then
+        rs->resolver_timeout = clcf->resolver_timeout == NGX_CONF_UNSET_MSEC
+                               ? 30000 : clcf->resolver_timeout;
+    }
+
+    return NGX_OK;
+}
+
+static void *
+ngx_http_auth_radius_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_radius_main_conf_t));
+    if (mcf == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->shutdown_timeout = NGX_CONF_UNSET_MSEC;
+
+    return mcf;
+}
+
+static char *
+ngx_http_auth_radius_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+
+    if (mcf->shutdown_timeout == NGX_CONF_UNSET_MSEC) {
+        mcf->shutdown_timeout = 10000;
+    }
+
+    // Defaults of radius_accounting_queue
+    radius_acct_queue_t *q = mcf->acct;
+    if (q && q->size == NGX_CONF_UNSET_UINT) {
+        q->size = 1024;
+    }
+    if (q && q->overflow == NGX_CONF_UNSET_UINT) {
+        q->overflow = RADIUS_ACCT_DROP_OLDEST;
+    }
+    if (q && q->spill_max == NGX_CONF_UNSET) {
+        q->spill_max = 64 * 1024 * 1024;
+    }
+    if (q && q->retries == NGX_CONF_UNSET_UINT) {
+        q->retries = 3;
+    }
+    if (q && q->timeout == NGX_CONF_UNSET_MSEC) {
+        q->timeout = 2000;
+    }
+    if (q && q->window == NGX_CONF_UNSET_UINT) {
+        q->window = RADIUS_ACCT_WINDOW;
+    }
+
+    if (mcf->classes == NULL || mcf->servers == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    size_t i, j;
+    radius_class_t *cls = mcf->classes->elts;
+    for (i = 0; i < mcf->classes->nelts; i++) {
+        if (!cls[i].defined) {
+            CONF_LOG_EMERG(cf, 0, "unknown radius_qos_class \"%V\"",
+                           &cls[i].name);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    // The waiting requests of the servers, by class
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        rss[i].qos = ngx_pcalloc(cf->pool,
+                                 mcf->classes->nelts * sizeof(radius_qos_t));
+        if (rss[i].qos == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+            return NGX_CONF_ERROR;
+        }
+        for (j = 0; j < mcf->classes->nelts; j++) {
+            ngx_queue_init(&rss[i].qos[j].waiting);
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static void *
+ngx_http_auth_radius_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    lcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_radius_loc_conf_t));
+    if (lcf == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->type = NONE;
+    lcf->limits = NGX_CONF_UNSET_PTR;
+    lcf->limit_status = NGX_CONF_UNSET_UINT;
+    lcf->reject_filter = NGX_CONF_UNSET_PTR;
+    lcf->reject_recheck = NGX_CONF_UNSET_UINT;
+    lcf->cache = NGX_CONF_UNSET_PTR;
+    lcf->affinity = NGX_CONF_UNSET;
+    lcf->outlier = NGX_CONF_UNSET_PTR;
+    lcf->qos = NGX_CONF_UNSET_UINT;
+    lcf->acct = NGX_CONF_UNSET_PTR;
+    lcf->acct_start = NGX_CONF_UNSET;
+    lcf->attrs = NGX_CONF_UNSET_PTR;
+    return lcf;
+}
+
+static char*
+ngx_http_auth_radius_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_auth_radius_loc_conf_t *prev = parent;
+    ngx_http_auth_radius_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->limits, prev->limits, NULL);
+    ngx_conf_merge_uint_value(conf->limit_status, prev->limit_status,
+                              NGX_HTTP_TOO_MANY_REQUESTS);
+    ngx_conf_merge_ptr_value(conf->reject_filter, prev->reject_filter, NULL);
+    ngx_conf_merge_uint_value(conf->reject_recheck, prev->reject_recheck, 0);
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_value(conf->affinity, prev->affinity, 0);
+    ngx_conf_merge_ptr_value(conf->outlier, prev->outlier, NULL);
+    ngx_conf_merge_uint_value(conf->qos, prev->qos, 0);
+    ngx_conf_merge_ptr_value(conf->acct, prev->acct, NULL);
+    ngx_conf_merge_value(conf->acct_start, prev->acct_start, 0);
+    ngx_conf_merge_ptr_value(conf->attrs, prev->attrs, NULL);
+
+    if ((conf->affinity || conf->outlier)
+        && conf->server_ptrs && conf->server_ptrs->nelts > 255)
+    {
+        CONF_LOG_EMERG(cf, 0, "too many radius servers for "
+                       "\"radius_affinity\" or \"radius_outlier_ejection\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->affinity && conf->server_ptrs && conf->server_ptrs->nelts > 1) {
+        if (build_radius_ring(cf, conf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_server_block(ngx_conf_t *cf,
+                                             ngx_command_t *cmd,
+                                             void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_str_t name = value[1];
+
+    if (ngx_strlen(name.data) == 0) {
+        CONF_LOG_EMERG(cf, 0, "missing server name in radius_server");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+
+    if (mcf->servers == NULL) {
+        mcf->servers = ngx_array_create(cf->pool, 5, sizeof(radius_server_t));
+        if (mcf->servers == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    radius_server_t *rs = ngx_array_push(mcf->servers);
+    if (rs == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(rs, sizeof(*rs));
+    rs->id = mcf->servers->nelts;
+    rs->name = name;
+    rs->auth_timeout = 5000;
+    rs->auth_retries = 3;
+    rs->health_timeout = 5000;
+    rs->health_retries = 1;
+    rs->req_queue_size = 10;
+    rs->fail_timeout = 10000;
+    rs->idle_timeout = 60000;
+    rs->min_sockets = 1;
+    rs->transport = RADIUS_TRANSPORT_UDP;
+    rs->nstreams = 1;
+#if (NGX_HTTP_SSL)
+    rs->tls_verify = 1;
+#endif
+
+    // Set ngx_http_auth_radius_set_radius_server as a handler
+    // for each value in the block
+    ngx_conf_t save = *cf;
+    cf->handler = ngx_http_auth_radius_set_radius_server;
+    cf->handler_conf = conf;
+    char *rc = ngx_conf_parse(cf, NULL);
+    *cf = save;
+
+    if (rc != NGX_CONF_OK) {
+        return rc;
+    }
+
+    if (rs->peers == NULL) {
+        CONF_LOG_EMERG(cf, 0, "missing \"url\" in radius_server \"%V\"",
+                       &rs->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rs->hash = ngx_crc32_short(rs->name.data, rs->name.len);
+
+    if (rs->acct_port == 0) {
+        // 1813 for the default port, see RFC 2866
+        rs->acct_port = rs->port + 1;
+    }
+
+    if (rs->resolve_interval) {
+        ngx_addr_t addr;
+        if (rs->host.data[0] == '['
+            || ngx_parse_addr(cf->pool, &addr,
+                              rs->host.data, rs->host.len) == NGX_OK)
+        {
+            // Nothing to re-resolve for an address literal
+            rs->resolve_interval = 0;
+        }
+    }
+
+    if (rs->source_ports && rs->transport != RADIUS_TRANSPORT_UDP) {
+        CONF_LOG_EMERG(cf, 0, "\"source_ports\" requires \"transport udp\" "
+                       "in radius_server \"%V\"", &rs->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rs->transport != RADIUS_TRANSPORT_UDP) {
+        if (init_radius_server_streams(cf, rs) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    rs->req_queue = ngx_pcalloc(cf->pool,
+                                rs->req_queue_size * sizeof(radius_req_t));
+    if (rs->req_queue == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    size_t i;
+    rs->req_queue[0].rs = rs;
+    for (i = 1; i < rs->req_queue_size; ++i) {
+        radius_req_t *req = &rs->req_queue[i];
+        req->id = i;
+        req->rs = rs;
+        rs->req_queue[i - 1].next = req;
+    }
+    rs->req_free_list = &rs->req_queue[0];
+
+    if (rs->adaptive) {
+        // Half way, the server may already be overloaded
+        rs->limit = (rs->req_queue_size + 1) / 2;
+        rs->rtt_min = NGX_MAX_UINT32_VALUE;
+    }
+
+    return rc;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_affinity(ngx_conf_t *cf,
+                                         ngx_command_t *cmd,
+                                         void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->affinity != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "user") == 0) {
+        lcf->affinity = 1;
+    } else if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->affinity = 0;
+    } else {
+        CONF_LOG_EMERG(cf, 0, "invalid value \"%V\", "
+                       "expected \"user\" or \"off\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_outlier_ejection(ngx_conf_t *cf,
+                                                 ngx_command_t *cmd,
+                                                 void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->outlier != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->outlier = NULL;
+        return NGX_CONF_OK;
+    }
+
+    radius_outlier_conf_t *oc = ngx_pcalloc(cf->pool, sizeof(radius_outlier_conf_t));
+    if (oc == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+    oc->latency = 30;
+    oc->errors = 500;
+    oc->time = 30000;
+    oc->slow_start = 0;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        ngx_str_t s;
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
+            ngx_int_t n = ngx_atofp(value[i].data + 8, value[i].len - 8, 1);
+            if (n == NGX_ERROR || n <= 10) {
+                CONF_LOG_EMERG(cf, 0, "invalid latency \"%V\", "
+                               "expected a factor over 1", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            oc->latency = n;
+        } else if (ngx_strncmp(value[i].data, "errors=", 7) == 0) {
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+            ngx_int_t n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                CONF_LOG_EMERG(cf, 0, "invalid errors \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            oc->errors = n * 10;
+        } else if (ngx_strncmp(value[i].data, "time=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            oc->time = n;
+        } else if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+            s.data = value[i].data + 11;
+            s.len = value[i].len - 11;
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) {
+                CONF_LOG_EMERG(cf, 0, "invalid slow_start \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            oc->slow_start = n;
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    lcf->outlier = oc;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_state_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (mcf->state) {
+        return "is duplicate";
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t name;
+    name.data = value[1].data + 5;
+    u_char *p = (u_char *) ngx_strchr(name.data, ':');
+    if (p == NULL) {
+        CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    name.len = p - name.data;
+
+    ngx_str_t s;
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+    ssize_t size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    radius_state_zone_t *sz = ngx_pcalloc(cf->pool, sizeof(radius_state_zone_t));
+    if (sz == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->state = ngx_shared_memory_add(cf, &name, size,
+                                       &ngx_http_auth_radius_module);
+    if (mcf->state == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->state->data) {
+        CONF_LOG_EMERG(cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->state->init = init_radius_state_zone;
+    mcf->state->data = sz;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_api(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_auth_radius_api_handler;
+
+    return NGX_CONF_OK;
+}
+
+static int ngx_libc_cdecl
+radius_ring_point_cmp(const void *one, const void *two)
+{
+    const radius_ring_point_t *first = one;
+    const radius_ring_point_t *second = two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+    if (first->hash > second->hash) {
+        return 1;
+    }
+    return (int) first->idx - second->idx;
+}
+
+static ngx_int_t
+build_radius_ring(ngx_conf_t *cf, ngx_http_auth_radius_loc_conf_t *lcf)
+{
+    // Virtual nodes per server, as in the upstream hash module
+    const ngx_uint_t vnodes = 160;
+
+    ngx_uint_t n = lcf->server_ptrs->nelts;
+
+    lcf->ring = ngx_array_create(cf->pool, n * vnodes,
+                                 sizeof(radius_ring_point_t));
+    if (lcf->ring == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+        return NGX_ERROR;
+    }
+
+    // Points depend on the server names only, so adding or removing
+    // a server moves just the users of its arcs
+    size_t i;
+    uint32_t j;
+    radius_server_t **rss = lcf->server_ptrs->elts;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < vnodes; j++) {
+            radius_ring_point_t *point = ngx_array_push(lcf->ring);
+            if (point == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+                return NGX_ERROR;
+            }
+
+            ngx_crc32_init(point->hash);
+            ngx_crc32_update(&point->hash, rss[i]->name.data, rss[i]->name.len);
+            ngx_crc32_update(&point->hash, (u_char *) &j, sizeof(j));
+            ngx_crc32_final(point->hash);
+            point->idx = i;
+        }
+    }
+
+    ngx_qsort(lcf->ring->elts, lcf->ring->nelts,
+              sizeof(radius_ring_point_t), radius_ring_point_cmp);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+init_radius_server_streams(ngx_conf_t *cf, radius_server_t *rs)
+{
+    rs->streams = ngx_pcalloc(cf->pool,
+                              rs->nstreams * sizeof(radius_stream_t));
+    if (rs->streams == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_ERROR;
+    }
+
+    size_t i;
+    for (i = 0; i < rs->nstreams; ++i) {
+        rs->streams[i].rs = rs;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (rs->transport != RADIUS_TRANSPORT_TLS) {
+        return NGX_OK;
+    }
+
+    if (rs->secret.len == 0) {
+        // https://www.rfc-editor.org/rfc/rfc6614#section-2.3
+        ngx_str_set(&rs->secret, "radsec");
+    }
+
+    if (!rs->has_port) {
+        for (i = 0; i < rs->peers->nelts; ++i) {
+            ngx_inet_set_port(rs->peers->elts[i].sockaddr,
+                              RADIUS_TLS_DEFAULT_PORT);
+        }
+        rs->port = RADIUS_TLS_DEFAULT_PORT;
+    }
+
+    rs->ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
+    if (rs->ssl == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_ERROR;
+    }
+    rs->ssl->log = cf->log;
+
+    if (ngx_ssl_create(rs->ssl, NGX_SSL_TLSv1_2 | NGX_SSL_TLSv1_3, NULL)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(rs->ssl);
+        return NGX_ERROR;
+    }
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = rs->ssl;
+
+    if (rs->tls_certificate.len) {
+        if (rs->tls_certificate_key.len == 0) {
+            CONF_LOG_EMERG(cf, 0, "no \"tls_certificate_key\" "
+                           "in radius_server \"%V\"", &rs->name);
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_certificate(cf, rs->ssl, &rs->tls_certificate,
+                                &rs->tls_certificate_key, NULL)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (rs->tls_verify) {
+        if (rs->tls_trusted_certificate.len == 0) {
+            CONF_LOG_EMERG(cf, 0, "no \"tls_trusted_certificate\" "
+                           "in radius_server \"%V\"", &rs->name);
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_trusted_certificate(cf, rs->ssl,
+                                        &rs->tls_trusted_certificate, 1)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_ssl_client_session_cache(cf, rs->ssl, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+static char*
+ngx_http_auth_radius_set_radius_server(ngx_conf_t *cf,
+                                       ngx_command_t *cmd,
+                                       void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+
+    // Get latest server from servers array
+    assert(mcf->servers != NULL);
+
+    radius_server_t *rss = mcf->servers->elts; // [radius_server_t]
+    radius_server_t *rs = &rss[mcf->servers->nelts - 1];
+
+    ngx_str_t* value = cf->args->elts;
+
+    if (ngx_strncmp(value[0].data, "url", value[0].len) == 0) {
+        ngx_url_t u;
+        ngx_memzero(&u, sizeof(ngx_url_t));
+        u.url = value[1];
+        u.uri_part = 1;
+        u.default_port = RADIUS_DEFAULT_PORT;
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                CONF_LOG_EMERG(cf, ngx_errno,
+                               "invalid \"%V\" \"url\" value: \"%V\"",
+                               &value[0], &value[1]);
+            }
+            return NGX_CONF_ERROR;
+        }
+        rs->url = value[1];
+        rs->host = u.host;
+        rs->port = ngx_inet_get_port(u.addrs[0].sockaddr);
+        rs->has_port = !u.no_port;
+
+        // Every address the host resolves to is a member of the server
+        rs->peers = ngx_pcalloc(cf->pool, sizeof(radius_peers_t));
+        if (rs->peers == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+            return NGX_CONF_ERROR;
+        }
+        rs->peers->elts = ngx_pcalloc(cf->pool,
+                                      u.naddrs * sizeof(radius_peer_t));
+        if (rs->peers->elts == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+            return NGX_CONF_ERROR;
+        }
+        size_t i;
+        for (i = 0; i < u.naddrs; i++) {
+            radius_peer_t *peer = &rs->peers->elts[i];
+            peer->sockaddr = u.addrs[i].sockaddr;
+            peer->socklen = u.addrs[i].socklen;
+            peer->name = u.addrs[i].name;
+            peer->weight = 1;
+        }
+        rs->peers->nelts = u.naddrs;
+        rs->peers->nbase = u.naddrs;
+        rs->peers->refs = 1;
+    } else if (ngx_strncmp(value[0].data, "secret", value[0].len) == 0) {
+        rs->secret = value[1];
+    } else if (ngx_strncmp(value[0].data, "nas_identifier", value[0].len) == 0) {
+        rs->nas_id = value[1];
+    } else if (ngx_strncmp(value[0].data, "auth_timeout", value[0].len) == 0) {
+        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
+        if (timeout == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"auth_timeout\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->auth_timeout = timeout;
+    } else if (ngx_strncmp(value[0].data, "auth_retries", value[0].len) == 0) {
+        ngx_int_t retries = ngx_atoi(value[1].data, value[1].len);
+        if (retries == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"auth_retries\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->auth_retries = retries;
+    } else if (ngx_strncmp(value[0].data, "health_timeout", value[0].len) == 0) {
+        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
+        if (timeout == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"health_timeout\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->health_timeout = timeout;
+    } else if (ngx_strncmp(value[0].data, "health_retries", value[0].len) == 0) {
+        ngx_int_t retries = ngx_atoi(value[1].data, value[1].len);
+        if (retries == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"health_retries\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->health_retries = retries;
+    } else if (ngx_strncmp(value[0].data, "queue_size", value[0].len) == 0) {
+        ngx_int_t size = ngx_atoi(value[1].data, value[1].len);
+        if (size == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"queue_size\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        if (size < 1 || size > 255) {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"queue_size\" value: \"%V\", "
+                           "expected value range [1, 255]",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->req_queue_size = size;
+    } else if (ngx_strncmp(value[0].data, "acct_port", value[0].len) == 0) {
+        ngx_int_t port = ngx_atoi(value[1].data, value[1].len);
+        if (port < 1 || port > 65535) {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"acct_port\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->acct_port = port;
+    } else if (ngx_strncmp(value[0].data, "adaptive_concurrency", value[0].len) == 0) {
+        if (ngx_strcmp(value[1].data, "on") == 0) {
+            rs->adaptive = 1;
+        } else if (ngx_strcmp(value[1].data, "off") == 0) {
+            rs->adaptive = 0;
+        } else {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"adaptive_concurrency\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    } else if (ngx_strncmp(value[0].data, "fail_timeout", value[0].len) == 0) {
+        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
+        if (timeout == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"fail_timeout\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->fail_timeout = timeout;
+    } else if (ngx_strncmp(value[0].data, "resolve_interval", value[0].len) == 0) {
+        ngx_int_t interval = ngx_parse_time(&value[1], 0);
+        if (interval == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"resolve_interval\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->resolve_interval = interval;
+    } else if (ngx_strncmp(value[0].data, "idle_timeout", value[0].len) == 0) {
+        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
+        if (timeout == NGX_ERROR || timeout == 0) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"idle_timeout\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->idle_timeout = timeout;
+    } else if (ngx_strncmp(value[0].data, "min_sockets", value[0].len) == 0) {
+        ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+        if (n == NGX_ERROR) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"min_sockets\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->min_sockets = n;
+    } else if (ngx_strncmp(value[0].data, "bind", value[0].len) == 0) {
+        if (cf->args->nelts < 2) {
+            CONF_LOG_EMERG(cf, 0, "no \"bind\" addresses");
+            return NGX_CONF_ERROR;
+        }
+        if (rs->bind == NULL) {
+            rs->bind = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                        sizeof(ngx_addr_t));
+            if (rs->bind == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+                return NGX_CONF_ERROR;
+            }
+        }
+        size_t i;
+        for (i = 1; i < cf->args->nelts; i++) {
+            ngx_addr_t *addr = ngx_array_push(rs->bind);
+            if (addr == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+                return NGX_CONF_ERROR;
+            }
+            // Without a port, see "source_ports"
+            if (ngx_parse_addr(cf->pool, addr, value[i].data, value[i].len)
+                != NGX_OK)
+            {
+                CONF_LOG_EMERG(cf, 0,
+                               "invalid \"bind\" value: \"%V\"",
+                               &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            addr->name = value[i];
+        }
+    } else if (ngx_strncmp(value[0].data, "source_ports", value[0].len) == 0) {
+        u_char *dash = ngx_strlchr(value[1].data,
+                                   value[1].data + value[1].len, '-');
+        ngx_int_t low = NGX_ERROR, high = NGX_ERROR;
+        if (dash) {
+            low = ngx_atoi(value[1].data, dash - value[1].data);
+            high = ngx_atoi(dash + 1, value[1].data + value[1].len - dash - 1);
+        }
+        // The workers can't bind the privileged ports
+        if (low < 1024 || high > 65535 || low > high) {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"source_ports\" value: \"%V\", "
+                           "expected LOW-HIGH in [1024, 65535]",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->source_port = low;
+        rs->source_ports = high - low + 1;
+    } else if (ngx_strncmp(value[0].data, "transport", value[0].len) == 0) {
+        if (ngx_strcmp(value[1].data, "udp") == 0) {
+            rs->transport = RADIUS_TRANSPORT_UDP;
+        } else if (ngx_strcmp(value[1].data, "tcp") == 0) {
+            rs->transport = RADIUS_TRANSPORT_TCP;
+        } else if (ngx_strcmp(value[1].data, "tls") == 0) {
+#if (NGX_HTTP_SSL)
+            rs->transport = RADIUS_TRANSPORT_TLS;
+#else
+            CONF_LOG_EMERG(cf, 0,
+                           "\"transport tls\" requires ngx_http_ssl_module");
+            return NGX_CONF_ERROR;
+#endif
+        } else {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"transport\" value: \"%V\", "
+                           "expected \"udp\", \"tcp\" or \"tls\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    } else if (ngx_strncmp(value[0].data, "connections", value[0].len) == 0) {
+        ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+        if (n == NGX_ERROR || n == 0) {
+            CONF_LOG_EMERG(cf, ngx_errno,
+                           "invalid \"connections\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        rs->nstreams = n;
+#if (NGX_HTTP_SSL)
+    } else if (ngx_strncmp(value[0].data, "tls_certificate", value[0].len) == 0) {
+        rs->tls_certificate = value[1];
+    } else if (ngx_strncmp(value[0].data, "tls_certificate_key", value[0].len) == 0) {
+        rs->tls_certificate_key = value[1];
+    } else if (ngx_strncmp(value[0].data, "tls_trusted_certificate", value[0].len) == 0) {
+        rs->tls_trusted_certificate = value[1];
+    } else if (ngx_strncmp(value[0].data, "tls_verify", value[0].len) == 0) {
+        if (ngx_strcmp(value[1].data, "on") == 0) {
+            rs->tls_verify = 1;
+        } else if (ngx_strcmp(value[1].data, "off") == 0) {
+            rs->tls_verify = 0;
+        } else {
+            CONF_LOG_EMERG(cf, 0,
+                           "invalid \"tls_verify\" value: \"%V\"",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+#endif
+    } else {
+        CONF_LOG_EMERG(cf, 0,
+                       "unknown option \"%V\"",
+                       &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_servers(ngx_conf_t *cf,
+                                        ngx_command_t *cmd,
+                                        void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+
+    if (mcf->servers == NULL) {
+        CONF_LOG_EMERG(cf, 0,
+                       "using \"radius_servers\" without \"radius_server\" defined");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
+
+    if (lcf->server_ptrs == NULL) {
+        lcf->server_ptrs = ngx_array_create(cf->pool, 5, sizeof(radius_server_t *));
+        if (lcf->server_ptrs == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    assert(mcf->servers != NULL);
+
+    radius_server_t *rss = mcf->servers->elts; // [radius_server_t]
+    radius_server_t *server = NULL;
+
+    // Search server by name
+    size_t i;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        radius_server_t *rs = &rss[i];
+        if (ngx_strncmp(rs->name.data, value[1].data, rs->name.len) == 0) {
+            server = rs;
+            break;
+        }
+    }
+
+    if (server == NULL) {
+        CONF_LOG_EMERG(cf, 0, "server \"%V\" is not defined", value);
+        return NGX_CONF_ERROR;
+    }
+
+    radius_server_t **target = ngx_array_push(lcf->server_ptrs);
+    if (target == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+
+    *target = server;
+
+    ngx_crc32_update(&lcf->servers_hash, server->name.data, server->name.len);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_auth(ngx_conf_t *cf,
+                                     ngx_command_t *cmd,
+                                     void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "off", 3) == 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
+
+    if (lcf->type == HEALTH) {
+        CONF_LOG_EMERG(cf, 0,
+                       "\"radius_health\" already defined");
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->type = AUTH;
+    lcf->auth.realm.len = sizeof("Basic realm=\"") - 1 + value[1].len + 1;
+    lcf->auth.realm.data = ngx_pcalloc(cf->pool, lcf->auth.realm.len);
+    if (lcf->auth.realm.data == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    uint8_t *p;
+    p = ngx_cpymem(lcf->auth.realm.data,
+                   "Basic realm=\"",
+                   sizeof("Basic realm=\"") - 1);
+    p = ngx_cpymem(p, value[1].data, value[1].len);
+    *p = '"';
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_health(ngx_conf_t *cf,
+                                       ngx_command_t *cmd,
+                                       void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_http_auth_radius_loc_conf_t *lcf;
+    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
+
+    if (lcf->type == AUTH) {
+        CONF_LOG_EMERG(cf, 0,
+                       "\"auth_radius\" or \"radius_auth\" already defined");
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->type = HEALTH;
+
+    if (cf->args->nelts >= 2) {
+        lcf->health.user = value[1];
+    }
+
+    if (cf->args->nelts == 3) {
+        lcf->health.passwd = value[2];
+    }
+
+    if (lcf->health.user.len > RADIUS_USER_MAX
+        || lcf->health.passwd.len > RADIUS_PASSWD_MAX)
+    {
+        CONF_LOG_EMERG(cf, 0, "user over %d or password over %d bytes",
+                       RADIUS_USER_MAX, RADIUS_PASSWD_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_limit_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    ngx_int_t rate = 0;
+    ngx_int_t burst = 0;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.data = value[i].data + 5;
+            u_char *p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            name.len = p - name.data;
+
+            ngx_str_t s;
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            size_t len = value[i].len;
+            u_char *p = value[i].data + len - 3;
+            ngx_int_t scale = 1;
+            if (ngx_strncmp(p, "r/s", 3) == 0) {
+                len -= 3;
+            } else if (ngx_strncmp(p, "r/m", 3) == 0) {
+                scale = 60;
+                len -= 3;
+            }
+            rate = ngx_atoi(value[i].data + 5, len - 5);
+            if (rate <= 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            rate = rate * 1000 / scale;
+        } else if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (burst == NGX_ERROR) {
+                CONF_LOG_EMERG(cf, 0, "invalid burst \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len == 0 || rate == 0) {
+        CONF_LOG_EMERG(cf, 0, "\"%V\" must have \"zone\" and \"rate\" parameters",
+                       &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    radius_limit_zone_t *lz = ngx_pcalloc(cf->pool, sizeof(radius_limit_zone_t));
+    if (lz == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+    lz->rate = rate;
+    lz->burst = burst * 1000;
+
+    ngx_shm_zone_t *shm_zone;
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &radius_limit_zone_tag);
+    if (shm_zone == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        CONF_LOG_EMERG(cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = init_radius_limit_zone;
+    shm_zone->data = lz;
+
+    // For radius_api to report
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    if (mcf->limits == NULL) {
+        mcf->limits = ngx_array_create(cf->pool, 1, sizeof(ngx_shm_zone_t *));
+        if (mcf->limits == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NGX_CONF_ERROR;
+        }
+    }
+    ngx_shm_zone_t **limit = ngx_array_push(mcf->limits);
+    if (limit == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+    *limit = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_limit(ngx_conf_t *cf,
+                                      ngx_command_t *cmd,
+                                      void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_shm_zone_t *shm_zone = NULL;
+    radius_limit_key_t key = RADIUS_LIMIT_USER;
+    ngx_uint_t has_key = 0;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            ngx_str_t name;
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+            shm_zone = ngx_shared_memory_add(cf, &name, 0,
+                                             &radius_limit_zone_tag);
+            if (shm_zone == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strcmp(value[i].data, "key=user") == 0) {
+            key = RADIUS_LIMIT_USER;
+            has_key = 1;
+        } else if (ngx_strcmp(value[i].data, "key=addr") == 0) {
+            key = RADIUS_LIMIT_ADDR;
+            has_key = 1;
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (shm_zone == NULL || !has_key) {
+        CONF_LOG_EMERG(cf, 0, "\"%V\" must have \"zone\" and \"key\" parameters",
+                       &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lcf->limits == NULL || lcf->limits == NGX_CONF_UNSET_PTR) {
+        lcf->limits = ngx_array_create(cf->pool, 2, sizeof(radius_limit_t));
+        if (lcf->limits == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    radius_limit_t *limit = ngx_array_push(lcf->limits);
+    if (limit == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+
+    limit->shm_zone = shm_zone;
+    limit->key = key;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_reject_filter_zone(ngx_conf_t *cf,
+                                                   ngx_command_t *cmd,
+                                                   void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    ngx_int_t ttl = 60;
+    ngx_int_t fp = 10000;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.data = value[i].data + 5;
+            u_char *p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            name.len = p - name.data;
+
+            ngx_str_t s;
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+            ngx_str_t s;
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+            ttl = ngx_parse_time(&s, 1);
+            if (ttl == NGX_ERROR || ttl == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid ttl \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "fp=", 3) == 0) {
+            fp = ngx_atofp(value[i].data + 3, value[i].len - 3, 6);
+            if (fp <= 0 || fp >= 1000000) {
+                CONF_LOG_EMERG(cf, 0, "invalid false positive rate \"%V\"",
+                               &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len == 0) {
+        CONF_LOG_EMERG(cf, 0, "\"%V\" must have \"zone\" parameter",
+                       &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    radius_filter_zone_t *fz = ngx_pcalloc(cf->pool, sizeof(radius_filter_zone_t));
+    if (fz == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+    fz->ttl = ttl;
+    fz->fp = fp;
+
+    // The optimal number of hashes for the rate is log2(1 / fp)
+    // and it is reached with ln(2) * nbits / hashes fingerprints
+    while (((ngx_uint_t) 1000000 >> fz->hashes) > (ngx_uint_t) fp && fz->hashes < 16) {
+        fz->hashes++;
+    }
+    if (fz->hashes == 0) {
+        fz->hashes = 1;
+    }
+
+    ngx_shm_zone_t *shm_zone;
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &radius_filter_zone_tag);
+    if (shm_zone == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        CONF_LOG_EMERG(cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = init_radius_filter_zone;
+    shm_zone->data = fz;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_reject_filter(ngx_conf_t *cf,
+                                              ngx_command_t *cmd,
+                                              void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->reject_filter != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    lcf->reject_filter = NULL;
+    lcf->reject_recheck = 0;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            ngx_str_t name;
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+            lcf->reject_filter = ngx_shared_memory_add(cf, &name, 0,
+                                                       &radius_filter_zone_tag);
+            if (lcf->reject_filter == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "recheck=", 8) == 0) {
+            ngx_int_t n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (n == NGX_ERROR) {
+                CONF_LOG_EMERG(cf, 0, "invalid recheck \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            lcf->reject_recheck = n;
+        } else if (ngx_strcmp(value[i].data, "off") == 0) {
+            // Disable the filter inherited from the parent
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_cache_zone(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf)
+{
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t name;
+    name.data = value[1].data + 5;
+    u_char *p = (u_char *) ngx_strchr(name.data, ':');
+    if (p == NULL) {
+        CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    name.len = p - name.data;
+
+    ngx_str_t s;
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+    ssize_t size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        CONF_LOG_EMERG(cf, 0, "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    radius_cache_zone_t *cz = ngx_pcalloc(cf->pool, sizeof(radius_cache_zone_t));
+    if (cz == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    size_t i;
+    radius_cache_l2_t *l2 = NULL;
+    ngx_uint_t snapshot_key = 0;
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (l2 == NULL && ngx_strncmp(value[i].data, "l2", 2) == 0) {
+            l2 = ngx_pcalloc(cf->pool, sizeof(radius_cache_l2_t));
+            if (l2 == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+                return NGX_CONF_ERROR;
+            }
+            l2->timeout = 50;
+        }
+
+        if (ngx_strncmp(value[i].data, "l2=", 3) == 0) {
+            ngx_url_t u;
+            ngx_memzero(&u, sizeof(ngx_url_t));
+            u.url.data = value[i].data + 3;
+            u.url.len = value[i].len - 3;
+            u.default_port = RADIUS_CACHE_L2_DEFAULT_PORT;
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    CONF_LOG_EMERG(cf, 0, "%s in \"%V\"", u.err, &value[i]);
+                }
+                return NGX_CONF_ERROR;
+            }
+            l2->addr = u.addrs[0];
+        } else if (ngx_strncmp(value[i].data, "l2_salt=", 8) == 0) {
+            l2->salt.data = value[i].data + 8;
+            l2->salt.len = value[i].len - 8;
+        } else if (ngx_strncmp(value[i].data, "l2_timeout=", 11) == 0) {
+            ngx_str_t s = { value[i].len - 11, value[i].data + 11 };
+            ngx_int_t timeout = ngx_parse_time(&s, 0);
+            if (timeout == NGX_ERROR || timeout == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            l2->timeout = timeout;
+        } else if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+            cz->snapshot.data = value[i].data + 9;
+            cz->snapshot.len = value[i].len - 9;
+            if (cz->snapshot.len == 0
+                || ngx_conf_full_name(cf->cycle, &cz->snapshot, 0) != NGX_OK)
+            {
+                CONF_LOG_EMERG(cf, 0, "invalid snapshot \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "snapshot_key=", 13) == 0) {
+            ngx_str_t path = { value[i].len - 13, value[i].data + 13 };
+            if (path.len == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid snapshot_key \"%V\"",
+                               &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            if (read_radius_cache_snapshot_key(cf, &path,
+                                               cz->snapshot_key) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+            snapshot_key = 1;
+        } else if (ngx_strncmp(value[i].data, "snapshot_interval=", 18) == 0) {
+            ngx_str_t s = { value[i].len - 18, value[i].data + 18 };
+            cz->snapshot_interval = ngx_parse_time(&s, 1);
+            if (cz->snapshot_interval == (time_t) NGX_ERROR
+                || cz->snapshot_interval == 0)
+            {
+                CONF_LOG_EMERG(cf, 0, "invalid snapshot_interval \"%V\"",
+                               &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (cz->snapshot_interval == 0) {
+        cz->snapshot_interval = 60;
+    }
+
+    if ((cz->snapshot.len != 0) != snapshot_key) {
+        CONF_LOG_EMERG(cf, 0, "\"snapshot\" and \"snapshot_key\" go together");
+        return NGX_CONF_ERROR;
+    }
+
+    if (l2 && (l2->addr.sockaddr == NULL || l2->salt.len == 0)) {
+        CONF_LOG_EMERG(cf, 0, "\"l2\" and \"l2_salt\" go together");
+        return NGX_CONF_ERROR;
+    }
+    cz->l2 = l2;
+
+    ngx_shm_zone_t *shm_zone;
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &radius_cache_zone_tag);
+    if (shm_zone == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        CONF_LOG_EMERG(cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = init_radius_cache_zone;
+    shm_zone->data = cz;
+
+    // For radius_api to flush
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+    if (mcf->caches == NULL) {
+        mcf->caches = ngx_array_create(cf->pool, 1, sizeof(ngx_shm_zone_t *));
+        if (mcf->caches == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NGX_CONF_ERROR;
+        }
+    }
+    ngx_shm_zone_t **cache = ngx_array_push(mcf->caches);
+    if (cache == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+    *cache = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_cache(ngx_conf_t *cf,
+                                      ngx_command_t *cmd,
+                                      void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    radius_cache_conf_t *cache = ngx_pcalloc(cf->pool, sizeof(radius_cache_conf_t));
+    if (cache == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        ngx_str_t s;
+        time_t *t = NULL;
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+            cache->shm_zone = ngx_shared_memory_add(cf, &s, 0,
+                                                    &radius_cache_zone_tag);
+            if (cache->shm_zone == NULL) {
+                CONF_LOG_EMERG(cf, ngx_errno, "ngx_shared_memory_add failed");
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        } else if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+            t = &cache->valid;
+        } else if (ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+            t = &cache->refresh;
+        } else if (ngx_strncmp(value[i].data, "stale=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+            t = &cache->stale;
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        *t = ngx_parse_time(&s, 1);
+        if (*t == (time_t) NGX_ERROR) {
+            CONF_LOG_EMERG(cf, 0, "invalid time \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (cache->shm_zone == NULL || cache->valid == 0) {
+        CONF_LOG_EMERG(cf, 0, "\"%V\" must have \"zone\" and \"valid\" parameters",
+                       &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->refresh >= cache->valid) {
+        CONF_LOG_EMERG(cf, 0, "\"refresh\" must be less than \"valid\"");
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->cache = cache;
+
+    return NGX_CONF_OK;
+}
+
+// Classes can be referred to before they are defined, they are checked
+// in ngx_http_auth_radius_init_main_conf
+static radius_class_t *
+get_radius_class(ngx_conf_t *cf,
+                 ngx_http_auth_radius_main_conf_t *mcf,
+                 ngx_str_t *name,
+                 ngx_uint_t *idx)
+{
+    radius_class_t *cls;
+    ngx_uint_t i;
+
+    if (mcf->classes == NULL) {
+        mcf->classes = ngx_array_create(cf->pool, 4, sizeof(radius_class_t));
+        if (mcf->classes == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
+            return NULL;
+        }
+
+        cls = ngx_array_push(mcf->classes);
+        if (cls == NULL) {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+            return NULL;
+        }
+        ngx_str_set(&cls->name, "default");
+        cls->weight = 1;
+        cls->queue = 0;
+        cls->defined = 1;
+    }
+
+    cls = mcf->classes->elts;
+    for (i = 0; i < mcf->classes->nelts; i++) {
+        if (cls[i].name.len == name->len
+            && ngx_strncmp(cls[i].name.data, name->data, name->len) == 0)
+        {
+            *idx = i;
+            return &cls[i];
+        }
+    }
+
+    cls = ngx_array_push(mcf->classes);
+    if (cls == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NULL;
+    }
+    cls->name = *name;
+    cls->weight = 1;
+    cls->queue = 0;
+    cls->defined = 0;
+    *idx = mcf->classes->nelts - 1;
+
+    return cls;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_qos_class(ngx_conf_t *cf,
+                                          ngx_command_t *cmd,
+                                          void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    ngx_uint_t idx;
+    radius_class_t *cls = get_radius_class(cf, mcf, &value[1], &idx);
+    if (cls == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cls->defined && idx != 0) {
+        return "is duplicate";
+    }
+
+    size_t i;
+    for (i = 2; i < cf->args->nelts; i++) {
+        ngx_int_t n;
+        if (ngx_strncmp(value[i].data, "weight=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == NGX_ERROR || n < 1 || n > 1000) {
+                CONF_LOG_EMERG(cf, 0, "invalid weight \"%V\", "
+                               "expected value range [1, 1000]", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            cls->weight = n;
+        } else if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR) {
+                CONF_LOG_EMERG(cf, 0, "invalid queue \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            cls->queue = n;
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    cls->defined = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_qos(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->qos != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+
+    if (get_radius_class(cf, mcf, &value[1], &lcf->qos) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+// Compiles the attribute into the program of the location: a constant
+// one is encoded and appended to the head of the last op, a variable
+// one gets an op of its own
+static char *
+ngx_http_auth_radius_set_radius_attribute(ngx_conf_t *cf,
+                                          ngx_command_t *cmd,
+                                          void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    radius_attr_prog_t *prog = lcf->attrs;
+    if (prog == NGX_CONF_UNSET_PTR) {
+        prog = ngx_pcalloc(cf->pool, sizeof(*prog));
+        if (prog == NULL
+            || ngx_array_init(&prog->ops, cf->pool, 4,
+                              sizeof(radius_attr_op_t)) != NGX_OK
+            || ngx_array_push(&prog->ops) == NULL)
+        {
+            CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+            return NGX_CONF_ERROR;
+        }
+        ngx_memzero(prog->ops.elts, sizeof(radius_attr_op_t));
+        lcf->attrs = prog;
+    }
+
+    // Header, the lengths are set once the value is encoded
+    u_char hdr[8];
+    size_t hdr_len;
+    uint8_t len_at[2], len_add[2];
+    const radius_attr_desc_t *desc;
+
+    if (ngx_strncmp(value[1].data, "vendor:", 7) == 0) {
+        // vendor:ID:TYPE
+        u_char *p = value[1].data + 7;
+        u_char *last = value[1].data + value[1].len;
+        u_char *sep = ngx_strlchr(p, last, ':');
+        ngx_int_t vendor = sep ? ngx_atoi(p, sep - p) : NGX_ERROR;
+        ngx_int_t type = sep ? ngx_atoi(sep + 1, last - sep - 1) : NGX_ERROR;
+        if (vendor < 1 || vendor > 0xffffff || type < 1 || type > 255) {
+            CONF_LOG_EMERG(cf, 0, "invalid attribute \"%V\", "
+                           "expected \"vendor:ID:TYPE\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        // https://www.rfc-editor.org/rfc/rfc2865#section-5.26
+        desc = radius_vsa_desc();
+        uint32_t vid = htonl(vendor);
+        hdr[0] = RADIUS_ATTR_VENDOR_SPECIFIC;
+        ngx_memcpy(&hdr[2], &vid, sizeof(vid));
+        hdr[6] = type;
+        hdr_len = 8;
+        len_at[0] = 1;
+        len_add[0] = 2;
+        len_at[1] = 7;
+        len_add[1] = 8;
+    } else {
+        uint8_t id;
+        desc = radius_attr_lookup(&value[1], &id);
+        if (desc == NULL) {
+            CONF_LOG_EMERG(cf, 0, "unknown attribute \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        // The codec sets these, NAS-Identifier from "nas_identifier"
+        if (id == RADIUS_ATTR_USER_NAME
+            || id == RADIUS_ATTR_USER_PASSWORD
+            || id == RADIUS_ATTR_SERVICE_TYPE
+            || id == RADIUS_ATTR_NAS_IDENTIFIER)
+        {
+            CONF_LOG_EMERG(cf, 0, "attribute \"%V\" can't be set",
+                           &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        hdr[0] = id;
+        hdr_len = 2;
+        len_at[0] = len_at[1] = 1;
+        len_add[0] = len_add[1] = 2;
+    }
+
+    ngx_http_complex_value_t *cv = ngx_palloc(cf->pool, sizeof(*cv));
+    if (cv == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_palloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_compile_complex_value_t ccv;
+    ngx_memzero(&ccv, sizeof(ccv));
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = cv;
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    u_char buf[sizeof(hdr) + 255];
+    ngx_memcpy(buf, hdr, hdr_len);
+    size_t len = hdr_len;
+
+    if (cv->lengths == NULL) {
+        ssize_t n = desc->encode(buf + hdr_len, &cv->value, desc->len_max);
+        if (n < (ssize_t) desc->len_min) {
+            CONF_LOG_EMERG(cf, 0, "invalid \"%V\" value \"%V\"",
+                           &value[1], &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        buf[hdr_len - len_at[0]] = n + len_add[0];
+        buf[hdr_len - len_at[1]] = n + len_add[1];
+        len += n;
+        prog->size += len;
+    } else {
+        prog->size += len + desc->len_max;
+    }
+
+    if (prog->size > RADIUS_PKG_MAX / 2) {
+        CONF_LOG_EMERG(cf, 0, "too many radius_attribute");
+        return NGX_CONF_ERROR;
+    }
+
+    radius_attr_op_t *op = prog->ops.elts;
+    op = &op[prog->ops.nelts - 1];
+
+    u_char *head = ngx_pnalloc(cf->pool, op->head.len + len);
+    if (head == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pnalloc failed");
+        return NGX_CONF_ERROR;
+    }
+    ngx_memcpy(ngx_cpymem(head, op->head.data, op->head.len), buf, len);
+    op->head.data = head;
+    op->head.len += len;
+
+    if (cv->lengths == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    op->value = cv;
+    op->encode = desc->encode;
+    op->len_min = desc->len_min;
+    op->len_max = desc->len_max;
+    ngx_memcpy(op->len_at, len_at, sizeof(len_at));
+    ngx_memcpy(op->len_add, len_add, sizeof(len_add));
+
+    op = ngx_array_push(&prog->ops);
+    if (op == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
+        return NGX_CONF_ERROR;
+    }
+    ngx_memzero(op, sizeof(*op));
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_dynauth_listen(ngx_conf_t *cf,
+                                               ngx_command_t *cmd,
+                                               void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (mcf->dynauth) {
+        return "is duplicate";
+    }
+
+    ngx_url_t u;
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url = value[1];
+    u.listen = 1;
+    u.default_port = RADIUS_DYNAUTH_DEFAULT_PORT;
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            CONF_LOG_EMERG(cf, 0, "%s in \"%V\"", u.err, &value[1]);
+        }
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->dynauth = ngx_pcalloc(cf->pool, sizeof(radius_dynauth_t));
+    if (mcf->dynauth == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+    mcf->dynauth->addr = u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_slow_log(ngx_conf_t *cf,
+                                         ngx_command_t *cmd,
+                                         void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (mcf->slow_log) {
+        return "is duplicate";
+    }
+
+    ngx_int_t threshold = ngx_parse_time(&value[1], 0);
+    if (threshold == NGX_ERROR) {
+        CONF_LOG_EMERG(cf, 0, "invalid threshold \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_int_t size = RADIUS_SLOW_LOG_ENTRIES;
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "entries=", 8) != 0) {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        size = ngx_atoi(value[2].data + 8, value[2].len - 8);
+        if (size == NGX_ERROR || size == 0) {
+            CONF_LOG_EMERG(cf, 0, "invalid entries \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    radius_slow_log_t *sl = ngx_pcalloc(cf->pool, sizeof(radius_slow_log_t));
+    if (sl == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NGX_CONF_ERROR;
+    }
+
+    // Each worker has its own copy
+    sl->ring = ngx_palloc(cf->pool, size * sizeof(radius_trace_t));
+    if (sl->ring == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_palloc failed");
+        return NGX_CONF_ERROR;
+    }
+    sl->threshold = threshold;
+    sl->size = size;
+    mcf->slow_log = sl;
+
+    return NGX_CONF_OK;
+}
+
+static radius_acct_queue_t *
+get_radius_acct_queue(ngx_conf_t *cf, ngx_http_auth_radius_main_conf_t *mcf)
+{
+    if (mcf->acct) {
+        return mcf->acct;
+    }
+
+    radius_acct_queue_t *q = ngx_pcalloc(cf->pool, sizeof(*q));
+    if (q == NULL) {
+        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
+        return NULL;
+    }
+
+    // See ngx_http_auth_radius_init_main_conf for the defaults
+    q->size = NGX_CONF_UNSET_UINT;
+    q->overflow = NGX_CONF_UNSET_UINT;
+    q->spill_max = NGX_CONF_UNSET;
+    q->retries = NGX_CONF_UNSET_UINT;
+    q->timeout = NGX_CONF_UNSET_MSEC;
+    q->window = NGX_CONF_UNSET_UINT;
+    q->spill.fd = NGX_INVALID_FILE;
+
+    mcf->acct = q;
+    return q;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_accounting_queue(ngx_conf_t *cf,
+                                                 ngx_command_t *cmd,
+                                                 void *conf)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    radius_acct_queue_t *q = get_radius_acct_queue(cf, mcf);
+    if (q == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (q->configured) {
+        return "is duplicate";
+    }
+    q->configured = 1;
+
+    size_t i;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            ngx_int_t n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR || n == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            q->size = n;
+        } else if (ngx_strcmp(value[i].data, "overflow=drop_oldest") == 0) {
+            q->overflow = RADIUS_ACCT_DROP_OLDEST;
+        } else if (ngx_strcmp(value[i].data, "overflow=spill") == 0) {
+            q->overflow = RADIUS_ACCT_SPILL;
+        } else if (ngx_strncmp(value[i].data, "spill=", 6) == 0) {
+            q->spill_path.data = value[i].data + 6;
+            q->spill_path.len = value[i].len - 6;
+            if (q->spill_path.len == 0
+                || ngx_conf_full_name(cf->cycle, &q->spill_path, 0) != NGX_OK)
+            {
+                CONF_LOG_EMERG(cf, 0, "invalid spill \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "spill_max=", 10) == 0) {
+            ngx_str_t s = { value[i].len - 10, value[i].data + 10 };
+            q->spill_max = ngx_parse_offset(&s);
+            if (q->spill_max == NGX_ERROR
+                || q->spill_max < (off_t) (sizeof(radius_acct_spill_hdr_t)
+                                           + sizeof(radius_acct_rec_t)))
+            {
+                CONF_LOG_EMERG(cf, 0, "invalid spill_max \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        } else if (ngx_strncmp(value[i].data, "retries=", 8) == 0) {
+            ngx_int_t n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (n == NGX_ERROR) {
+                CONF_LOG_EMERG(cf, 0, "invalid retries \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            q->retries = n;
+        } else if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            ngx_str_t s = { value[i].len - 8, value[i].data + 8 };
+            ngx_int_t timeout = ngx_parse_time(&s, 0);
+            if (timeout == NGX_ERROR || timeout == 0) {
+                CONF_LOG_EMERG(cf, 0, "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            q->timeout = timeout;
+        } else if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            // The Identifier is the slot index
+            ngx_int_t n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n < 1 || n > 256) {
+                CONF_LOG_EMERG(cf, 0, "invalid window \"%V\", "
+                               "expected value range [1, 256]", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            q->window = n;
+        } else {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (q->overflow == RADIUS_ACCT_SPILL && q->spill_path.len == 0) {
+        CONF_LOG_EMERG(cf, 0, "\"overflow=spill\" requires \"spill=\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_auth_radius_set_radius_accounting(ngx_conf_t *cf,
+                                           ngx_command_t *cmd,
+                                           void *conf)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (lcf->acct != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        lcf->acct = NULL;
+        lcf->acct_start = 0;
+        return NGX_CONF_OK;
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+
+    if (mcf->servers == NULL) {
+        CONF_LOG_EMERG(cf, 0,
+                       "using \"radius_accounting\" without \"radius_server\" defined");
+        return NGX_CONF_ERROR;
+    }
+
+    radius_server_t *rss = mcf->servers->elts;
+    radius_server_t *server = NULL;
+
+    size_t i;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        if (rss[i].name.len == value[1].len
+            && ngx_strncmp(rss[i].name.data, value[1].data, value[1].len) == 0)
+        {
+            server = &rss[i];
+            break;
+        }
+    }
+
+    if (server == NULL) {
+        CONF_LOG_EMERG(cf, 0, "server \"%V\" is not defined", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (server->transport != RADIUS_TRANSPORT_UDP) {
+        CONF_LOG_EMERG(cf, 0, "radius_accounting requires a udp server, "
+                       "\"%V\" is not", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->acct_start = 0;
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "start") != 0) {
+            CONF_LOG_EMERG(cf, 0, "invalid parameter \"%V\", "
+                           "expected \"start\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        lcf->acct_start = 1;
+    }
+
+    if (get_radius_acct_queue(cf, mcf) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    server->accounting = 1;
+    lcf->acct = server;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_auth_radius_init_servers(ngx_cycle_t *cycle)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_auth_radius_module);
+
+    if (mcf == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_t *log = cycle->log;
+
+    // Changes made through radius_api before a reload
+    sync_radius_state(mcf, log);
+
+    LOG_INFO(log, "md5: %s", radius_md5_init());
+    ngx_err_t err = radius_rand_init();
+    if (err) {
+        LOG_EMERG(log, err, "getrandom failed");
+        return NGX_ERROR;
+    }
+    mcf->encode_ev.handler = radius_encode_handler;
+    mcf->encode_ev.data = mcf;
+    mcf->encode_ev.log = log;
+
+    if (init_radius_servers(mcf->servers, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (init_radius_acct(mcf, cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    init_radius_caches(mcf, log);
+
+    return init_radius_dynauth(mcf, log);
+}
+
+static void
+ngx_http_auth_radius_destroy_servers(ngx_cycle_t *cycle)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_auth_radius_module);
+
+    if (mcf == NULL) {
+        return;
+    }
+
+    if (mcf->shutdown_ev.timer_set) {
+        ngx_del_timer(&mcf->shutdown_ev);
+    }
+
+    if (mcf->encode_ev.posted) {
+        ngx_delete_posted_event(&mcf->encode_ev);
+    }
+
+    ngx_log_t *log = cycle->log;
+    destroy_radius_caches(mcf, log);
+    destroy_radius_dynauth(mcf);
+    destroy_radius_acct(mcf, log);
+    destroy_radius_servers(mcf->servers, log);
+}
+
+static ngx_int_t
+init_radius_servers(ngx_array_t *servers, ngx_log_t *log)
+{
+    if (servers == NULL) {
+        LOG_EMERG(log, 0, "no radius servers");
+        return NGX_ERROR;
+    }
+
+    assert(servers != NULL);
+
+    size_t i, j;
+    radius_server_t *rss = servers->elts;
+    for (i = 0; i < servers->nelts; ++i) {
+        radius_server_t *rs = &rss[i];
+        radius_peers_t *peers = rs->peers;
+
+        for (j = 0; j < peers->nelts; ++j) {
+            LOG_DEBUG(log, "\"%V\", addr: %V", &rs->name, &peers->elts[j].name);
+        }
+
+        if (rs->source_ports && ngx_worker == 0) {
+            ngx_core_conf_t *ccf = (ngx_core_conf_t *)
+                ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
+            ngx_uint_t pairs = (rs->bind ? rs->bind->nelts : 1)
+                               * rs->source_ports;
+            ngx_uint_t slots = ccf->worker_processes * rs->req_queue_size;
+            if (pairs < slots) {
+                LOG_WARN(log, 0, "\"%V\" %ui source address and port "
+                         "pairs for %ui slots, the rest use ephemeral ports",
+                         &rs->name, pairs, slots);
+            }
+        }
+
+        if (rs->transport != RADIUS_TRANSPORT_UDP) {
+            for (j = 0; j < rs->req_queue_size; ++j) {
+                radius_req_t *req = &rs->req_queue[j];
+                req->timer.handler = radius_stream_timeout_handler;
+                req->timer.data = req;
+                req->timer.log = log;
+            }
+
+            // Connections are persistent, open the warm minimum
+            for (j = 0; j < rs->min_sockets && j < rs->nstreams; ++j) {
+                if (open_radius_stream(&rs->streams[j], peers,
+                                       &peers->elts[j % peers->nelts],
+                                       log) != NGX_OK)
+                {
+                    LOG_ERR(log, 0, "\"%V\" could not connect, addr: %V",
+                            &rs->name, &peers->elts[j % peers->nelts].name);
+                }
+            }
+        }
+
+        // Open the warm minimum, the rest is opened on demand
+        radius_req_t *req = rs->req_free_list;
+        for (j = 0;
+             req && j < rs->min_sockets && rs->transport == RADIUS_TRANSPORT_UDP;
+             ++j, req = req->next)
+        {
+            // Spread the slots over the server addresses
+            if (connect_radius_req(req, peers,
+                                   &peers->elts[j % peers->nelts],
+                                   log) != NGX_OK)
+            {
+                destroy_radius_servers(servers, log);
+                return NGX_ERROR;
+            }
+        }
+
+        rs->idle_ev.handler = radius_idle_handler;
+        rs->idle_ev.data = rs;
+        rs->idle_ev.log = log;
+        rs->idle_ev.cancelable = 1;
+        ngx_add_timer(&rs->idle_ev, rs->idle_timeout);
+
+        if (rs->resolve_interval) {
+            rs->resolve_ev.handler = radius_resolve_timer_handler;
+            rs->resolve_ev.data = rs;
+            rs->resolve_ev.log = log;
+            // Don't delay worker shutdown
+            rs->resolve_ev.cancelable = 1;
+            ngx_add_timer(&rs->resolve_ev, rs->resolve_interval);
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void
+destroy_radius_servers(ngx_array_t* servers, ngx_log_t *log)
+{
+    if (servers == NULL) {
+        LOG_EMERG(log, 0, "no radius servers");
+        return;
+    }
+
+    assert(servers != NULL);
+
+    size_t i, j;
+    radius_server_t *rss = servers->elts;
+    for (i = 0; i < servers->nelts; ++i) {
+        radius_server_t *rs = &rss[i];
+        for (j = 0; j < rs->req_queue_size; ++j) {
+            close_radius_req(&rs->req_queue[j]);
+        }
+
+        for (j = 0; j < rs->nstreams && rs->streams; ++j) {
+            close_radius_stream(&rs->streams[j]);
+        }
+
+#if (NGX_HTTP_SSL)
+        if (rs->ssl_session) {
+            ngx_ssl_free_session(rs->ssl_session);
+            rs->ssl_session = NULL;
+        }
+#endif
+
+        if (rs->idle_ev.timer_set) {
+            ngx_del_timer(&rs->idle_ev);
+        }
+
+        if (rs->resolve_ev.timer_set) {
+            ngx_del_timer(&rs->resolve_ev);
+        }
+    }
+
+    // No need to free the array, since the pool
+    // should free it automatically
+}
+
+static ngx_connection_t *
+create_radius_connection(struct sockaddr *sockaddr,
+                         socklen_t socklen,
+                         radius_server_t *rs,
+                         ngx_uint_t slot,
+                         ngx_log_t *log)
+{
+    // Create UDP socket
+    int sockfd = ngx_socket(sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        LOG_ERR(log, ngx_errno, "ngx_socket failed");
+        return NULL;
+    }
+
+    // Set socket to non-blocking mode
+    if (ngx_nonblocking(sockfd) == -1) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_nonblocking failed, sockfd: %d", sockfd);
+        ngx_close_socket(sockfd);
+        return NULL;
+    }
+
+#if (NGX_LINUX)
+    // Queue ICMP errors, not only port unreachable,
+    // see recv_radius_errqueue
+    int on = 1;
+    if (sockaddr->sa_family == AF_INET) {
+        if (setsockopt(sockfd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) == -1) {
+            LOG_ERR(log, ngx_errno, "setsockopt(IP_RECVERR) failed");
+        }
+    } else if (sockaddr->sa_family == AF_INET6) {
+        if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on)) == -1) {
+            LOG_ERR(log, ngx_errno, "setsockopt(IPV6_RECVERR) failed");
+        }
+    }
+#endif
+
+    if (bind_radius_socket(rs, sockfd, sockaddr->sa_family,
+                           ngx_worker * rs->req_queue_size + slot,
+                           1, log) != NGX_OK)
+    {
+        ngx_close_socket(sockfd);
+        return NULL;
+    }
+
+    // Connect socket to make it possible to use
+    // recv(2)/send(2) instead of recvfrom(2)/sendto(2)
+    if (connect(sockfd, sockaddr, socklen) == -1) {
+        LOG_ERR(log, ngx_errno, "connect failed");
+        ngx_close_socket(sockfd);
+        return NULL;
+    }
+
+    // Get connection around socket
+    ngx_connection_t *c = ngx_get_connection(sockfd, log);
+    if (c == NULL) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_get_connection failed, sockfd: %d", sockfd);
+        ngx_close_socket(sockfd);
+        return NULL;
+    }
+
+    c->log = log;
+    c->data = NULL;
+    c->read->handler = radius_read_handler;
+    c->read->log = c->log;
+
+    // Subscribe to read data event
+    if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_LEVEL_EVENT) != NGX_OK) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_add_event failed, sockfd: %d", sockfd);
+        ngx_close_connection(c);
+        return NULL;
+    }
+
+    sa_family_t family = sockaddr->sa_family;
+    char host[INET6_ADDRSTRLEN] = "";
+    uint16_t port = 0;
+    if (family == AF_INET) {
+        struct sockaddr_in sa;
+        ngx_memzero(&sa, sizeof(sa));
+        if (getsockname(sockfd, (struct sockaddr *)&sa, &socklen) != -1) {
+            inet_ntop(family, &sa.sin_addr, host, sizeof(host)),
+            port = ntohs(sa.sin_port);
+        } else {
+            LOG_ERR(log, ngx_errno, "getsockname sockaddr_in failed");
+        }
+    } else if (family == AF_INET6) {
+        struct sockaddr_in6 sa;
+        ngx_memzero(&sa, sizeof(sa));
+        if (getsockname(sockfd, (struct sockaddr *)&sa, &socklen) != -1) {
+            inet_ntop(family, &sa.sin6_addr, host, sizeof(host)),
+            port = ntohs(sa.sin6_port);
+        } else {
+            LOG_ERR(log, ngx_errno, "getsockname sockaddr_in6 failed");
+        }
+    } else {
+        LOG_ERR(log, 0, "unknown family: %d", family);
+    }
+    LOG_DEBUG(log, "sockfd: %d, addr: %s:%d", sockfd, host, port);
+
+    return c;
+}
+
+// The slots of the workers, numbered from 0 across them, are spread
+// over the "bind" addresses first, then over the "source_ports", so
+// every slot has its own address and port while there are enough
+static ngx_addr_t *
+select_radius_source(radius_server_t *rs, int family, ngx_uint_t slot)
+{
+    if (rs->bind == NULL) {
+        return NULL;
+    }
+
+    ngx_uint_t k, n = rs->bind->nelts;
+    ngx_addr_t *addrs = rs->bind->elts;
+    for (k = 0; k < n; k++) {
+        ngx_addr_t *addr = &addrs[(slot + k) % n];
+        if (addr->sockaddr->sa_family == family) {
+            return addr;
+        }
+    }
+
+    return NULL;
+}
+
+// A port still used by another socket, of a worker exiting after a
+// reload for instance, is replaced by an ephemeral one
+static ngx_int_t
+bind_radius_socket(radius_server_t *rs,
+                   ngx_socket_t s,
+                   int family,
+                   ngx_uint_t slot,
+                   ngx_uint_t fixed_port,
+                   ngx_log_t *log)
+{
+    ngx_addr_t *addr = select_radius_source(rs, family, slot);
+    in_port_t port = 0;
+    if (fixed_port && rs->source_ports) {
+        ngx_uint_t n = rs->bind ? rs->bind->nelts : 1;
+        port = rs->source_port + slot / n % rs->source_ports;
+    }
+
+    if (addr == NULL && port == 0) {
+        return NGX_OK;
+    }
+
+    ngx_sockaddr_t sa;
+    socklen_t socklen;
+    if (addr) {
+        ngx_memcpy(&sa, addr->sockaddr, addr->socklen);
+        socklen = addr->socklen;
+    } else {
+        // The wildcard address, the port only
+        ngx_memzero(&sa, sizeof(sa));
+        sa.sockaddr.sa_family = family;
+        socklen = family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                     : sizeof(struct sockaddr_in);
+    }
+    ngx_inet_set_port(&sa.sockaddr, port);
+
+    if (bind(s, &sa.sockaddr, socklen) == -1) {
+        ngx_err_t err = ngx_socket_errno;
+        if (port == 0 || err != NGX_EADDRINUSE) {
+            LOG_ERR(log, err, "\"%V\" bind failed, port: %d",
+                    &rs->name, (int) port);
+            return NGX_ERROR;
+        }
+
+        LOG_NOTICE_LIMITED(&rs->log_limit, log, 0,
+                           "\"%V\" source port %d in use, "
+                           "an ephemeral port is used", &rs->name, (int) port);
+        ngx_inet_set_port(&sa.sockaddr, 0);
+        if (bind(s, &sa.sockaddr, socklen) == -1) {
+            LOG_ERR(log, ngx_socket_errno, "\"%V\" bind failed", &rs->name);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void
+close_radius_connection(ngx_connection_t *c)
+{
+
+    ngx_close_connection(c);
+}
+
+static void
+close_radius_req(radius_req_t *req)
+{
+    if (req->conn) {
+        close_radius_connection(req->conn);
+        req->conn = NULL;
+        req->rs->nconns--;
+    }
+    if (req->peers) {
+        release_radius_peers(req->peers);
+        req->peers = NULL;
+        req->peer = NULL;
+    }
+}
+
+static void
+radius_idle_handler(ngx_event_t *ev)
+{
+    radius_server_t *rs = ev->data;
+
+    // The free list is a stack, so the least recently used slots
+    // are at its bottom
+    radius_req_t *req;
+    for (req = rs->req_free_list;
+         req && rs->nconns > rs->min_sockets;
+         req = req->next)
+    {
+        if (req->conn
+            && ngx_current_msec - req->last_used >= rs->idle_timeout)
+        {
+            LOG_DEBUG(ev->log, "close idle socket \"%V\", req_id: %d",
+                      &rs->name, req->id);
+            close_radius_req(req);
+        }
+    }
+
+    ngx_add_timer(ev, rs->idle_timeout);
+}
+
+static radius_peer_t *
+select_radius_peer(radius_server_t *rs,
+                   ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_peers_t *peers = rs->peers;
+    if (peers->nelts == 1) {
+        return &peers->elts[0];
+    }
+
+    if (ctx->peer_tries == 0) {
+        // Share the load among the addresses
+        ctx->peer_first = pick_radius_peer(rs, peers);
+    }
+
+    // Skip the drained addresses and the ones that failed recently,
+    // unless all of them did
+    ngx_uint_t k;
+    for (k = ctx->peer_tries; k < peers->nelts; k++) {
+        radius_peer_t *peer = &peers->elts[(ctx->peer_first + k) % peers->nelts];
+        if (!peer->drained
+            && (ngx_msec_int_t) (peer->down_until - ngx_current_msec) <= 0)
+        {
+            ctx->peer_tries = k;
+            return peer;
+        }
+    }
+
+    for (k = ctx->peer_tries; k < peers->nelts; k++) {
+        radius_peer_t *peer = &peers->elts[(ctx->peer_first + k) % peers->nelts];
+        if (!peer->drained) {
+            ctx->peer_tries = k;
+            return peer;
+        }
+    }
+
+    return &peers->elts[(ctx->peer_first + ctx->peer_tries) % peers->nelts];
+}
+
+static ngx_int_t
+connect_radius_req(radius_req_t *req,
+                   radius_peers_t *peers,
+                   radius_peer_t *peer,
+                   ngx_log_t *log)
+{
+    if (req->rs->transport != RADIUS_TRANSPORT_UDP) {
+        return attach_radius_stream(req, peers, peer, log);
+    }
+
+    if (req->conn && req->peer == peer) {
+        return NGX_OK;
+    }
+
+    if (req->conn && req->peer
+        && req->peer->sockaddr->sa_family == peer->sockaddr->sa_family)
+    {
+        // Re-connecting a UDP socket just changes its peer address
+        if (connect(req->conn->fd, peer->sockaddr, peer->socklen) == -1) {
+            LOG_ERR(log, ngx_errno, "connect failed, addr: %V", &peer->name);
+            return NGX_ERROR;
+        }
+    } else {
+        if (req->conn) {
+            close_radius_connection(req->conn);
+            req->conn = NULL;
+        }
+
+        ngx_connection_t *c = create_radius_connection(peer->sockaddr,
+                                                       peer->socklen,
+                                                       req->rs, req->id,
+                                                       log);
+        if (c == NULL) {
+            return NGX_ERROR;
+        }
+        req->conn = c;
+        c->data = req;
+        req->rs->nconns++;
+
+    }
+
+    // Sockets of free slots are closed first on graceful shutdown,
+    // see ngx_close_idle_connections
+    req->conn->idle = !req->active;
+
+    if (req->peers != peers) {
+        peers->refs++;
+        if (req->peers) {
+            release_radius_peers(req->peers);
+        }
+        req->peers = peers;
+    }
+    req->peer = peer;
+
+    return NGX_OK;
+}
+
+static void
+mark_radius_peer_down(radius_req_t *req, ngx_log_t *log)
+{
+    radius_peer_t *peer = req->peer;
+    if (peer == NULL || req->peers->nelts == 1) {
+        return;
+    }
+
+    peer->down_until = ngx_current_msec + req->rs->fail_timeout;
+    LOG_NOTICE(log, 0, "\"%V\" addr: %V is down",
+               &req->rs->name, &peer->name);
+}
+
+static void
+complete_radius_req(radius_req_t *req)
+{
+    ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_COMPLETE, ctx->accepted);
+    update_radius_server_stats(req);
+    release_radius_req(req);
+    if (ctx->r) {
+        // Post RADIUS Auth done event
+        ngx_post_event(ctx->r->connection->write, &ngx_posted_events);
+    } else {
+        finish_radius_refresh(ctx);
+    }
+}
+
+static ngx_int_t
+attach_radius_stream(radius_req_t *req,
+                     radius_peers_t *peers,
+                     radius_peer_t *peer,
+                     ngx_log_t *log)
+{
+    radius_server_t *rs = req->rs;
+
+    // The least loaded connection to the peer, or a connection
+    // without pending requests to (re)open
+    radius_stream_t *stream = NULL;
+    radius_stream_t *spare = NULL;
+    radius_stream_t *busy = NULL;
+    size_t i;
+    for (i = 0; i < rs->nstreams; ++i) {
+        radius_stream_t *s = &rs->streams[i];
+        if (s->conn && s->peer == peer) {
+            if (stream == NULL || s->pending < stream->pending) {
+                stream = s;
+            }
+        } else if (s->pending == 0) {
+            if (spare == NULL || s->conn == NULL) {
+                spare = s;
+            }
+        } else if (busy == NULL || s->pending < busy->pending) {
+            busy = s;
+        }
+    }
+
+    // Spread the load over the pool before pipelining
+    if (spare && (stream == NULL || stream->pending)) {
+        close_radius_stream(spare);
+        ngx_int_t rc = open_radius_stream(spare, peers, peer, log);
+        if (rc != NGX_OK) {
+            if (rc == NGX_DECLINED) {
+                // Let the caller try the next address
+                req->peers = peers;
+                req->peer = peer;
+                mark_radius_peer_down(req, log);
+                req->peers = NULL;
+                req->peer = NULL;
+            }
+            return rc;
+        }
+        stream = spare;
+    }
+
+    if (stream == NULL) {
+        // All the connections are busy with other addresses
+        stream = busy;
+    }
+
+    req->stream = stream;
+    req->peers = stream->peers;
+    req->peer = stream->peer;
+    stream->pending++;
+    stream->conn->idle = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+open_radius_stream(radius_stream_t *stream,
+                   radius_peers_t *peers,
+                   radius_peer_t *peer,
+                   ngx_log_t *log)
+{
+    radius_server_t *rs = stream->rs;
+
+    ngx_peer_connection_t pc;
+    ngx_memzero(&pc, sizeof(pc));
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = &peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = log;
+    pc.log_error = NGX_ERROR_ERR;
+    // The connections are few and reopened, the ports are the system's
+    pc.local = select_radius_source(rs, peer->sockaddr->sa_family,
+                                    ngx_worker * rs->nstreams
+                                    + (stream - rs->streams));
+
+    ngx_int_t rc = ngx_event_connect_peer(&pc);
+    if (rc == NGX_ERROR) {
+        LOG_ERR(log, 0, "ngx_event_connect_peer failed, addr: %V",
+                &peer->name);
+        return NGX_ERROR;
+    }
+    if (rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (pc.connection) {
+            ngx_close_connection(pc.connection);
+        }
+        return NGX_DECLINED;
+    }
+
+    ngx_connection_t *c = pc.connection;
+    c->pool = ngx_create_pool(128, log);
+    if (c->pool == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_create_pool failed");
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    c->data = stream;
+    // Closed on graceful shutdown unless requests are pending
+    c->idle = 1;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+    c->read->handler = radius_stream_read_handler;
+    c->write->handler = radius_stream_write_handler;
+
+    stream->conn = c;
+    stream->peers = peers;
+    stream->peer = peer;
+    peers->refs++;
+
+    LOG_DEBUG(log, "\"%V\" connecting to addr: %V, fd: %d",
+              &rs->name, &peer->name, c->fd);
+
+    if (rc == NGX_OK) {
+        // Connected already, a write event follows anyway
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+static void
+close_radius_stream(radius_stream_t *stream)
+{
+    ngx_connection_t *c = stream->conn;
+    if (c) {
+#if (NGX_HTTP_SSL)
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+            (void) ngx_ssl_shutdown(c);
+        }
+#endif
+        ngx_pool_t *pool = c->pool;
+        ngx_close_connection(c);
+        ngx_destroy_pool(pool);
+        stream->conn = NULL;
+    }
+
+    if (stream->peers) {
+        release_radius_peers(stream->peers);
+        stream->peers = NULL;
+        stream->peer = NULL;
+    }
+
+    stream->connected = 0;
+    stream->send_head = NULL;
+    stream->send_tail = NULL;
+    stream->sent = 0;
+    stream->in_len = 0;
+}
+
+static void
+fail_radius_stream(radius_stream_t *stream,
+                   ngx_uint_t timedout,
+                   ngx_log_t *log)
+{
+    radius_server_t *rs = stream->rs;
+
+    // Every request pending on the connection is lost with it
+    size_t i;
+    for (i = 0; i < rs->req_queue_size; ++i) {
+        radius_req_t *req = &rs->req_queue[i];
+        ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+        if (!req->active || req->stream != stream || ctx == NULL) {
+            continue;
+        }
+
+        if (req->timer.timer_set) {
+            ngx_del_timer(&req->timer);
+        }
+
+        if (!ctx->done) {
+            mark_radius_peer_down(req, log);
+            ctx->done = 1;
+            if (timedout) {
+                ctx->timedout = 1;
+            } else {
+                ctx->connection_refused = 1;
+            }
+        }
+
+        complete_radius_req(req);
+    }
+
+    close_radius_stream(stream);
+}
+
+static void
+queue_radius_stream(radius_stream_t *stream, radius_req_t *req)
+{
+    req->send_next = NULL;
+    if (stream->send_tail) {
+        stream->send_tail->send_next = req;
+    } else {
+        stream->send_head = req;
+    }
+    stream->send_tail = req;
+
+    if (stream->connected) {
+        // Requests queued in the same event loop iteration
+        // are written together
+        ngx_post_event(stream->conn->write, &ngx_posted_events);
+    }
+}
+
+static ngx_int_t
+flush_radius_stream(radius_stream_t *stream)
+{
+    ngx_connection_t *c = stream->conn;
+
+    while (stream->send_head) {
+        radius_req_t *req = stream->send_head;
+        ssize_t n = c->send(c, req->buf + stream->sent,
+                            req->len - stream->sent);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (n == NGX_AGAIN) {
+            return ngx_handle_write_event(c->write, 0);
+        }
+
+        stream->sent += n;
+        if (stream->sent == req->len) {
+            stream->send_head = req->send_next;
+            req->send_next = NULL;
+            stream->sent = 0;
+        }
+    }
+    stream->send_tail = NULL;
+
+    return NGX_OK;
+}
+
+static void
+radius_stream_connected(radius_stream_t *stream)
+{
+    ngx_connection_t *c = stream->conn;
+
+    LOG_DEBUG(c->log, "\"%V\" connected to addr: %V, fd: %d",
+              &stream->rs->name, &stream->peer->name, c->fd);
+
+    stream->connected = 1;
+    if (flush_radius_stream(stream) != NGX_OK) {
+        fail_radius_stream(stream, 0, c->log);
+    }
+}
+
+static void
+radius_stream_write_handler(ngx_event_t *ev)
+{
+    ngx_connection_t *c = ev->data;
+    radius_stream_t *stream = c->data;
+
+    if (stream->connected) {
+        if (flush_radius_stream(stream) != NGX_OK) {
+            LOG_ERR(c->log, 0, "\"%V\" send failed, addr: %V",
+                    &stream->rs->name, &stream->peer->name);
+            fail_radius_stream(stream, 0, c->log);
+        }
+        return;
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+    if (err) {
+        LOG_ERR(c->log, err, "\"%V\" connect failed, addr: %V",
+                &stream->rs->name, &stream->peer->name);
+        fail_radius_stream(stream, 0, c->log);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+    radius_server_t *rs = stream->rs;
+    if (rs->transport == RADIUS_TRANSPORT_TLS && c->ssl == NULL) {
+        if (ngx_ssl_create_connection(rs->ssl, c, NGX_SSL_CLIENT) != NGX_OK) {
+            fail_radius_stream(stream, 0, c->log);
+            return;
+        }
+
+        c->ssl->save_session = radius_stream_save_session;
+        if (rs->ssl_session
+            && ngx_ssl_set_session(c, rs->ssl_session) != NGX_OK)
+        {
+            fail_radius_stream(stream, 0, c->log);
+            return;
+        }
+
+        ngx_int_t rc = ngx_ssl_handshake(c);
+        if (rc == NGX_AGAIN) {
+            c->ssl->handler = radius_stream_handshake_handler;
+            return;
+        }
+
+        radius_stream_handshake_handler(c);
+        return;
+    }
+#endif
+
+    radius_stream_connected(stream);
+}
+
+#if (NGX_HTTP_SSL)
+
+static void
+radius_stream_handshake_handler(ngx_connection_t *c)
+{
+    radius_stream_t *stream = c->data;
+    radius_server_t *rs = stream->rs;
+
+    if (!c->ssl->handshaked) {
+        LOG_ERR(c->log, 0, "\"%V\" TLS handshake failed, addr: %V",
+                &rs->name, &stream->peer->name);
+        fail_radius_stream(stream, 0, c->log);
+        return;
+    }
+
+    if (rs->tls_verify) {
+        long rc = SSL_get_verify_result(c->ssl->connection);
+        if (rc != X509_V_OK) {
+            LOG_ERR(c->log, 0, "\"%V\" certificate verify error: (%l:%s), "
+                    "addr: %V", &rs->name, rc,
+                    X509_verify_cert_error_string(rc), &stream->peer->name);
+            fail_radius_stream(stream, 0, c->log);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &rs->host) != NGX_OK) {
+            LOG_ERR(c->log, 0, "\"%V\" certificate does not match \"%V\", "
+                    "addr: %V", &rs->name, &rs->host, &stream->peer->name);
+            fail_radius_stream(stream, 0, c->log);
+            return;
+        }
+    }
+
+    LOG_DEBUG(c->log, "\"%V\" TLS session reused: %d",
+              &rs->name, SSL_session_reused(c->ssl->connection));
+
+    c->read->handler = radius_stream_read_handler;
+    c->write->handler = radius_stream_write_handler;
+
+    radius_stream_connected(stream);
+}
+
+static void
+radius_stream_save_session(ngx_connection_t *c)
+{
+    radius_stream_t *stream = c->data;
+    radius_server_t *rs = stream->rs;
+
+    ngx_ssl_session_t *session = ngx_ssl_get0_session(c);
+    if (session == NULL || !SSL_SESSION_up_ref(session)) {
+        return;
+    }
+
+    if (rs->ssl_session) {
+        ngx_ssl_free_session(rs->ssl_session);
+    }
+    rs->ssl_session = session;
+}
+
+#endif
+
+static void
+radius_stream_read_handler(ngx_event_t *ev)
+{
+    ngx_connection_t *c = ev->data;
+    radius_stream_t *stream = c->data;
+    ngx_log_t *log = c->log;
+
+    if (c->close) {
+        // Graceful shutdown, nothing is pending
+        start_radius_shutdown(log);
+        close_radius_stream(stream);
+        return;
+    }
+
+    for (;;) {
+        ssize_t n = c->recv(c, stream->in + stream->in_len,
+                            sizeof(stream->in) - stream->in_len);
+        if (n == NGX_AGAIN) {
+            break;
+        }
+        if (n == 0 || n == NGX_ERROR) {
+            LOG_INFO(log, "\"%V\" connection closed, addr: %V",
+                     &stream->rs->name, &stream->peer->name);
+            fail_radius_stream(stream, 0, log);
+            return;
+        }
+        stream->in_len += n;
+
+        // Replies come in any order, see RFC 6613
+        u_char *p = stream->in;
+        size_t left = stream->in_len;
+        while (left >= RADIUS_PKG_MIN) {
+            size_t len = (p[2] << 8) | p[3];
+            if (len < RADIUS_PKG_MIN || len > RADIUS_PKG_MAX) {
+                LOG_ERR(log, 0, "\"%V\" incorrect pkg len: %uz, addr: %V",
+                        &stream->rs->name, len, &stream->peer->name);
+                fail_radius_stream(stream, 0, log);
+                return;
+            }
+            if (left < len) {
+                break;
+            }
+
+            dispatch_radius_stream_pkg(stream, p, len, log);
+            p += len;
+            left -= len;
+        }
+
+        ngx_memmove(stream->in, p, left);
+        stream->in_len = left;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        fail_radius_stream(stream, 0, log);
+    }
+}
+
+static void
+dispatch_radius_stream_pkg(radius_stream_t *stream,
+                           const u_char *buf,
+                           size_t len,
+                           ngx_log_t *log)
+{
+    radius_server_t *rs = stream->rs;
+
+    uint8_t id = buf[1];
+    radius_req_t *req = id < rs->req_queue_size ? &rs->req_queue[id] : NULL;
+    if (req == NULL || !req->active || req->stream != stream
+        || req->ctx == NULL)
+    {
+        LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                        "\"%V\" unexpected reply, req_id: %d",
+                        &rs->name, id);
+        return;
+    }
+
+    RADIUS_PROBE_REQ(reply, req, len);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_REPLY, len);
+    int rc = parse_radius_pkg(buf, len, req->id, req->auth, &rs->secret);
+    RADIUS_PROBE_REQ(parse, req, rc);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_PARSE, rc);
+    if (rc < 0) {
+        LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                        "parse pkg error: %d, r: 0x%xl, req: 0x%xl",
+                        rc, req->ctx->r, req);
+        return;
+    }
+
+    if (req->timer.timer_set) {
+        ngx_del_timer(&req->timer);
+    }
+
+    ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+    req->accepted = rc == RADIUS_AUTH_ACCEPTED;
+    ctx->done = 1;
+    ctx->accepted = req->accepted;
+
+    LOG_DEBUG(log,
+              "accepted: %d, r: 0x%xl, req: 0x%xl, req_id: %d",
+              req->accepted, ctx->r, req, req->id);
+
+    complete_radius_req(req);
+}
+
+static void
+radius_stream_timeout_handler(ngx_event_t *ev)
+{
+    radius_req_t *req = ev->data;
+
+    LOG_INFO(ev->log, "\"%V\" timedout r: 0x%xl, req: 0x%xl, addr: %V",
+             &req->rs->name, req->ctx->r, req, &req->peer->name);
+    RADIUS_PROBE_REQ(timeout, req, 0);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_TIMEOUT, 0);
+
+    // The connection is stuck, the rest of its requests are failed over
+    fail_radius_stream(req->stream, 1, ev->log);
+}
+
+static void
+release_radius_peers(radius_peers_t *peers)
+{
+    if (--peers->refs == 0 && peers->pool) {
+        ngx_destroy_pool(peers->pool);
+    }
+}
+
+static void
+start_radius_shutdown(ngx_log_t *log)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+
+    if (mcf == NULL || mcf->shutdown_ev.timer_set || mcf->shutdown_ev.data) {
+        return;
+    }
+
+    LOG_INFO(log, "waiting %M ms for requests in flight",
+             mcf->shutdown_timeout);
+
+    mcf->shutdown_ev.handler = radius_shutdown_handler;
+    mcf->shutdown_ev.data = mcf;
+    mcf->shutdown_ev.log = log;
+    // Requests in flight keep their own timers,
+    // so the deadline alone doesn't delay the exit
+    mcf->shutdown_ev.cancelable = 1;
+    ngx_add_timer(&mcf->shutdown_ev, mcf->shutdown_timeout);
+}
+
+static void
+radius_shutdown_handler(ngx_event_t *ev)
+{
+    ngx_http_auth_radius_main_conf_t *mcf = ev->data;
+
+    if (mcf->servers == NULL) {
+        return;
+    }
+
+    size_t i, j;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; ++i) {
+        radius_server_t *rs = &rss[i];
+        for (j = 0; j < rs->req_queue_size; ++j) {
+            radius_req_t *req = &rs->req_queue[j];
+            ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+            if (!req->active || ctx == NULL) {
+                continue;
+            }
+
+            LOG_NOTICE(ev->log, 0, "shutdown timedout r: 0x%xl, req: 0x%xl",
+                       ctx->r, req);
+
+            ctx->done = 1;
+            ctx->shutdown = 1;
+
+            if (req->stream) {
+                // Completed along with the connection below
+                continue;
+            }
+
+            if (req->conn->read->timer_set) {
+                ngx_del_timer(req->conn->read);
+            }
+            complete_radius_req(req);
+        }
+
+        for (j = 0; j < rs->nstreams; ++j) {
+            if (rs->streams[j].pending) {
+                fail_radius_stream(&rs->streams[j], 0, ev->log);
+            }
+        }
+    }
+}
+
+static void
+radius_resolve_timer_handler(ngx_event_t *ev)
+{
+    radius_server_t *rs = ev->data;
+    ngx_log_t *log = ev->log;
+
+    ngx_resolver_ctx_t *ctx = ngx_resolve_start(rs->resolver, NULL);
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        LOG_ERR(log, 0, "ngx_resolve_start failed, host: %V", &rs->host);
+        ngx_add_timer(&rs->resolve_ev, rs->resolve_interval);
+        return;
+    }
+
+    ctx->name = rs->host;
+    ctx->handler = radius_resolve_handler;
+    ctx->data = rs;
+    ctx->timeout = rs->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        // The context is freed by the resolver
+        LOG_ERR(log, 0, "ngx_resolve_name failed, host: %V", &rs->host);
+        ngx_add_timer(&rs->resolve_ev, rs->resolve_interval);
+    }
+}
+
+static void
+radius_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    radius_server_t *rs = ctx->data;
+    ngx_log_t *log = rs->resolve_ev.log;
+    radius_peers_t *old = rs->peers;
+
+    if (ctx->state) {
+        // Keep using the known addresses
+        LOG_ERR(log, 0, "\"%V\" could not be resolved (%i: %s)",
+                &ctx->name, ctx->state, ngx_resolver_strerror(ctx->state));
+        goto done;
+    }
+
+    // All of them, they are copied to the new peers if any changed
+    size_t i, j;
+    for (i = 0; i < ctx->naddrs; i++) {
+        ngx_inet_set_port(ctx->addrs[i].sockaddr, rs->port);
+    }
+
+    ngx_uint_t changed = ctx->naddrs != old->nbase;
+    for (i = 0; i < ctx->naddrs && !changed; i++) {
+        for (j = 0; j < old->nbase; j++) {
+            if (ngx_cmp_sockaddr(ctx->addrs[i].sockaddr, ctx->addrs[i].socklen,
+                                 old->elts[j].sockaddr, old->elts[j].socklen,
+                                 1) == NGX_OK)
+            {
+                break;
+            }
+        }
+        changed = j == old->nbase;
+    }
+
+    if (!changed) {
+        goto done;
+    }
+
+    ngx_addr_t *addrs = ngx_alloc(ctx->naddrs * sizeof(ngx_addr_t), log);
+    if (addrs == NULL) {
+        goto done;
+    }
+    for (i = 0; i < ctx->naddrs; i++) {
+        addrs[i].sockaddr = ctx->addrs[i].sockaddr;
+        addrs[i].socklen = ctx->addrs[i].socklen;
+        ngx_str_null(&addrs[i].name);
+    }
+
+    radius_peers_t *peers = create_radius_peers(rs, addrs, ctx->naddrs, log);
+    ngx_free(addrs);
+    if (peers == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < peers->nbase; i++) {
+        LOG_INFO(log, "\"%V\", addr: %V", &rs->name, &peers->elts[i].name);
+    }
+
+    // Requests in flight keep their connections to the old addresses,
+    // the slots are re-connected as they are acquired
+    rs->peers = peers;
+    rs->peer_idx = 0;
+    release_radius_peers(old);
+
+done:
+    ngx_resolve_name_done(ctx);
+    ngx_add_timer(&rs->resolve_ev, rs->resolve_interval);
+}
+
+static radius_peers_t *
+create_radius_peers(radius_server_t *rs,
+                    ngx_addr_t *addrs,
+                    ngx_uint_t naddrs,
+                    ngx_log_t *log)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+    radius_peers_t *old = rs->peers;
+    size_t i, j;
+
+    ngx_pool_t *pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_create_pool failed");
+        return NULL;
+    }
+
+    radius_peers_t *peers = ngx_pcalloc(pool, sizeof(radius_peers_t));
+    if (peers == NULL) {
+        goto failed;
+    }
+    peers->elts = ngx_pcalloc(pool, (naddrs + mcf->nentries)
+                                    * sizeof(radius_peer_t));
+    if (peers->elts == NULL) {
+        goto failed;
+    }
+    peers->pool = pool;
+
+    // The base addresses, then the ones added through radius_api
+    ngx_uint_t n = 0;
+    for (i = 0; i < naddrs + mcf->nentries; i++) {
+        struct sockaddr *sockaddr;
+        socklen_t socklen;
+        if (i < naddrs) {
+            sockaddr = addrs[i].sockaddr;
+            socklen = addrs[i].socklen;
+        } else {
+            radius_state_entry_t *e = &mcf->entries[i - naddrs];
+            if (e->server != rs->hash || !e->added) {
+                continue;
+            }
+            sockaddr = &e->sockaddr.sockaddr;
+            socklen = e->socklen;
+            for (j = 0; j < naddrs; j++) {
+                if (ngx_cmp_sockaddr(sockaddr, socklen,
+                                     addrs[j].sockaddr, addrs[j].socklen,
+                                     1) == NGX_OK)
+                {
+                    break;
+                }
+            }
+            if (j < naddrs) {
+                continue;
+            }
+        }
+
+        radius_peer_t *peer = &peers->elts[n++];
+        peer->socklen = socklen;
+        peer->sockaddr = ngx_palloc(pool, socklen);
+        peer->name.data = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+        if (peer->sockaddr == NULL || peer->name.data == NULL) {
+            goto failed;
+        }
+        ngx_memcpy(peer->sockaddr, sockaddr, socklen);
+        peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->socklen,
+                                       peer->name.data, NGX_SOCKADDR_STRLEN, 1);
+        peer->weight = 1;
+        peer->added = i >= naddrs;
+
+        // Runtime changes of the address
+        for (j = 0; j < mcf->nentries; j++) {
+            radius_state_entry_t *e = &mcf->entries[j];
+            if (e->server == rs->hash && e->socklen
+                && ngx_cmp_sockaddr(&e->sockaddr.sockaddr, e->socklen,
+                                    peer->sockaddr, peer->socklen,
+                                    1) == NGX_OK)
+            {
+                peer->weight = e->weight;
+                peer->drained = e->drained;
+                break;
+            }
+        }
+
+        // Carry over the failure state of the known addresses
+        for (j = 0; old && j < old->nelts; j++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 old->elts[j].sockaddr, old->elts[j].socklen,
+                                 1) == NGX_OK)
+            {
+                peer->down_until = old->elts[j].down_until;
+                break;
+            }
+        }
+    }
+    peers->nbase = naddrs;
+    peers->nelts = n;
+    peers->refs = 1;
+
+    return peers;
+
+failed:
+    LOG_ERR(log, ngx_errno, "ngx_palloc failed");
+    ngx_destroy_pool(pool);
+    return NULL;
+}
+
+static ngx_uint_t
+pick_radius_peer(radius_server_t *rs, radius_peers_t *peers)
+{
+    // Smooth weighted round-robin, as in the upstream module
+    radius_peer_t *best = NULL;
+    ngx_uint_t i, idx = 0;
+    ngx_int_t total = 0;
+    for (i = 0; i < peers->nelts; i++) {
+        radius_peer_t *peer = &peers->elts[i];
+        if (peer->drained
+            || (ngx_msec_int_t) (peer->down_until - ngx_current_msec) > 0)
+        {
+            continue;
+        }
+
+        peer->current_weight += peer->weight;
+        total += peer->weight;
+        if (best == NULL || peer->current_weight > best->current_weight) {
+            best = peer;
+            idx = i;
+        }
+    }
+
+    if (best == NULL) {
+        // All down or drained, rotate anyway
+        return rs->peer_idx++;
+    }
+
+    best->current_weight -= total;
+    return idx;
+}
+
+static void
+sync_radius_state(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
+{
+    if (mcf->state == NULL || mcf->servers == NULL) {
+        return;
+    }
+
+    radius_state_zone_t *sz = mcf->state->data;
+    if (sz->sh->generation == mcf->state_generation) {
+        return;
+    }
+
+    ngx_pool_t *pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_create_pool failed");
+        return;
+    }
+
+    // Copy the changes out, the peers are built without the lock
+    ngx_shmtx_lock(&sz->shpool->mutex);
+    ngx_atomic_uint_t generation = sz->sh->generation;
+    ngx_uint_t n = sz->sh->nentries;
+    radius_state_entry_t *entries = ngx_palloc(pool,
+                                               (n + 1) * sizeof(radius_state_entry_t));
+    if (entries) {
+        ngx_memcpy(entries, sz->sh->entries, n * sizeof(radius_state_entry_t));
+    }
+    ngx_shmtx_unlock(&sz->shpool->mutex);
+
+    if (entries == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_palloc failed");
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    if (mcf->state_pool) {
+        ngx_destroy_pool(mcf->state_pool);
+    }
+    mcf->state_pool = pool;
+    mcf->entries = entries;
+    mcf->nentries = n;
+    mcf->state_generation = generation;
+
+    size_t i, j;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        radius_server_t *rs = &rss[i];
+
+        rs->drained = 0;
+        for (j = 0; j < n; j++) {
+            if (entries[j].server == rs->hash && entries[j].socklen == 0) {
+                rs->drained = entries[j].drained;
+            }
+        }
+
+        radius_peers_t *old = rs->peers;
+        ngx_addr_t *addrs = ngx_palloc(pool, old->nbase * sizeof(ngx_addr_t));
+        if (addrs == NULL) {
+            LOG_ERR(log, ngx_errno, "ngx_palloc failed");
+            continue;
+        }
+        for (j = 0; j < old->nbase; j++) {
+            addrs[j].sockaddr = old->elts[j].sockaddr;
+            addrs[j].socklen = old->elts[j].socklen;
+            addrs[j].name = old->elts[j].name;
+        }
+
+        radius_peers_t *peers = create_radius_peers(rs, addrs, old->nbase, log);
+        if (peers == NULL) {
+            continue;
+        }
+
+        rs->peers = peers;
+        release_radius_peers(old);
+    }
+
+    LOG_INFO(log, "radius state generation: %uA", generation);
+}
+
+static ngx_int_t
+update_radius_state(ngx_http_auth_radius_main_conf_t *mcf,
+                    radius_state_entry_t *change,
+                    ngx_uint_t remove)
+{
+    radius_state_zone_t *sz = mcf->state->data;
+    radius_state_shctx_t *sh = sz->sh;
+    ngx_int_t rc = NGX_OK;
+
+    ngx_shmtx_lock(&sz->shpool->mutex);
+
+    radius_state_entry_t *e = NULL;
+    size_t i;
+    for (i = 0; i < sh->nentries; i++) {
+        if (sh->entries[i].server == change->server
+            && sh->entries[i].socklen == change->socklen
+            && (change->socklen == 0
+                || ngx_cmp_sockaddr(&sh->entries[i].sockaddr.sockaddr,
+                                    sh->entries[i].socklen,
+                                    &change->sockaddr.sockaddr,
+                                    change->socklen, 1) == NGX_OK))
+        {
+            e = &sh->entries[i];
+            break;
+        }
+    }
+
+    if (remove) {
+        if (e == NULL || !e->added) {
+            rc = NGX_DECLINED;
+            goto done;
+        }
+        *e = sh->entries[--sh->nentries];
+    } else if (e) {
+        e->weight = change->weight;
+        e->drained = change->drained;
+        e->added |= change->added;
+    } else if (sh->nentries < sh->capacity) {
+        sh->entries[sh->nentries++] = *change;
+    } else {
+        rc = NGX_BUSY;
+        goto done;
+    }
+
+    sh->generation++;
+
+done:
+    ngx_shmtx_unlock(&sz->shpool->mutex);
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_auth_radius_api_handler(ngx_http_request_t *r)
+{
+    ngx_log_t *log = r->connection->log;
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD | NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    ngx_int_t rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_auth_radius_module);
+    sync_radius_state(mcf, log);
+
+    // GET ?slow
+    ngx_str_t arg;
+    if (!(r->method & NGX_HTTP_POST)) {
+        if (ngx_http_arg(r, (u_char *) "slow", 4, &arg) == NGX_OK) {
+            return send_radius_slow_log(r, mcf);
+        }
+        return send_radius_api_state(r, mcf);
+    }
+
+    // POST ?flush=<cache zone>
+    if (ngx_http_arg(r, (u_char *) "flush", 5, &arg) == NGX_OK) {
+        size_t i;
+        ngx_shm_zone_t **caches = mcf->caches ? mcf->caches->elts : NULL;
+        for (i = 0; caches && i < mcf->caches->nelts; i++) {
+            if (caches[i]->shm.name.len == arg.len
+                && ngx_strncmp(caches[i]->shm.name.data, arg.data, arg.len) == 0)
+            {
+                flush_radius_cache(caches[i]);
+                LOG_NOTICE(log, 0, "radius cache \"%V\" flushed", &arg);
+                return send_radius_api_state(r, mcf);
+            }
+        }
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    // POST ?server=<name>[&addr=<addr>](&drain=0|1|&weight=<n>)
+    // POST ?server=<name>&add=<addr>|&remove=<addr>
+    if (mcf->state == NULL) {
+        LOG_ERR(log, 0, "radius_api changes need \"radius_state_zone\"");
+        return NGX_HTTP_CONFLICT;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "server", 6, &arg) != NGX_OK
+        || mcf->servers == NULL)
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    radius_server_t *rs = NULL;
+    size_t i;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        if (rss[i].name.len == arg.len
+            && ngx_strncmp(rss[i].name.data, arg.data, arg.len) == 0)
+        {
+            rs = &rss[i];
+            break;
+        }
+    }
+    if (rs == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    radius_state_entry_t change;
+    ngx_memzero(&change, sizeof(change));
+    change.server = rs->hash;
+    change.weight = 1;
+    ngx_uint_t remove = 0;
+
+    ngx_addr_t addr;
+    radius_peer_t *peer = NULL;
+    if (ngx_http_arg(r, (u_char *) "addr", 4, &arg) == NGX_OK
+        || ngx_http_arg(r, (u_char *) "add", 3, &arg) == NGX_OK
+        || (remove = ngx_http_arg(r, (u_char *) "remove", 6, &arg) == NGX_OK))
+    {
+        if (ngx_parse_addr_port(r->pool, &addr, arg.data, arg.len) != NGX_OK
+            || addr.socklen > sizeof(ngx_sockaddr_t))
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        if (ngx_inet_get_port(addr.sockaddr) == 0) {
+            ngx_inet_set_port(addr.sockaddr, rs->port);
+        }
+        ngx_memcpy(&change.sockaddr, addr.sockaddr, addr.socklen);
+        change.socklen = addr.socklen;
+
+        for (i = 0; i < rs->peers->nelts; i++) {
+            if (ngx_cmp_sockaddr(rs->peers->elts[i].sockaddr,
+                                 rs->peers->elts[i].socklen,
+                                 addr.sockaddr, addr.socklen, 1) == NGX_OK)
+            {
+                peer = &rs->peers->elts[i];
+                break;
+            }
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "add", 3, &arg) == NGX_OK) {
+        change.added = 1;
+    } else if (!remove) {
+        if (change.socklen && peer == NULL) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        // Keep what isn't changed
+        if (peer) {
+            change.weight = peer->weight;
+            change.drained = peer->drained;
+            change.added = peer->added;
+        } else {
+            change.drained = rs->drained;
+        }
+
+        ngx_uint_t changed = 0;
+        if (ngx_http_arg(r, (u_char *) "drain", 5, &arg) == NGX_OK) {
+            if (arg.len != 1 || (arg.data[0] != '0' && arg.data[0] != '1')) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+            change.drained = arg.data[0] == '1';
+            changed = 1;
+        }
+        if (peer && ngx_http_arg(r, (u_char *) "weight", 6, &arg) == NGX_OK) {
+            ngx_int_t weight = ngx_atoi(arg.data, arg.len);
+            if (weight == NGX_ERROR || weight == 0) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+            change.weight = weight;
+            changed = 1;
+        }
+        if (!changed) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    rc = update_radius_state(mcf, &change, remove);
+    if (rc == NGX_DECLINED) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+    if (rc == NGX_BUSY) {
+        LOG_ERR(log, 0, "radius state zone \"%V\" is full",
+                &mcf->state->shm.name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    LOG_NOTICE(log, 0, "radius state changed: %V", &r->args);
+
+    sync_radius_state(mcf, log);
+    return send_radius_api_state(r, mcf);
+}
+
+static ngx_int_t
+send_radius_api_state(ngx_http_request_t *r,
+                      ngx_http_auth_radius_main_conf_t *mcf)
+{
+    // This worker's view, the runtime changes are the same in all of them
+    size_t i, j;
+    size_t size = sizeof("{\"pid\":,\"generation\":,\"servers\":[]}")
+                  + 2 * NGX_ATOMIC_T_LEN;
+    radius_server_t *rss = mcf->servers ? mcf->servers->elts : NULL;
+    ngx_uint_t n = mcf->servers ? mcf->servers->nelts : 0;
+    for (i = 0; i < n; i++) {
+        size += sizeof("{\"name\":\"\",\"drained\":false,\"ejected\":false,"
+                       "\"rtt_us\":,\"errors\":,\"limit\":,"
+                       "\"inflight\":,\"addrs\":[]},")
+                + 4 * NGX_ATOMIC_T_LEN
+                + ngx_escape_json(NULL, rss[i].name.data, rss[i].name.len)
+                + rss[i].name.len;
+        size += rss[i].peers->nelts
+                * (sizeof("{\"addr\":\"\",\"weight\":,\"drained\":false,"
+                          "\"down\":false,\"added\":false},")
+                   + NGX_SOCKADDR_STRLEN + NGX_ATOMIC_T_LEN);
+    }
+
+    radius_class_t *cls = mcf->classes ? mcf->classes->elts : NULL;
+    ngx_uint_t ncls = mcf->classes ? mcf->classes->nelts : 0;
+    for (i = 0; i < ncls; i++) {
+        size += n * (sizeof(",\"classes\":[]")
+                     + sizeof("{\"name\":\"\",\"weight\":,\"waiting\":,"
+                              "\"queued\":,\"granted\":,\"rejected\":,"
+                              "\"wait_ms\":},")
+                     + 6 * NGX_ATOMIC_T_LEN
+                     + ngx_escape_json(NULL, cls[i].name.data, cls[i].name.len)
+                     + cls[i].name.len);
+    }
+
+    radius_acct_queue_t *q = mcf->acct;
+    if (q) {
+        size += sizeof(",\"accounting\":{\"queued\":,\"spill_bytes\":,"
+                       "\"recorded\":,\"sent\":,\"acked\":,\"retried\":,"
+                       "\"failed\":,\"dropped\":,\"spilled\":}")
+                + 9 * NGX_OFF_T_LEN;
+    }
+
+    ngx_shm_zone_t **limits = mcf->limits ? mcf->limits->elts : NULL;
+    ngx_uint_t nlimits = mcf->limits ? mcf->limits->nelts : 0;
+    if (nlimits) {
+        size += sizeof("\"limits\":[],");
+    }
+    for (i = 0; i < nlimits; i++) {
+        ngx_str_t *name = &limits[i]->shm.name;
+        size += sizeof("{\"name\":\"\",\"passed\":,\"limited\":},")
+                + 2 * NGX_ATOMIC_T_LEN
+                + ngx_escape_json(NULL, name->data, name->len) + name->len;
+    }
+
+    radius_dynauth_t *da = mcf->dynauth;
+    if (da) {
+        size += sizeof(",\"dynauth\":{\"received\":,\"acked\":,"
+                       "\"naked\":,\"invalid\":,\"evicted\":}")
+                + 5 * NGX_ATOMIC_T_LEN;
+    }
+
+    ngx_buf_t *b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    u_char *p = b->last;
+    p = ngx_sprintf(p, "{\"pid\":%P,\"generation\":%uA,",
+                    ngx_pid, mcf->state_generation);
+    if (da) {
+        p = ngx_sprintf(p, "\"dynauth\":{\"received\":%ui,\"acked\":%ui,"
+                        "\"naked\":%ui,\"invalid\":%ui,\"evicted\":%ui},",
+                        da->received, da->acked, da->naked, da->invalid,
+                        da->evicted);
+    }
+    if (q) {
+        p = ngx_sprintf(p, "\"accounting\":{\"queued\":%ui,"
+                        "\"spill_bytes\":%O,\"recorded\":%ui,\"sent\":%ui,"
+                        "\"acked\":%ui,\"retried\":%ui,\"failed\":%ui,"
+                        "\"dropped\":%ui,\"spilled\":%ui},",
+                        q->count, q->spill_write - q->spill_read, q->recorded,
+                        q->sent, q->acked, q->retried, q->failed, q->dropped,
+                        q->spilled);
+    }
+    if (nlimits) {
+        // Shared by the workers
+        p = ngx_sprintf(p, "\"limits\":[");
+        for (i = 0; i < nlimits; i++) {
+            radius_limit_zone_t *lz = limits[i]->data;
+            ngx_str_t *name = &limits[i]->shm.name;
+            p = ngx_sprintf(p, "%s{\"name\":\"", i ? "," : "");
+            p = (u_char *) ngx_escape_json(p, name->data, name->len);
+            p = ngx_sprintf(p, "\",\"passed\":%uA,\"limited\":%uA}",
+                            lz->sh->passed, lz->sh->limited);
+        }
+        p = ngx_sprintf(p, "],");
+    }
+    p = ngx_sprintf(p, "\"servers\":[");
+    for (i = 0; i < n; i++) {
+        radius_server_t *rs = &rss[i];
+        p = ngx_sprintf(p, "%s{\"name\":\"", i ? "," : "");
+        p = (u_char *) ngx_escape_json(p, rs->name.data, rs->name.len);
+        p = ngx_sprintf(p, "\",\"drained\":%s,\"ejected\":%s,"
+                        "\"rtt_us\":%ui,\"errors\":%ui,\"limit\":%ui,"
+                        "\"inflight\":%ui,\"addrs\":[",
+                        rs->drained ? "true" : "false",
+                        rs->ejected_until ? "true" : "false",
+                        rs->rtt, rs->errors,
+                        rs->limit ? rs->limit : rs->req_queue_size,
+                        rs->inflight);
+        for (j = 0; j < rs->peers->nelts; j++) {
+            radius_peer_t *peer = &rs->peers->elts[j];
+            ngx_uint_t down = (ngx_msec_int_t) (peer->down_until
+                                                - ngx_current_msec) > 0;
+            p = ngx_sprintf(p, "%s{\"addr\":\"%V\",\"weight\":%ui,"
+                            "\"drained\":%s,\"down\":%s,\"added\":%s}",
+                            j ? "," : "", &peer->name, peer->weight,
+                            peer->drained ? "true" : "false",
+                            down ? "true" : "false",
+                            peer->added ? "true" : "false");
+        }
+        p = ngx_sprintf(p, "]");
+        if (rs->qos) {
+            p = ngx_sprintf(p, ",\"classes\":[");
+            for (j = 0; j < ncls; j++) {
+                radius_qos_t *qos = &rs->qos[j];
+                p = ngx_sprintf(p, "%s{\"name\":\"", j ? "," : "");
+                p = (u_char *) ngx_escape_json(p, cls[j].name.data,
+                                               cls[j].name.len);
+                p = ngx_sprintf(p, "\",\"weight\":%ui,\"waiting\":%ui,"
+                                "\"queued\":%ui,\"granted\":%ui,"
+                                "\"rejected\":%ui,\"wait_ms\":%M}",
+                                cls[j].weight, qos->nwaiting, qos->queued,
+                                qos->granted, qos->rejected, qos->wait_time);
+            }
+            p = ngx_sprintf(p, "]");
+        }
+        p = ngx_sprintf(p, "}");
+    }
+    p = ngx_sprintf(p, "]}" CRLF);
+    b->last = p;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    ngx_chain_t out;
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+// The slow requests of this worker, oldest first
+static ngx_int_t
+send_radius_slow_log(ngx_http_request_t *r,
+                     ngx_http_auth_radius_main_conf_t *mcf)
+{
+    radius_slow_log_t *sl = mcf->slow_log;
+    if (sl == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    size_t i, j, name_len = sizeof("null") - 1;
+    radius_server_t *rss = mcf->servers ? mcf->servers->elts : NULL;
+    ngx_uint_t nservers = mcf->servers ? mcf->servers->nelts : 0;
+    for (i = 0; i < nservers; i++) {
+        size_t len = sizeof("\"\"") - 1 + rss[i].name.len
+                     + ngx_escape_json(NULL, rss[i].name.data,
+                                       rss[i].name.len);
+        name_len = ngx_max(name_len, len);
+    }
+
+    ngx_uint_t n = ngx_min(sl->recorded, sl->size);
+    ngx_uint_t first = sl->recorded > sl->size ? sl->next : 0;
+
+    size_t size = sizeof("{\"pid\":,\"threshold_ms\":,\"recorded\":,"
+                         "\"auths\":[]}" CRLF)
+                  + 3 * NGX_ATOMIC_T_LEN;
+    for (i = 0; i < n; i++) {
+        radius_trace_t *trace = &sl->ring[(first + i) % sl->size];
+        size += sizeof("{\"connection\":,\"request\":,\"time_ms\":,"
+                       "\"dropped\":,\"events\":[]},")
+                + 4 * NGX_ATOMIC_T_LEN
+                + trace->n * (sizeof("{\"at\":,\"event\":\"reschedule\","
+                                     "\"server\":,\"id\":,\"arg\":},")
+                              + 3 * NGX_INT32_LEN + name_len);
+    }
+
+    ngx_buf_t *b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    u_char *p = b->last;
+    p = ngx_sprintf(p, "{\"pid\":%P,\"threshold_ms\":%M,\"recorded\":%ui,"
+                    "\"auths\":[", ngx_pid, sl->threshold, sl->recorded);
+    for (i = 0; i < n; i++) {
+        radius_trace_t *trace = &sl->ring[(first + i) % sl->size];
+        p = ngx_sprintf(p, "%s{\"connection\":%uA,\"request\":%ui,"
+                        "\"time_ms\":%uD,\"dropped\":%ui,\"events\":[",
+                        i ? "," : "", trace->connection, trace->requests,
+                        trace->events[trace->n - 1].at, trace->dropped);
+        for (j = 0; j < trace->n; j++) {
+            radius_trace_event_t *e = &trace->events[j];
+            p = ngx_sprintf(p, "%s{\"at\":%uD,\"event\":\"%s\",\"server\":",
+                            j ? "," : "", e->at,
+                            radius_trace_names[e->event]);
+            if (e->server) {
+                ngx_str_t *name = &rss[e->server - 1].name;
+                *p++ = '"';
+                p = (u_char *) ngx_escape_json(p, name->data, name->len);
+                *p++ = '"';
+            } else {
+                p = ngx_sprintf(p, "null");
+            }
+            p = ngx_sprintf(p, ",\"id\":%d,\"arg\":%D}",
+                            (int) e->ident, e->arg);
+        }
+        p = ngx_sprintf(p, "]}");
+    }
+    p = ngx_sprintf(p, "]}" CRLF);
+    b->last = p;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    ngx_chain_t out;
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t
+init_radius_state_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    radius_state_zone_t *osz = data;
+    radius_state_zone_t *sz = shm_zone->data;
+
+    if (osz) {
+        // Reload, the runtime changes survive it
+        sz->sh = osz->sh;
+        sz->shpool = osz->shpool;
+        return NGX_OK;
+    }
+
+    sz->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        sz->sh = sz->shpool->data;
+        return NGX_OK;
+    }
+
+    sz->sh = ngx_slab_calloc(sz->shpool, sizeof(radius_state_shctx_t));
+    if (sz->sh == NULL) {
+        return NGX_ERROR;
+    }
+    sz->shpool->data = sz->sh;
+
+    sz->sh->capacity = shm_zone->shm.size / 2 / sizeof(radius_state_entry_t);
+    sz->sh->entries = ngx_slab_calloc(sz->shpool, sz->sh->capacity
+                                                  * sizeof(radius_state_entry_t));
+    if (sz->sh->entries == NULL) {
+        return NGX_ERROR;
+    }
+    // Workers start at generation 0, so sync when something changes
+    sz->sh->generation = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+select_radius_server(ngx_http_request_t *r,
+                     const ngx_array_t *server_ptrs,
+                     ngx_http_auth_radius_ctx_t *ctx)
+{
+    ngx_log_t *log = r->connection->log;
+
+    assert(server_ptrs != NULL);
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_auth_radius_module);
+    if (mcf->shutdown_ev.data && !mcf->shutdown_ev.timer_set) {
+        // Shutdown timeout expired, don't start anything new
+        LOG_INFO(log, "shutdown timedout r: 0x%xl", r);
+        r->keepalive = 0;
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    radius_server_t *rs = current_radius_server(server_ptrs, ctx);
+    while (rs->drained) {
+        ctx->peer_tries = 0;
+        if (ctx->rs_idx + 1u >= server_ptrs->nelts) {
+            LOG_INFO(log, "all servers drained r: 0x%xl", r);
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+        ctx->rs_idx++;
+        rs = current_radius_server(server_ptrs, ctx);
+    }
+
+    radius_req_t *req = NULL;
+    ngx_int_t qrc = acquire_radius_slot(rs, ctx, &req);
+    if (qrc == NGX_AGAIN) {
+        // Woken up by grant_radius_slots
+        return NGX_AGAIN;
+    }
+    if (qrc == NGX_DECLINED) {
+        LOG_NOTICE_LIMITED(&rs->log_limit, log, 0,
+                           "\"%V\" radius_qos_class queue is full "
+                           "r: 0x%xl", &rs->name, r);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+    if (qrc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (req != NULL) {
+        radius_peers_t *peers = rs->peers;
+        radius_peer_t *peer = select_radius_peer(rs, ctx);
+        ngx_int_t rc = connect_radius_req(req, peers, peer, log);
+        if (rc == NGX_DECLINED) {
+            // Handled as refused by the next handler pass
+            release_radius_req(req);
+            ctx->done = 1;
+            ctx->connection_refused = 1;
+            RADIUS_TRACE(ctx, RADIUS_TRACE_REFUSED, rs, -1, 0);
+            ngx_post_event(r->connection->write, &ngx_posted_events);
+            return NGX_AGAIN;
+        }
+        if (rc != NGX_OK) {
+            release_radius_req(req);
+            LOG_INFO(log, "internal error r: 0x%xl", r);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    } else {
+        LOG_NOTICE_LIMITED(&rs->log_limit, log, 0,
+                           "\"%V\" requests queue is full, rescheduling...",
+                           &rs->name);
+        RADIUS_PROBE(reschedule, r, NULL, rs, -1, 0,
+                     rs->limit ? rs->limit : rs->req_queue_size);
+        RADIUS_TRACE(ctx, RADIUS_TRACE_RESCHEDULE, rs, -1,
+                     rs->limit ? rs->limit : rs->req_queue_size);
+
+        // Subscribe to reschedule timeout event
+        ngx_event_t *ev = ngx_pcalloc(r->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed r: 0x%xl", r);
+            return NGX_ERROR;
+        }
+        ev->data = r;
+        ev->handler = radius_reschedule_handler;
+        ev->log = r->connection->log;
+        ngx_add_timer(ev, 100);
+
+        return NGX_AGAIN;
+    }
+
+    if (ctx->type == AUTH) {
+        ctx->timeout = rs->auth_timeout;
+        ctx->retries = rs->auth_retries;
+    } else {
+        ctx->timeout = rs->health_timeout;
+        ctx->retries = rs->health_retries;
+    }
+    ctx->req = req;
+    ctx->done = 0;
+    ctx->accepted = 0;
+    ctx->timedout = 0;
+    ctx->connection_refused = 0;
+    ctx->internal_error = 0;
+
+    req->ctx = ctx;
+    RADIUS_PROBE_REQ(slot__acquire, req, ctx->rs_idx);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_SLOT, ctx->peer_tries);
+
+    LOG_DEBUG(log, "r: 0x%xl, rs: 0x%xl, req: 0x%xl, req_id: %d, addr: %V",
+              r, rs, req, req->id, &req->peer->name);
+    send_radius_request(ctx, req);
+
+    return NGX_AGAIN;
+}
+
+static ngx_int_t
+order_radius_servers(ngx_http_auth_radius_loc_conf_t *lcf,
+                     ngx_http_auth_radius_ctx_t *ctx,
+                     ngx_pool_t *pool)
+{
+    ngx_uint_t n = lcf->server_ptrs->nelts;
+
+    ctx->rs_order = ngx_pnalloc(pool, n);
+    if (ctx->rs_order == NULL) {
+        LOG_ERR(ctx->log, ngx_errno, "ngx_pnalloc failed");
+        return NGX_ERROR;
+    }
+
+    ngx_uint_t i, k = 0;
+    if (lcf->ring == NULL || ctx->type != AUTH) {
+        for (i = 0; i < n; i++) {
+            ctx->rs_order[i] = i;
+        }
+        goto outliers;
+    }
+
+    // The first point at or after the user hash is the primary,
+    // the next distinct servers along the ring are the fallbacks
+    uint32_t hash = ngx_crc32_long(ctx->user.data, ctx->user.len);
+    radius_ring_point_t *points = lcf->ring->elts;
+    ngx_uint_t npoints = lcf->ring->nelts;
+    ngx_uint_t lo = 0, hi = npoints;
+    while (lo < hi) {
+        ngx_uint_t mid = lo + (hi - lo) / 2;
+        if (points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    u_char seen[256];
+    ngx_memzero(seen, n);
+    for (i = 0; i < npoints && k < n; i++) {
+        radius_ring_point_t *point = &points[(lo + i) % npoints];
+        if (!seen[point->idx]) {
+            seen[point->idx] = 1;
+            ctx->rs_order[k++] = point->idx;
+        }
+    }
+
+    // Every server has points, but keep the order complete anyway
+    for (i = 0; i < n && k < n; i++) {
+        if (!seen[i]) {
+            ctx->rs_order[k++] = i;
+        }
+    }
+
+outliers:
+    if (lcf->outlier) {
+        eject_radius_outliers(lcf, ctx);
+    }
+
+    return NGX_OK;
+}
+
+static void
+eject_radius_outliers(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx)
+{
+    // Samples a server needs before it's judged
+    const ngx_uint_t min_samples = 10;
+    // Reply time over the mean never ejects a server below that, in us
+    const ngx_uint_t min_latency = 10000;
+
+    radius_outlier_conf_t *oc = lcf->outlier;
+    radius_server_t **rss = lcf->server_ptrs->elts;
+    ngx_uint_t n = lcf->server_ptrs->nelts;
+    ngx_msec_t now = ngx_current_msec;
+    ngx_uint_t i;
+
+    ngx_uint_t sum = 0, healthy = 0;
+    for (i = 0; i < n; i++) {
+        radius_server_t *rs = rss[i];
+        if (rs->ejected_until
+            && (ngx_msec_int_t) (rs->ejected_until - now) <= 0)
+        {
+            // Judged again on fresh samples only
+            LOG_NOTICE(ctx->log, 0, "\"%V\" is back", &rs->name);
+            rs->ejected_until = 0;
+            rs->recovered_at = oc->slow_start ? now : 0;
+            rs->samples = 0;
+            rs->rtt = 0;
+            rs->errors = 0;
+        }
+
+        if (!rs->ejected_until && rs->samples >= min_samples) {
+            sum += rs->rtt;
+            healthy++;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        radius_server_t *rs = rss[i];
+        if (rs->ejected_until || rs->samples < min_samples) {
+            continue;
+        }
+
+        ngx_uint_t slow = 0;
+        if (healthy > 1) {
+            ngx_uint_t mean = (sum - rs->rtt) / (healthy - 1);
+            slow = rs->rtt * 10 > mean * oc->latency
+                   && rs->rtt > mean + min_latency;
+        }
+
+        if (slow || rs->errors >= oc->errors) {
+            LOG_NOTICE(ctx->log, 0,
+                       "\"%V\" is ejected, rtt: %uius, errors: %ui/1000",
+                       &rs->name, rs->rtt, rs->errors);
+            rs->ejected_until = now + oc->time;
+            rs->recovered_at = 0;
+            sum -= rs->rtt;
+            healthy--;
+        }
+    }
+
+    // Ejected servers are tried last, keeping the order otherwise
+    u_char order[256];
+    ngx_uint_t k = 0;
+    for (i = 0; i < n; i++) {
+        if (!rss[ctx->rs_order[i]]->ejected_until) {
+            order[k++] = ctx->rs_order[i];
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (rss[ctx->rs_order[i]]->ejected_until) {
+            order[k++] = ctx->rs_order[i];
+        }
+    }
+    ngx_memcpy(ctx->rs_order, order, n);
+
+    // A recovering server goes first with a probability growing
+    // linearly over slow_start, otherwise the next one does
+    for (i = 0; i + 1 < n; i++) {
+        radius_server_t *rs = rss[ctx->rs_order[i]];
+        if (!rs->recovered_at || rs->ejected_until) {
+            continue;
+        }
+
+        ngx_msec_t elapsed = now - rs->recovered_at;
+        if (elapsed >= oc->slow_start) {
+            rs->recovered_at = 0;
+            continue;
+        }
+
+        if ((ngx_msec_t) ngx_random() % oc->slow_start >= elapsed) {
+            u_char idx = ctx->rs_order[i];
+            ctx->rs_order[i] = ctx->rs_order[i + 1];
+            ctx->rs_order[i + 1] = idx;
+            i++;
+        }
+    }
+}
+
+static void
+update_radius_server_stats(radius_req_t *req)
+{
+    radius_server_t *rs = req->rs;
+    ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+
+    if (ctx->shutdown || ctx->internal_error) {
+        return;
+    }
+
+    // Weight 1/8, as for the smoothed RTT of TCP
+    if (ctx->timedout || ctx->connection_refused) {
+        rs->errors += (1000 - rs->errors) / 8;
+        if (ctx->timedout) {
+            update_radius_limit(req, NGX_MAX_UINT32_VALUE);
+        }
+    } else {
+        ngx_uint_t rtt = (ngx_current_msec - req->sent_at) * 1000;
+        update_radius_limit(req, rtt);
+        if (rs->samples == 0) {
+            rs->rtt = rtt;
+        } else if (rtt > rs->rtt) {
+            rs->rtt += (rtt - rs->rtt) / 8;
+        } else {
+            rs->rtt -= (rs->rtt - rtt) / 8;
+        }
+        rs->errors -= rs->errors / 8;
+    }
+
+    if (rs->samples < NGX_MAX_UINT32_VALUE) {
+        rs->samples++;
+    }
+}
+
+// AIMD: the limit is raised by one after as many replies as the limit
+// while it is actually used, and cut by a quarter on a timeout or when
+// the RTT gets over twice the baseline, that is the server queues the
+// requests. Once per round trip, the replies in flight at the time
+// of a cut don't cut again. The timeouts pass NGX_MAX_UINT32_VALUE.
+static void
+update_radius_limit(radius_req_t *req, ngx_uint_t rtt)
+{
+    radius_server_t *rs = req->rs;
+    if (!rs->limit) {
+        return;
+    }
+
+    ngx_uint_t timedout = rtt == NGX_MAX_UINT32_VALUE;
+    if (!timedout) {
+        if (rs->rtt_min_samples == 0 || rtt < rs->rtt_min_next) {
+            rs->rtt_min_next = rtt;
+        }
+        if (rtt < rs->rtt_min) {
+            rs->rtt_min = rtt;
+        }
+        // The baseline may have grown, e.g. the path has changed
+        if (++rs->rtt_min_samples == RADIUS_LIMIT_EPOCH) {
+            rs->rtt_min = rs->rtt_min_next;
+            rs->rtt_min_samples = 0;
+        }
+    }
+
+    if (timedout
+        || (rtt > rs->rtt_min
+            && rtt - rs->rtt_min > rs->rtt_min + RADIUS_LIMIT_RTT_SLACK))
+    {
+        if ((ngx_msec_int_t) (req->sent_at - rs->limit_cut_at) <= 0) {
+            return;
+        }
+        rs->limit_cut_at = ngx_current_msec;
+        rs->limit_acks = 0;
+        rs->limit = ngx_max(rs->limit * 3 / 4, 1);
+        LOG_DEBUG(ngx_cycle->log, "\"%V\" limit cut: %ui, rtt: %ui",
+                  &rs->name, rs->limit, timedout ? 0 : rtt);
+        return;
+    }
+
+    // Not limited by the limit, the load says nothing about it
+    if (rs->inflight * 2 < rs->limit) {
+        return;
+    }
+
+    if (++rs->limit_acks >= rs->limit) {
+        rs->limit_acks = 0;
+        if (rs->limit < rs->req_queue_size) {
+            rs->limit++;
+        }
+    }
+}
+
+static radius_server_t *
+current_radius_server(const ngx_array_t *server_ptrs,
+                      ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_server_t **rss = server_ptrs->elts; // [radius_server_t *]
+    if (ctx->rs_order) {
+        return rss[ctx->rs_order[ctx->rs_idx]];
+    }
+    return rss[ctx->rs_idx];
+}
+
+// The packet is encoded and sent from encode_ev, a failure completes
+// the request later through fail_radius_send
+static void
+send_radius_request(ngx_http_auth_radius_ctx_t *ctx,
+                    radius_req_t *req)
+{
+    ngx_log_t *log = ctx->log;
+    ngx_http_request_t *r = ctx->r;
+
+    ngx_msec_t timeout = ctx->timeout;
+    if (req->stream) {
+        // Nothing is re-sent over a stream, the kernel recovers
+        // the losses, so wait as long as all the retries would
+        timeout *= ngx_max(ctx->retries, 1);
+    }
+
+    send_radius_pkg(req, timeout, log);
+
+    LOG_DEBUG(log,
+              "r: 0x%xl, req: 0x%xl, req_id: %d",
+              r, req, req->id);
+}
+
+static ngx_int_t
+set_realm(ngx_http_request_t *r, const ngx_str_t *realm)
+{
+    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
+    if (r->headers_out.www_authenticate == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.www_authenticate->hash = 1;
+    r->headers_out.www_authenticate->key.len = sizeof("WWW-Authenticate") - 1;
+    r->headers_out.www_authenticate->key.data = (uint8_t *) "WWW-Authenticate";
+    r->headers_out.www_authenticate->value = *realm;
+
+    return NGX_HTTP_UNAUTHORIZED;
+}
+
+static ngx_int_t
+check_radius_limits(ngx_http_request_t *r,
+                    ngx_http_auth_radius_loc_conf_t *lcf)
+{
+    if (lcf->limits == NULL) {
+        return NGX_OK;
+    }
+
+    size_t i;
+    radius_limit_t *limits = lcf->limits->elts;
+    for (i = 0; i < lcf->limits->nelts; i++) {
+        radius_limit_t *limit = &limits[i];
+        radius_limit_zone_t *lz = limit->shm_zone->data;
+
+        ngx_str_t key;
+        if (limit->key == RADIUS_LIMIT_USER) {
+            key = r->headers_in.user;
+        } else {
+            // The address without the port, as in $binary_remote_addr
+            struct sockaddr *sa = r->connection->sockaddr;
+            switch (sa->sa_family) {
+            case AF_INET:
+                key.data = (u_char *) &((struct sockaddr_in *) sa)->sin_addr;
+                key.len = sizeof(struct in_addr);
+                break;
+#if (NGX_HAVE_INET6)
+            case AF_INET6:
+                key.data = (u_char *) &((struct sockaddr_in6 *) sa)->sin6_addr;
+                key.len = sizeof(struct in6_addr);
+                break;
+#endif
+            default:
+                key.data = (u_char *) sa;
+                key.len = r->connection->socklen;
+                break;
+            }
+        }
+
+        if (key.len == 0 || key.len > 65535) {
+            continue;
+        }
+
+        if (lookup_radius_limit(lz, limit->key, &key) == NGX_BUSY) {
+            if (limit->key == RADIUS_LIMIT_USER) {
+                LOG_INFO(r->connection->log, "limited by user \"%V\", zone \"%V\" r: 0x%xl",
+                         &key, &limit->shm_zone->shm.name, r);
+            } else {
+                LOG_INFO(r->connection->log, "limited by addr %V, zone \"%V\" r: 0x%xl",
+                         &r->connection->addr_text, &limit->shm_zone->shm.name, r);
+            }
+            return lcf->limit_status;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+lookup_radius_limit(radius_limit_zone_t *lz,
+                    radius_limit_key_t type,
+                    const ngx_str_t *key)
+{
+    uint32_t hash = ngx_crc32_short(key->data, key->len) ^ type;
+    ngx_msec_t now = ngx_current_msec;
+
+    ngx_shmtx_lock(&lz->shpool->mutex);
+
+    expire_radius_limit(lz, 1);
+
+    ngx_rbtree_node_t *node = lz->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = lz->sh->rbtree.sentinel;
+    radius_limit_node_t *ln;
+
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = hash < node->key ? node->left : node->right;
+            continue;
+        }
+
+        ln = (radius_limit_node_t *) &node->color;
+        ngx_int_t rc = (ngx_int_t) type - ln->type;
+        if (rc == 0) {
+            rc = (ngx_int_t) key->len - ln->len;
+        }
+        if (rc == 0) {
+            rc = ngx_memcmp(key->data, ln->data, key->len);
+        }
+        if (rc == 0) {
+            ngx_queue_remove(&ln->queue);
+            ngx_queue_insert_head(&lz->sh->queue, &ln->queue);
+
+            ngx_msec_int_t ms = (ngx_msec_int_t) (now - ln->last);
+            if (ms < 0) {
+                ms = 0;
+            }
+            ngx_int_t excess = (ngx_int_t) ln->excess
+                               - (ngx_int_t) (lz->rate * ms / 1000) + 1000;
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            if ((ngx_uint_t) excess > lz->burst) {
+                lz->sh->limited++;
+                ngx_shmtx_unlock(&lz->shpool->mutex);
+                return NGX_BUSY;
+            }
+
+            ln->excess = excess;
+            ln->last = now;
+            lz->sh->passed++;
+            ngx_shmtx_unlock(&lz->shpool->mutex);
+            return NGX_OK;
+        }
+
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    size_t size = offsetof(ngx_rbtree_node_t, color)
+                  + offsetof(radius_limit_node_t, data)
+                  + key->len;
+
+    node = ngx_slab_alloc_locked(lz->shpool, size);
+    if (node == NULL) {
+        expire_radius_limit(lz, 0);
+        node = ngx_slab_alloc_locked(lz->shpool, size);
+        if (node == NULL) {
+            // Don't deny anybody when out of memory
+            ngx_shmtx_unlock(&lz->shpool->mutex);
+            return NGX_OK;
+        }
+    }
+
+    node->key = hash;
+    ln = (radius_limit_node_t *) &node->color;
+    ln->type = type;
+    ln->len = key->len;
+    ln->last = now;
+    ln->excess = 0;
+    ngx_memcpy(ln->data, key->data, key->len);
+
+    ngx_rbtree_insert(&lz->sh->rbtree, node);
+    ngx_queue_insert_head(&lz->sh->queue, &ln->queue);
+    lz->sh->passed++;
+
+    ngx_shmtx_unlock(&lz->shpool->mutex);
+
+    return NGX_OK;
+}
+
+static void
+expire_radius_limit(radius_limit_zone_t *lz, ngx_uint_t n)
+{
+    ngx_msec_t now = ngx_current_msec;
+
+    // n == 1 deletes one or two zero rate entries
+    // n == 0 deletes the oldest entry by force and one or two
+    // zero rate entries
+    while (n < 3) {
+        if (ngx_queue_empty(&lz->sh->queue)) {
+            return;
+        }
+
+        ngx_queue_t *q = ngx_queue_last(&lz->sh->queue);
+        radius_limit_node_t *ln = ngx_queue_data(q, radius_limit_node_t, queue);
+
+        if (n++ != 0) {
+            ngx_msec_int_t ms = (ngx_msec_int_t) (now - ln->last);
+            ms = ngx_abs(ms);
+            if (ms < 60000) {
+                return;
+            }
+
+            ngx_int_t excess = (ngx_int_t) ln->excess
+                               - (ngx_int_t) (lz->rate * ms / 1000);
+            if (excess > 0) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_node_t *node = (ngx_rbtree_node_t *)
+            ((u_char *) ln - offsetof(ngx_rbtree_node_t, color));
+        ngx_rbtree_delete(&lz->sh->rbtree, node);
+        ngx_slab_free_locked(lz->shpool, node);
+    }
+}
+
+static ngx_int_t
+init_radius_limit_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    radius_limit_zone_t *olz = data;
+    radius_limit_zone_t *lz = shm_zone->data;
+
+    if (olz) {
+        // Reload, keep the counters
+        lz->sh = olz->sh;
+        lz->shpool = olz->shpool;
+        return NGX_OK;
+    }
+
+    lz->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        lz->sh = lz->shpool->data;
+        return NGX_OK;
+    }
+
+    lz->sh = ngx_slab_alloc(lz->shpool, sizeof(radius_limit_shctx_t));
+    if (lz->sh == NULL) {
+        return NGX_ERROR;
+    }
+    lz->shpool->data = lz->sh;
+
+    ngx_rbtree_init(&lz->sh->rbtree, &lz->sh->sentinel,
+                    radius_limit_rbtree_insert_value);
+    ngx_queue_init(&lz->sh->queue);
+
+    size_t len = sizeof(" in radius limit zone \"\"") + shm_zone->shm.name.len;
+    lz->shpool->log_ctx = ngx_slab_alloc(lz->shpool, len);
+    if (lz->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(lz->shpool->log_ctx, " in radius limit zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+static void
+radius_filter_hashes(radius_filter_zone_t *fz,
+                     const u_char *fingerprint,
+                     uint32_t *h1, uint32_t *h2)
+{
+    ngx_memcpy(h1, fingerprint, sizeof(uint32_t));
+    ngx_memcpy(h2, fingerprint + sizeof(uint32_t), sizeof(uint32_t));
+    // Double hashing needs an odd step
+    *h2 |= 1;
+}
+
+static ngx_uint_t
+radius_filter_test(radius_filter_zone_t *fz,
+                   uintptr_t *bits,
+                   uint32_t h1, uint32_t h2)
+{
+    ngx_uint_t i;
+    for (i = 0; i < fz->hashes; i++) {
+        // Map the hash onto [0, nbits) without a division
+        uint32_t bit = ((uint64_t) (uint32_t) (h1 + i * h2) * fz->nbits) >> 32;
+        if (!(bits[bit / (8 * sizeof(uintptr_t))]
+              & ((uintptr_t) 1 << (bit % (8 * sizeof(uintptr_t))))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static ngx_int_t
+check_radius_reject_filter(ngx_http_request_t *r,
+                           ngx_http_auth_radius_loc_conf_t *lcf,
+                           ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_filter_zone_t *fz = lcf->reject_filter->data;
+    radius_filter_shctx_t *sh = fz->sh;
+
+    // Keyed, so the fingerprints are useless outside of the zone
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, sh->salt, sizeof(sh->salt));
+    ngx_md5_update(&md5, &lcf->servers_hash, sizeof(lcf->servers_hash));
+    ngx_md5_update(&md5, ctx->user.data, ctx->user.len);
+    ngx_md5_update(&md5, ":", 1);
+    ngx_md5_update(&md5, ctx->passwd.data, ctx->passwd.len);
+    ngx_md5_final(ctx->fingerprint, &md5);
+    ctx->filtered = 1;
+
+    uint32_t h1, h2;
+    radius_filter_hashes(fz, ctx->fingerprint, &h1, &h2);
+
+    // Rotations only happen on inserts, so on a quiet zone the
+    // generations are skipped once a rotation would have dropped them:
+    // the old one ttl after the last rotation, the current one at the
+    // next. Reads race with the rotation at worst, which costs a Radius
+    // request or a false positive.
+    time_t age = ngx_time() - sh->started;
+    ngx_uint_t current = sh->current;
+    if (!(age < 2 * fz->ttl
+          && radius_filter_test(fz, sh->bits[current], h1, h2))
+        && !(age < fz->ttl
+             && radius_filter_test(fz, sh->bits[current ^ 1], h1, h2)))
+    {
+        return NGX_OK;
+    }
+
+    ngx_atomic_uint_t hits = ngx_atomic_fetch_add(&sh->hits, 1);
+    if (lcf->reject_recheck && hits % lcf->reject_recheck == 0) {
+        ngx_atomic_fetch_add(&sh->rechecks, 1);
+        LOG_DEBUG(r->connection->log, "recheck filtered r: 0x%xl", r);
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+static void
+insert_radius_reject_filter(ngx_http_auth_radius_loc_conf_t *lcf,
+                            ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_filter_zone_t *fz = lcf->reject_filter->data;
+    radius_filter_shctx_t *sh = fz->sh;
+
+    uint32_t h1, h2;
+    radius_filter_hashes(fz, ctx->fingerprint, &h1, &h2);
+
+    ngx_shmtx_lock(&fz->shpool->mutex);
+
+    time_t now = ngx_time();
+    if (sh->count >= fz->capacity || now - sh->started >= fz->ttl) {
+        // Rotate, dropping the fingerprints of the old generation
+        sh->current ^= 1;
+        ngx_memzero(sh->bits[sh->current], fz->nbits / 8);
+        sh->count = 0;
+        sh->started = now;
+    }
+
+    uintptr_t *bits = sh->bits[sh->current];
+    ngx_uint_t i;
+    for (i = 0; i < fz->hashes; i++) {
+        uint32_t bit = ((uint64_t) (uint32_t) (h1 + i * h2) * fz->nbits) >> 32;
+        bits[bit / (8 * sizeof(uintptr_t))] |=
+            (uintptr_t) 1 << (bit % (8 * sizeof(uintptr_t)));
+    }
+    sh->count++;
+    sh->inserts++;
+
+    ngx_shmtx_unlock(&fz->shpool->mutex);
+}
+
+static ngx_int_t
+init_radius_filter_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    radius_filter_zone_t *ofz = data;
+    radius_filter_zone_t *fz = shm_zone->data;
+
+    if (ofz) {
+        fz->sh = ofz->sh;
+        fz->shpool = ofz->shpool;
+        fz->nbits = ofz->nbits;
+        // The fingerprints in the filter were set with these
+        fz->hashes = ofz->hashes;
+        fz->capacity = fz->nbits * 693 / 1000 / fz->hashes;
+        return NGX_OK;
+    }
+
+    fz->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        fz->sh = fz->shpool->data;
+        return NGX_OK;
+    }
+
+    fz->sh = ngx_slab_calloc(fz->shpool, sizeof(radius_filter_shctx_t));
+    if (fz->sh == NULL) {
+        return NGX_ERROR;
+    }
+    fz->shpool->data = fz->sh;
+
+    // Take what's left of the zone, less the slab allocator overhead
+    size_t size = (fz->shpool->end - fz->shpool->start) / 2;
+    size = ngx_align(size - size / 16 - ngx_pagesize, sizeof(uintptr_t));
+    while (size >= ngx_pagesize) {
+        fz->sh->bits[0] = ngx_slab_calloc(fz->shpool, size);
+        fz->sh->bits[1] = ngx_slab_calloc(fz->shpool, size);
+        if (fz->sh->bits[0] && fz->sh->bits[1]) {
+            break;
+        }
+        if (fz->sh->bits[0]) {
+            ngx_slab_free(fz->shpool, fz->sh->bits[0]);
+        }
+        if (fz->sh->bits[1]) {
+            ngx_slab_free(fz->shpool, fz->sh->bits[1]);
+        }
+        size = ngx_align(size - size / 16, sizeof(uintptr_t));
+    }
+
+    if (size < ngx_pagesize) {
+        return NGX_ERROR;
+    }
+
+    fz->nbits = ngx_min(size * 8, NGX_MAX_UINT32_VALUE);
+    fz->capacity = fz->nbits * 693 / 1000 / fz->hashes;
+    fz->sh->started = ngx_time();
+
+    ngx_err_t err = radius_rand_kernel(fz->sh->salt, sizeof(fz->sh->salt));
+    if (err) {
+        LOG_EMERG(shm_zone->shm.log, err, "getrandom failed");
+        return NGX_ERROR;
+    }
+
+    LOG_NOTICE(shm_zone->shm.log, 0,
+               "\"%V\": %ui bits, %ui hashes, %ui fingerprints per generation",
+               &shm_zone->shm.name, (ngx_uint_t) fz->nbits,
+               fz->hashes, fz->capacity);
+
+    return NGX_OK;
+}
+
+static radius_cache_node_t *
+lookup_radius_cache(radius_cache_zone_t *cz, const u_char *key)
+{
+    uint32_t hash;
+    ngx_memcpy(&hash, key, sizeof(hash));
+
+    ngx_rbtree_node_t *node = cz->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = cz->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = hash < node->key ? node->left : node->right;
+            continue;
+        }
+
+        radius_cache_node_t *cn = (radius_cache_node_t *) &node->color;
+        ngx_int_t rc = ngx_memcmp(key, cn->key, sizeof(cn->key));
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void
+delete_radius_cache_node(radius_cache_zone_t *cz, radius_cache_node_t *cn)
+{
+    ngx_queue_remove(&cn->queue);
+
+    ngx_rbtree_node_t *node = (ngx_rbtree_node_t *)
+        ((u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+    ngx_rbtree_delete(&cz->sh->rbtree, node);
+    ngx_rbtree_delete(&cz->sh->users, &cn->user_node);
+    ngx_slab_free_locked(cz->shpool, node);
+}
+
+static void
+flush_radius_cache(ngx_shm_zone_t *shm_zone)
+{
+    radius_cache_zone_t *cz = shm_zone->data;
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+    while (!ngx_queue_empty(&cz->sh->queue)) {
+        ngx_queue_t *q = ngx_queue_last(&cz->sh->queue);
+        delete_radius_cache_node(cz, ngx_queue_data(q, radius_cache_node_t,
+                                                    queue));
+    }
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+}
+
+static void
+expire_radius_cache(radius_cache_zone_t *cz, ngx_uint_t force)
+{
+    time_t now = ngx_time();
+
+    // Drop one or two dead entries, and the oldest one if forced
+    ngx_uint_t n;
+    for (n = 0; n < 2; n++) {
+        if (ngx_queue_empty(&cz->sh->queue)) {
+            return;
+        }
+
+        ngx_queue_t *q = ngx_queue_last(&cz->sh->queue);
+        radius_cache_node_t *cn = ngx_queue_data(q, radius_cache_node_t, queue);
+        if (!force && cn->stale_until >= now) {
+            return;
+        }
+
+        force = 0;
+        delete_radius_cache_node(cz, cn);
+    }
+}
+
+static void
+radius_cache_key(ngx_http_auth_radius_loc_conf_t *lcf,
+                 ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, cz->sh->salt, sizeof(cz->sh->salt));
+    ngx_md5_update(&md5, &lcf->servers_hash, sizeof(lcf->servers_hash));
+    ngx_md5_update(&md5, ctx->user.data, ctx->user.len);
+    ngx_md5_update(&md5, ":", 1);
+    ngx_md5_update(&md5, ctx->passwd.data, ctx->passwd.len);
+    ngx_md5_final(ctx->cache_key, &md5);
+    ctx->cached = 1;
+}
+
+// Key of the index by user name. Collisions only evict other users
+// along with the one asked for.
+static uint32_t
+radius_cache_user(radius_cache_zone_t *cz, const ngx_str_t *user)
+{
+    u_char digest[16];
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, cz->sh->salt, sizeof(cz->sh->salt));
+    ngx_md5_update(&md5, user->data, user->len);
+    ngx_md5_final(digest, &md5);
+
+    uint32_t hash;
+    ngx_memcpy(&hash, digest, sizeof(hash));
+    return hash;
+}
+
+// Drops the entries of the user whatever the password and the location,
+// returns how many
+static ngx_uint_t
+evict_radius_cache_user(ngx_shm_zone_t *shm_zone, const ngx_str_t *user)
+{
+    radius_cache_zone_t *cz = shm_zone->data;
+    uint32_t hash = radius_cache_user(cz, user);
+    ngx_uint_t n = 0;
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+
+    ngx_rbtree_node_t *node = cz->sh->users.root;
+    ngx_rbtree_node_t *sentinel = cz->sh->users.sentinel;
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = hash < node->key ? node->left : node->right;
+            continue;
+        }
+
+        // Equal keys may be on either side, start over
+        delete_radius_cache_node(cz, (radius_cache_node_t *)
+            ((u_char *) node - offsetof(radius_cache_node_t, user_node)));
+        n++;
+        node = cz->sh->users.root;
+    }
+
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+
+    // The entries of the other nodes can't be found by user name
+    if (cz->l2) {
+        revoke_radius_cache_l2(cz->l2, user, ngx_cycle->log);
+    }
+
+    return n;
+}
+
+static ngx_int_t
+check_radius_cache(ngx_http_auth_radius_loc_conf_t *lcf,
+                   ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+
+    radius_cache_key(lcf, ctx);
+
+    time_t now = ngx_time();
+    ngx_uint_t refresh = 0;
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+
+    radius_cache_node_t *cn = lookup_radius_cache(cz, ctx->cache_key);
+    if (cn == NULL || cn->expires <= now) {
+        cz->sh->misses++;
+        ngx_shmtx_unlock(&cz->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cz->sh->queue, &cn->queue);
+    cz->sh->hits++;
+
+    if (cn->expires - now <= lcf->cache->refresh && cn->refreshing < now) {
+        // Only the first hit in the window refreshes the entry
+        cn->refreshing = cn->expires;
+        cz->sh->refreshes++;
+        refresh = 1;
+    }
+
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+
+    if (refresh) {
+        start_radius_refresh(lcf, ctx);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+check_radius_cache_stale(ngx_http_auth_radius_loc_conf_t *lcf,
+                         ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+    ngx_int_t rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+
+    radius_cache_node_t *cn = lookup_radius_cache(cz, ctx->cache_key);
+    if (cn && cn->stale_until >= ngx_time()) {
+        cz->sh->stale++;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+
+    return rc;
+}
+
+static void
+update_radius_cache(ngx_http_auth_radius_loc_conf_t *lcf,
+                    ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+    time_t now = ngx_time();
+
+    // The other nodes learn the result too, if the revocation
+    // generation of the user is known
+    if (cz->l2 && ctx->l2_answered && !ctx->l2_hit) {
+        store_radius_cache_l2(lcf, ctx);
+    }
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+
+    radius_cache_node_t *cn = lookup_radius_cache(cz, ctx->cache_key);
+
+    if (!ctx->accepted) {
+        // The password has changed or the user is disabled
+        if (cn) {
+            delete_radius_cache_node(cz, cn);
+        }
+        ngx_shmtx_unlock(&cz->shpool->mutex);
+        return;
+    }
+
+    if (cn == NULL) {
+        expire_radius_cache(cz, 0);
+
+        size_t size = offsetof(ngx_rbtree_node_t, color)
+                      + sizeof(radius_cache_node_t);
+        ngx_rbtree_node_t *node = ngx_slab_alloc_locked(cz->shpool, size);
+        if (node == NULL) {
+            expire_radius_cache(cz, 1);
+            node = ngx_slab_alloc_locked(cz->shpool, size);
+            if (node == NULL) {
+                ngx_shmtx_unlock(&cz->shpool->mutex);
+                LOG_ERR(ctx->log, 0, "could not allocate cache node");
+                return;
+            }
+        }
+
+        cn = (radius_cache_node_t *) &node->color;
+        ngx_memcpy(&node->key, ctx->cache_key, sizeof(uint32_t));
+        ngx_memcpy(cn->key, ctx->cache_key, sizeof(cn->key));
+        ngx_rbtree_insert(&cz->sh->rbtree, node);
+        cn->user_node.key = radius_cache_user(cz, &ctx->user);
+        ngx_rbtree_insert(&cz->sh->users, &cn->user_node);
+    } else {
+        ngx_queue_remove(&cn->queue);
+    }
+
+    ngx_queue_insert_head(&cz->sh->queue, &cn->queue);
+    // A hit of the second tier lives as long as the entry it found
+    cn->expires = ctx->l2_hit ? ngx_min(ctx->l2_expires,
+                                        now + lcf->cache->valid)
+                              : now + lcf->cache->valid;
+    cn->stale_until = cn->expires + lcf->cache->stale;
+    cn->refreshing = 0;
+
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+}
+
+static void
+start_radius_refresh(ngx_http_auth_radius_loc_conf_t *lcf,
+                     ngx_http_auth_radius_ctx_t *rctx)
+{
+    // The HTTP request is answered from the cache right away,
+    // so the refresh lives in its own pool
+    ngx_log_t *log = ngx_cycle->log;
+    ngx_pool_t *pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_create_pool failed");
+        return;
+    }
+
+    ngx_http_auth_radius_ctx_t *ctx = ngx_pcalloc(pool, sizeof(*ctx));
+    if (ctx == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_pcalloc failed");
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    ctx->type = AUTH;
+    ctx->lcf = lcf;
+    ctx->log = log;
+    ctx->pool = pool;
+    ctx->user.len = rctx->user.len;
+    ctx->user.data = ngx_pstrdup(pool, &rctx->user);
+    ctx->passwd.len = rctx->passwd.len;
+    ctx->passwd.data = ngx_pstrdup(pool, &rctx->passwd);
+    // The attributes as encoded for the request
+    ctx->attrs.len = rctx->attrs.len;
+    ctx->attrs.data = ngx_pstrdup(pool, &rctx->attrs);
+    if (ctx->user.data == NULL || ctx->passwd.data == NULL
+        || ctx->attrs.data == NULL)
+    {
+        LOG_ERR(log, ngx_errno, "ngx_pstrdup failed");
+        goto failed;
+    }
+    ngx_memcpy(ctx->cache_key, rctx->cache_key, sizeof(ctx->cache_key));
+    ctx->cached = 1;
+
+    // The servers in the order the user is normally sent to them,
+    // ejected ones last, as select_radius_server does
+    if (order_radius_servers(lcf, ctx, pool) != NGX_OK) {
+        goto failed;
+    }
+
+    // The first one that takes the request right away: don't wait for
+    // a slot, the entry is refreshed by a later hit
+    radius_server_t *rs = NULL;
+    radius_req_t *req = NULL;
+    for (ctx->rs_idx = 0; ctx->rs_idx < lcf->server_ptrs->nelts;
+         ctx->rs_idx++)
+    {
+        rs = current_radius_server(lcf->server_ptrs, ctx);
+        if (rs->drained) {
+            continue;
+        }
+
+        if (rs->qos == NULL || radius_slots_available(rs)) {
+            req = acquire_radius_req(rs);
+        }
+        if (req == NULL) {
+            continue;
+        }
+
+        ctx->peer_tries = 0;
+        if (connect_radius_req(req, rs->peers, select_radius_peer(rs, ctx),
+                               log) == NGX_OK)
+        {
+            break;
+        }
+        release_radius_req(req);
+        req = NULL;
+    }
+    if (req == NULL) {
+        LOG_INFO(log, "no server available, refresh skipped");
+        goto failed;
+    }
+
+    ctx->timeout = rs->auth_timeout;
+    ctx->retries = rs->auth_retries;
+    ctx->req = req;
+    req->ctx = ctx;
+    RADIUS_PROBE_REQ(slot__acquire, req, ctx->rs_idx);
+
+    send_radius_request(ctx, req);
+
+    LOG_DEBUG(log, "refresh started, req: 0x%xl", req);
+    return;
+
+failed:
+    finish_radius_refresh(ctx);
+}
+
+static void
+finish_radius_refresh(ngx_http_auth_radius_ctx_t *ctx)
+{
+    ngx_http_auth_radius_loc_conf_t *lcf = ctx->lcf;
+
+    if (ctx->done && !ctx->timedout && !ctx->connection_refused
+        && !ctx->internal_error && !ctx->shutdown)
+    {
+        LOG_DEBUG(ctx->log, "refreshed, accepted: %d", ctx->accepted);
+        update_radius_cache(lcf, ctx);
+    } else {
+        // Let a later hit try again
+        radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+
+        ngx_shmtx_lock(&cz->shpool->mutex);
+        radius_cache_node_t *cn = lookup_radius_cache(cz, ctx->cache_key);
+        if (cn) {
+            cn->refreshing = 0;
+        }
+        ngx_shmtx_unlock(&cz->shpool->mutex);
+    }
+
+    ngx_destroy_pool(ctx->pool);
+}
+
+static ngx_int_t
+init_radius_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    radius_cache_zone_t *ocz = data;
+    radius_cache_zone_t *cz = shm_zone->data;
+
+    if (ocz) {
+        // Reload, new workers find the cache warm
+        cz->sh = ocz->sh;
+        cz->shpool = ocz->shpool;
+        return NGX_OK;
+    }
+
+    cz->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cz->sh = cz->shpool->data;
+        return NGX_OK;
+    }
+
+    cz->sh = ngx_slab_calloc(cz->shpool, sizeof(radius_cache_shctx_t));
+    if (cz->sh == NULL) {
+        return NGX_ERROR;
+    }
+    cz->shpool->data = cz->sh;
+
+    ngx_rbtree_init(&cz->sh->rbtree, &cz->sh->sentinel,
+                    radius_cache_rbtree_insert_value);
+    ngx_rbtree_init(&cz->sh->users, &cz->sh->users_sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_queue_init(&cz->sh->queue);
+
+    // A saved zone gets a random nonce instead, so the salt of the keys
+    // in the snapshot can be derived again by the next zone
+    u_char *salt = cz->snapshot.len ? cz->sh->nonce : cz->sh->salt;
+    ngx_err_t err = radius_rand_kernel(salt, sizeof(cz->sh->salt));
+    if (err) {
+        LOG_EMERG(shm_zone->shm.log, err, "getrandom failed");
+        return NGX_ERROR;
+    }
+    if (cz->snapshot.len) {
+        derive_radius_cache_salt(cz);
+    }
+
+    size_t len = sizeof(" in radius cache zone \"\"") + shm_zone->shm.name.len;
+    cz->shpool->log_ctx = ngx_slab_alloc(cz->shpool, len);
+    if (cz->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(cz->shpool->log_ctx, " in radius cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    if (cz->snapshot.len) {
+        load_radius_cache_snapshot(shm_zone);
+    }
+
+    return NGX_OK;
+}
+
+static void
+radius_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+
+    for (;;) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            radius_cache_node_t *cn = (radius_cache_node_t *) &node->color;
+            radius_cache_node_t *cnt = (radius_cache_node_t *) &temp->color;
+            p = ngx_memcmp(cn->key, cnt->key, sizeof(cn->key)) < 0
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+// Looked up after a miss of the zone, before any Radius server is
+// selected. NGX_AGAIN if the request waits for the reply, which wakes
+// it up accepted or not done yet. On an error or a timeout, and while
+// the second tier is down, the request goes to the Radius servers.
+static ngx_int_t
+check_radius_cache_l2(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+    radius_cache_l2_t *l2 = cz->l2;
+    ngx_log_t *log = ctx->log;
+
+    if (l2 == NULL || l2->npending == RADIUS_CACHE_L2_PENDING
+        || l2->down_until > ngx_current_msec)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!ctx->l2_cleanup) {
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+        if (cln == NULL) {
+            return NGX_DECLINED;
+        }
+        cln->handler = radius_cache_l2_cleanup;
+        cln->data = ctx;
+        ctx->l2_cleanup = 1;
+    }
+
+    // The entry and the revocation generation of the user at once
+    u_char *p = reserve_radius_cache_l2(l2, sizeof("get  \r\n") - 1
+                                            + RADIUS_CACHE_L2_KEY_LEN
+                                            + RADIUS_CACHE_L2_USER_KEY_LEN,
+                                        log);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
+    p = ngx_cpymem(p, "get ", 4);
+    radius_cache_l2_key(l2, lcf, ctx, p);
+    p += RADIUS_CACHE_L2_KEY_LEN;
+    *p++ = ' ';
+    radius_cache_l2_user_key(l2, &ctx->user, p);
+    p += RADIUS_CACHE_L2_USER_KEY_LEN;
+    *p++ = CR; *p++ = LF;
+    l2->out_len = p - l2->out;
+
+    ngx_uint_t idx = (l2->head + l2->npending) % RADIUS_CACHE_L2_PENDING;
+    radius_cache_l2_lookup_t *lookup = &l2->lookups[idx];
+    lookup->ctx = ctx;
+    lookup->sent_at = ngx_current_msec;
+    l2->npending++;
+    ctx->l2_lookup = lookup;
+    ctx->l2_waiting = 1;
+
+    arm_radius_cache_l2_timer(l2);
+    if (l2->connected && !l2->conn->write->posted) {
+        // Lookups of the same event loop iteration are written together
+        ngx_post_event(l2->conn->write, &ngx_posted_events);
+    }
+
+    return NGX_AGAIN;
+}
+
+// An accept is stored for the validity of the location, with its
+// expiry and the revocation generation of the user read by the lookup.
+// A reject deletes the key. Nothing waits for the reply.
+static void
+store_radius_cache_l2(ngx_http_auth_radius_loc_conf_t *lcf,
+                      ngx_http_auth_radius_ctx_t *ctx)
+{
+    radius_cache_zone_t *cz = lcf->cache->shm_zone->data;
+    radius_cache_l2_t *l2 = cz->l2;
+
+    if (l2->down_until > ngx_current_msec) {
+        return;
+    }
+
+    u_char value[NGX_TIME_T_LEN + 1 + NGX_INT32_LEN];
+    size_t vlen = ngx_sprintf(value, "%T %uD",
+                              ngx_time() + lcf->cache->valid, ctx->l2_gen)
+                  - value;
+    size_t len = ctx->accepted
+                 ? sizeof("set  0   noreply\r\n\r\n") - 1
+                   + 2 * NGX_TIME_T_LEN + vlen
+                 : sizeof("delete  noreply\r\n") - 1;
+    u_char *p = reserve_radius_cache_l2(l2, len + RADIUS_CACHE_L2_KEY_LEN,
+                                        ctx->log);
+    if (p == NULL) {
+        return;
+    }
+
+    p = ngx_cpymem(p, ctx->accepted ? "set " : "delete ",
+                   ctx->accepted ? 4 : 7);
+    radius_cache_l2_key(l2, lcf, ctx, p);
+    p += RADIUS_CACHE_L2_KEY_LEN;
+    if (ctx->accepted) {
+        p = ngx_sprintf(p, " 0 %T %uz noreply\r\n", lcf->cache->valid, vlen);
+        p = ngx_cpymem(p, value, vlen);
+        *p++ = CR; *p++ = LF;
+    } else {
+        p = ngx_cpymem(p, " noreply\r\n", 10);
+    }
+    l2->out_len = p - l2->out;
+
+    if (l2->connected && !l2->conn->write->posted) {
+        ngx_post_event(l2->conn->write, &ngx_posted_events);
+    }
+}
+
+// The key of the zone is salted per node, this one is salted the same
+// on every node
+static void
+radius_cache_l2_key(radius_cache_l2_t *l2,
+                    ngx_http_auth_radius_loc_conf_t *lcf,
+                    ngx_http_auth_radius_ctx_t *ctx,
+                    u_char *key)
+{
+    u_char digest[16];
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, l2->salt.data, l2->salt.len);
+    ngx_md5_update(&md5, &lcf->servers_hash, sizeof(lcf->servers_hash));
+    ngx_md5_update(&md5, ctx->user.data, ctx->user.len);
+    ngx_md5_update(&md5, ":", 1);
+    ngx_md5_update(&md5, ctx->passwd.data, ctx->passwd.len);
+    ngx_md5_final(digest, &md5);
+
+    key = ngx_cpymem(key, "radius:", sizeof("radius:") - 1);
+    ngx_hex_dump(key, digest, sizeof(digest));
+}
+
+static void
+radius_cache_l2_user_key(radius_cache_l2_t *l2,
+                         const ngx_str_t *user,
+                         u_char *key)
+{
+    u_char digest[16];
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, l2->salt.data, l2->salt.len);
+    ngx_md5_update(&md5, "u:", 2);
+    ngx_md5_update(&md5, user->data, user->len);
+    ngx_md5_final(digest, &md5);
+
+    key = ngx_cpymem(key, "radius:u:", sizeof("radius:u:") - 1);
+    ngx_hex_dump(key, digest, sizeof(digest));
+}
+
+// The entries of a user are keyed by its credentials, so they are
+// revoked by bumping the generation of the user instead: the entries
+// stored with another one are misses. A missing generation is 0, it's
+// created first since incr needs an existing key.
+static void
+revoke_radius_cache_l2(radius_cache_l2_t *l2,
+                       const ngx_str_t *user,
+                       ngx_log_t *log)
+{
+    size_t len = sizeof("add  0 0 1 noreply\r\n0\r\n") - 1
+                 + sizeof("incr  1 noreply\r\n") - 1
+                 + 2 * RADIUS_CACHE_L2_USER_KEY_LEN;
+    u_char *p = reserve_radius_cache_l2(l2, len, log);
+    if (p == NULL) {
+        LOG_ERR_LIMITED(&l2->log_limit, log, 0,
+                        "l2 cache revocation skipped, addr: %V",
+                        &l2->addr.name);
+        return;
+    }
+
+    u_char key[RADIUS_CACHE_L2_USER_KEY_LEN];
+    radius_cache_l2_user_key(l2, user, key);
+
+    p = ngx_cpymem(p, "add ", 4);
+    p = ngx_cpymem(p, key, sizeof(key));
+    p = ngx_cpymem(p, " 0 0 1 noreply\r\n0\r\n", 20);
+    p = ngx_cpymem(p, "incr ", 5);
+    p = ngx_cpymem(p, key, sizeof(key));
+    p = ngx_cpymem(p, " 1 noreply\r\n", 12);
+    l2->out_len = p - l2->out;
+
+    if (l2->connected && !l2->conn->write->posted) {
+        ngx_post_event(l2->conn->write, &ngx_posted_events);
+    }
+}
+
+// Room for a command at the end of the output, the connection is opened
+// if needed. NULL if the command is to be skipped.
+static u_char *
+reserve_radius_cache_l2(radius_cache_l2_t *l2, size_t len, ngx_log_t *log)
+{
+    if (l2->conn == NULL && ngx_exiting) {
+        return NULL;
+    }
+
+    if (l2->conn == NULL && open_radius_cache_l2(l2, log) != NGX_OK) {
+        l2->errors++;
+        l2->down_until = ngx_current_msec + RADIUS_CACHE_L2_DOWN;
+        return NULL;
+    }
+
+    if (l2->out_sent) {
+        l2->out_len -= l2->out_sent;
+        ngx_memmove(l2->out, l2->out + l2->out_sent, l2->out_len);
+        l2->out_sent = 0;
+    }
+
+    if (l2->out_len + len > sizeof(l2->out)) {
+        return NULL;
+    }
+
+    return l2->out + l2->out_len;
+}
+
+static ngx_int_t
+open_radius_cache_l2(radius_cache_l2_t *l2, ngx_log_t *log)
+{
+    ngx_peer_connection_t pc;
+    ngx_memzero(&pc, sizeof(pc));
+    pc.sockaddr = l2->addr.sockaddr;
+    pc.socklen = l2->addr.socklen;
+    pc.name = &l2->addr.name;
+    pc.get = ngx_event_get_peer;
+    pc.log = log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    ngx_int_t rc = ngx_event_connect_peer(&pc);
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (pc.connection) {
+            ngx_close_connection(pc.connection);
+        }
+        LOG_ERR_LIMITED(&l2->log_limit, log, 0,
+                        "l2 cache connect failed, addr: %V", &l2->addr.name);
+        return NGX_ERROR;
+    }
+
+    ngx_connection_t *c = pc.connection;
+    c->data = l2;
+    // Closed on graceful shutdown unless lookups are pending
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->read->handler = radius_cache_l2_read_handler;
+    c->write->handler = radius_cache_l2_write_handler;
+
+    l2->conn = c;
+    l2->connected = 0;
+    l2->found = 0;
+    l2->out_len = 0;
+    l2->out_sent = 0;
+    l2->in_len = 0;
+    l2->timer.handler = radius_cache_l2_timeout_handler;
+    l2->timer.data = l2;
+    l2->timer.log = c->log;
+
+    LOG_DEBUG(log, "l2 cache connecting to addr: %V, fd: %d",
+              &l2->addr.name, c->fd);
+
+    if (rc == NGX_OK) {
+        // Connected already, a write event follows anyway
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    // The connect has the time of a lookup
+    arm_radius_cache_l2_timer(l2);
+
+    return NGX_OK;
+}
+
+static void
+close_radius_cache_l2(radius_cache_l2_t *l2)
+{
+    if (l2->timer.timer_set) {
+        ngx_del_timer(&l2->timer);
+    }
+
+    if (l2->conn) {
+        ngx_close_connection(l2->conn);
+        l2->conn = NULL;
+    }
+    l2->connected = 0;
+}
+
+// The pending lookups go to the Radius servers
+static void
+fail_radius_cache_l2(radius_cache_l2_t *l2, ngx_log_t *log)
+{
+    l2->errors++;
+    l2->down_until = ngx_current_msec + RADIUS_CACHE_L2_DOWN;
+    close_radius_cache_l2(l2);
+
+    while (l2->npending) {
+        complete_radius_cache_l2(l2, 0);
+    }
+}
+
+// A hit is an entry of the current generation of the user not expired
+// yet, see parse_radius_cache_l2
+static void
+complete_radius_cache_l2(radius_cache_l2_t *l2, ngx_uint_t answered)
+{
+    radius_cache_l2_lookup_t *lookup = &l2->lookups[l2->head];
+    l2->head = (l2->head + 1) % RADIUS_CACHE_L2_PENDING;
+    l2->npending--;
+
+    ngx_uint_t hit = answered && l2->found && l2->entry_gen == l2->gen
+                     && l2->expires > ngx_time();
+    uint32_t gen = l2->gen;
+    time_t expires = l2->expires;
+    l2->found = 0;
+    l2->expires = 0;
+    l2->entry_gen = 0;
+    l2->gen = 0;
+
+    ngx_http_auth_radius_ctx_t *ctx = lookup->ctx;
+    lookup->ctx = NULL;
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx->l2_answered = answered;
+    ctx->l2_gen = gen;
+    ctx->l2_expires = expires;
+
+    if (hit) {
+        l2->hits++;
+        // Stored in the zone too, see update_radius_cache
+        ctx->done = 1;
+        ctx->accepted = 1;
+        ctx->l2_hit = 1;
+    } else {
+        l2->misses++;
+    }
+    ctx->l2_waiting = 0;
+    RADIUS_TRACE(ctx, RADIUS_TRACE_L2, NULL, -1, hit);
+
+    ngx_post_event(ctx->r->connection->write, &ngx_posted_events);
+}
+
+static void
+arm_radius_cache_l2_timer(radius_cache_l2_t *l2)
+{
+    if (l2->timer.timer_set) {
+        ngx_del_timer(&l2->timer);
+    }
+
+    ngx_msec_t since;
+    if (l2->npending) {
+        since = l2->lookups[l2->head].sent_at;
+    } else if (!l2->connected) {
+        since = ngx_current_msec;
+    } else {
+        return;
+    }
+
+    ngx_msec_int_t left = (ngx_msec_int_t) (since + l2->timeout
+                                            - ngx_current_msec);
+    ngx_add_timer(&l2->timer, left > 0 ? (ngx_msec_t) left : 1);
+}
+
+static void
+radius_cache_l2_write_handler(ngx_event_t *ev)
+{
+    ngx_connection_t *c = ev->data;
+    radius_cache_l2_t *l2 = c->data;
+
+    if (!l2->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+        if (err) {
+            LOG_ERR_LIMITED(&l2->log_limit, c->log, err,
+                            "l2 cache connect failed, addr: %V",
+                            &l2->addr.name);
+            fail_radius_cache_l2(l2, c->log);
+            return;
+        }
+
+        l2->connected = 1;
+        arm_radius_cache_l2_timer(l2);
+    }
+
+    while (l2->out_sent < l2->out_len) {
+        ssize_t n = c->send(c, l2->out + l2->out_sent,
+                            l2->out_len - l2->out_sent);
+        if (n == NGX_ERROR) {
+            LOG_ERR_LIMITED(&l2->log_limit, c->log, 0,
+                            "l2 cache send failed, addr: %V",
+                            &l2->addr.name);
+            fail_radius_cache_l2(l2, c->log);
+            return;
+        }
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                fail_radius_cache_l2(l2, c->log);
+            }
+            return;
+        }
+        l2->out_sent += n;
+    }
+
+    l2->out_len = 0;
+    l2->out_sent = 0;
+}
+
+static void
+radius_cache_l2_read_handler(ngx_event_t *ev)
+{
+    ngx_connection_t *c = ev->data;
+    radius_cache_l2_t *l2 = c->data;
+
+    if (c->close) {
+        // Graceful shutdown
+        fail_radius_cache_l2(l2, c->log);
+        return;
+    }
+
+    for (;;) {
+        ssize_t n = c->recv(c, l2->in + l2->in_len,
+                            sizeof(l2->in) - l2->in_len);
+        if (n == NGX_AGAIN) {
+            break;
+        }
+        if (n == 0 || n == NGX_ERROR) {
+            LOG_INFO(c->log, "l2 cache connection closed, addr: %V",
+                     &l2->addr.name);
+            fail_radius_cache_l2(l2, c->log);
+            return;
+        }
+        l2->in_len += n;
+
+        if (parse_radius_cache_l2(l2) != NGX_OK) {
+            LOG_ERR_LIMITED(&l2->log_limit, c->log, 0,
+                            "l2 cache unexpected reply, addr: %V",
+                            &l2->addr.name);
+            fail_radius_cache_l2(l2, c->log);
+            return;
+        }
+    }
+
+    arm_radius_cache_l2_timer(l2);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        fail_radius_cache_l2(l2, c->log);
+    }
+}
+
+// A lookup is answered by "END", with "VALUE <key> <flags> <bytes>"
+// and the data before it for each key found: "<expires> <generation>"
+// for the entry, "<generation>" for the user. Any other reply is an
+// error, such as one of a store, which don't expect any.
+static ngx_int_t
+parse_radius_cache_l2(radius_cache_l2_t *l2)
+{
+    u_char *p = l2->in;
+    u_char *last = l2->in + l2->in_len;
+
+    for (;;) {
+        u_char *lf = ngx_strlchr(p, last, LF);
+        if (lf == NULL || lf == p || lf[-1] != CR) {
+            if (lf) {
+                return NGX_ERROR;
+            }
+            break;
+        }
+
+        if (l2->npending == 0) {
+            return NGX_ERROR;
+        }
+
+        size_t len = lf + 1 - p;
+        if (len == sizeof("END\r\n") - 1
+            && ngx_strncmp(p, "END\r\n", len) == 0)
+        {
+            complete_radius_cache_l2(l2, 1);
+            p = lf + 1;
+            continue;
+        }
+
+        if (len <= sizeof("VALUE ") - 1
+            || ngx_strncmp(p, "VALUE ", sizeof("VALUE ") - 1) != 0)
+        {
+            return NGX_ERROR;
+        }
+
+        u_char *bytes = lf - 1;
+        while (bytes > p && bytes[-1] != ' ') {
+            bytes--;
+        }
+        ngx_int_t n = ngx_atoi(bytes, lf - 1 - bytes);
+        if (n == NGX_ERROR || n > (ngx_int_t) sizeof(l2->in) / 2) {
+            return NGX_ERROR;
+        }
+        if ((size_t) (last - lf - 1) < (size_t) n + 2) {
+            break;
+        }
+
+        if (parse_radius_cache_l2_value(l2, p + sizeof("VALUE ") - 1,
+                                        lf + 1, n) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        p = lf + 1 + n + 2;
+    }
+
+    if (p == l2->in && l2->in_len == sizeof(l2->in)) {
+        return NGX_ERROR;
+    }
+
+    l2->in_len = last - p;
+    ngx_memmove(l2->in, p, l2->in_len);
+    return NGX_OK;
+}
+
+static ngx_int_t
+parse_radius_cache_l2_value(radius_cache_l2_t *l2,
+                            u_char *key,
+                            u_char *data,
+                            size_t len)
+{
+    if (ngx_strncmp(key, "radius:u:", sizeof("radius:u:") - 1) == 0) {
+        ngx_int_t gen = ngx_atoi(data, len);
+        if (gen == NGX_ERROR) {
             return NGX_ERROR;
         }
+        l2->gen = gen;
+        return NGX_OK;
+    }
+
+    u_char *sp = ngx_strlchr(data, data + len, ' ');
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+    time_t expires = ngx_atotm(data, sp - data);
+    ngx_int_t gen = ngx_atoi(sp + 1, data + len - sp - 1);
+    if (expires == NGX_ERROR || gen == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    l2->found = 1;
+    l2->expires = expires;
+    l2->entry_gen = gen;
+    return NGX_OK;
+}
+
+static void
+radius_cache_l2_timeout_handler(ngx_event_t *ev)
+{
+    radius_cache_l2_t *l2 = ev->data;
+
+    LOG_ERR_LIMITED(&l2->log_limit, ev->log, 0,
+                    "l2 cache timedout, addr: %V, pending: %ui",
+                    &l2->addr.name, l2->npending);
+    fail_radius_cache_l2(l2, ev->log);
+}
+
+// The request is finalized while its lookup is pending
+static void
+radius_cache_l2_cleanup(void *data)
+{
+    ngx_http_auth_radius_ctx_t *ctx = data;
+
+    if (ctx->l2_waiting) {
+        // The reply is read and dropped
+        ctx->l2_lookup->ctx = NULL;
+        ctx->l2_waiting = 0;
+    }
+}
+
+static void
+init_radius_caches(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
+{
+    if (mcf->caches == NULL) {
+        return;
+    }
+
+    ngx_uint_t i;
+    ngx_shm_zone_t **zones = mcf->caches->elts;
+    for (i = 0; i < mcf->caches->nelts; i++) {
+        radius_cache_zone_t *cz = zones[i]->data;
+        if (cz->snapshot.len == 0) {
+            continue;
+        }
+
+        // Every worker has the timer, one of them saves per interval
+        cz->snapshot_ev.handler = radius_cache_snapshot_handler;
+        cz->snapshot_ev.data = zones[i];
+        cz->snapshot_ev.log = log;
+        cz->snapshot_ev.cancelable = 1;
+        ngx_add_timer(&cz->snapshot_ev, cz->snapshot_interval * 1000);
+    }
+}
+
+// The snapshot is saved on exit too, so a restart finds it up to date
+static void
+destroy_radius_caches(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
+{
+    if (mcf->caches == NULL) {
+        return;
+    }
+
+    ngx_uint_t i;
+    ngx_shm_zone_t **zones = mcf->caches->elts;
+    for (i = 0; i < mcf->caches->nelts; i++) {
+        radius_cache_zone_t *cz = zones[i]->data;
+        if (cz->l2) {
+            close_radius_cache_l2(cz->l2);
+        }
+
+        if (cz->snapshot.len) {
+            if (cz->snapshot_ev.timer_set) {
+                ngx_del_timer(&cz->snapshot_ev);
+            }
+            // Not again by the workers exiting at the same time
+            save_radius_cache_snapshot(zones[i], 1, log);
+        }
+    }
+}
+
+static void
+radius_cache_snapshot_handler(ngx_event_t *ev)
+{
+    ngx_shm_zone_t *shm_zone = ev->data;
+    radius_cache_zone_t *cz = shm_zone->data;
+
+    save_radius_cache_snapshot(shm_zone, cz->snapshot_interval, ev->log);
+    ngx_add_timer(ev, cz->snapshot_interval * 1000);
+}
+
+// The entries are copied under the lock and written to
+// "<snapshot>.<pid>", renamed over the snapshot then. Only the keys,
+// salted hashes of the credentials, and the times are saved, with the
+// nonce: the salt also needs the snapshot key, so the file alone is
+// useless for a dictionary attack. Nothing is saved if the last save
+// is less than min_age old.
+static void
+save_radius_cache_snapshot(ngx_shm_zone_t *shm_zone,
+                           time_t min_age,
+                           ngx_log_t *log)
+{
+    radius_cache_zone_t *cz = shm_zone->data;
+    time_t now = ngx_time();
+
+    ngx_shmtx_lock(&cz->shpool->mutex);
+
+    if (now - cz->sh->snapshot_at < min_age) {
+        ngx_shmtx_unlock(&cz->shpool->mutex);
+        return;
+    }
+    cz->sh->snapshot_at = now;
+
+    ngx_uint_t n = 0;
+    ngx_queue_t *q;
+    for (q = ngx_queue_head(&cz->sh->queue);
+         q != ngx_queue_sentinel(&cz->sh->queue);
+         q = ngx_queue_next(q))
+    {
+        n++;
+    }
+
+    size_t size = sizeof(radius_cache_snapshot_hdr_t)
+                  + n * sizeof(radius_cache_snapshot_rec_t);
+    u_char *buf = ngx_alloc(size, log);
+    if (buf == NULL) {
+        ngx_shmtx_unlock(&cz->shpool->mutex);
+        return;
+    }
+
+    radius_cache_snapshot_hdr_t *hdr = (radius_cache_snapshot_hdr_t *) buf;
+    hdr->magic = RADIUS_CACHE_SNAPSHOT_MAGIC;
+    hdr->count = n;
+    ngx_memcpy(hdr->nonce, cz->sh->nonce, sizeof(hdr->nonce));
+
+    radius_cache_snapshot_rec_t *rec = (radius_cache_snapshot_rec_t *)
+        (buf + sizeof(radius_cache_snapshot_hdr_t));
+    for (q = ngx_queue_head(&cz->sh->queue);
+         q != ngx_queue_sentinel(&cz->sh->queue);
+         q = ngx_queue_next(q), rec++)
+    {
+        radius_cache_node_t *cn = ngx_queue_data(q, radius_cache_node_t,
+                                                 queue);
+        ngx_memcpy(rec->key, cn->key, sizeof(rec->key));
+        rec->user = cn->user_node.key;
+        rec->reserved = 0;
+        rec->expires = cn->expires;
+        rec->stale_until = cn->stale_until;
+    }
+
+    ngx_shmtx_unlock(&cz->shpool->mutex);
+
+    ngx_str_t *path = &cz->snapshot;
+    u_char name[NGX_MAX_PATH];
+    if (path->len + NGX_INT64_LEN + 2 > sizeof(name)) {
+        ngx_free(buf);
+        return;
+    }
+    ngx_sprintf(name, "%V.%P%Z", path, ngx_pid);
+
+    ngx_fd_t fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                                NGX_FILE_OWNER_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        LOG_ERR(log, ngx_errno, ngx_open_file_n " \"%s\" failed", name);
+        ngx_free(buf);
+        return;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = ngx_write_fd(fd, buf + written, size - written);
+        if (w == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += w;
+    }
+    ngx_free(buf);
+
+    if (written < size) {
+        LOG_ERR(log, ngx_errno, ngx_write_fd_n " \"%s\" failed", name);
+        ngx_close_file(fd);
+        ngx_delete_file(name);
+        return;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR
+        || ngx_rename_file(name, path->data) == NGX_FILE_ERROR)
+    {
+        LOG_ERR(log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                name, path);
+        ngx_delete_file(name);
+        return;
+    }
+
+    LOG_DEBUG(log, "\"%V\" snapshot saved, entries: %ui",
+              &shm_zone->shm.name, n);
+}
+
+// Loaded into a new zone only. The time taken depends on the file and
+// the zone size only: the entries past their stale time are skipped
+// and the loading stops once the zone is full, keeping the most
+// recently used ones.
+static void
+load_radius_cache_snapshot(ngx_shm_zone_t *shm_zone)
+{
+    radius_cache_zone_t *cz = shm_zone->data;
+    ngx_log_t *log = shm_zone->shm.log;
+
+    ngx_file_t file;
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = cz->snapshot;
+    file.log = log;
+    file.fd = ngx_open_file(cz->snapshot.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            LOG_ERR(log, ngx_errno, ngx_open_file_n " \"%V\" failed",
+                    &cz->snapshot);
+        }
+        return;
+    }
 
-        ctx->type = lcf->type;
-        if (ctx->type == AUTH) {
-            ctx->user = r->headers_in.user;
-            ctx->passwd = r->headers_in.passwd;
-        } else {
-            ctx->user = lcf->health.user;
-            ctx->passwd = lcf->health.passwd;
+    ngx_file_info_t fi;
+    radius_cache_snapshot_hdr_t hdr;
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR
+        || ngx_read_file(&file, (u_char *) &hdr, sizeof(hdr), 0)
+           != (ssize_t) sizeof(hdr)
+        || hdr.magic != RADIUS_CACHE_SNAPSHOT_MAGIC
+        || ngx_file_size(&fi) != (off_t) (sizeof(hdr)
+                                          + (off_t) hdr.count
+                                            * sizeof(radius_cache_snapshot_rec_t)))
+    {
+        LOG_ERR(log, 0, "invalid snapshot \"%V\", ignored", &cz->snapshot);
+        ngx_close_file(file.fd);
+        return;
+    }
+
+    // The keys are only valid with the salt they were hashed with. With
+    // another snapshot key, they're just never found and age out.
+    ngx_memcpy(cz->sh->nonce, hdr.nonce, sizeof(cz->sh->nonce));
+    derive_radius_cache_salt(cz);
+
+    time_t now = ngx_time();
+    ngx_uint_t loaded = 0, skipped = 0, i, n;
+    off_t offset = sizeof(hdr);
+    radius_cache_snapshot_rec_t recs[RADIUS_CACHE_SNAPSHOT_BATCH];
+    size_t size = offsetof(ngx_rbtree_node_t, color)
+                  + sizeof(radius_cache_node_t);
+
+    for (n = hdr.count; n; n -= i) {
+        ngx_uint_t batch = ngx_min(n, RADIUS_CACHE_SNAPSHOT_BATCH);
+        ssize_t len = batch * sizeof(radius_cache_snapshot_rec_t);
+        if (ngx_read_file(&file, (u_char *) recs, len, offset) != len) {
+            break;
         }
+        offset += len;
+
+        for (i = 0; i < batch; i++) {
+            radius_cache_snapshot_rec_t *rec = &recs[i];
+            if (rec->stale_until < now
+                || lookup_radius_cache(cz, rec->key) != NULL)
+            {
+                skipped++;
+                continue;
+            }
 
-        ngx_http_set_ctx(r, ctx, ngx_http_auth_radius_module);
-    }
+            ngx_rbtree_node_t *node = ngx_slab_alloc(cz->shpool, size);
+            if (node == NULL) {
+                goto full;
+            }
 
-    if (ctx->done) {
-        if (ctx->internal_error) {
-            LOG_INFO(log, "internal error r: 0x%xl", r);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            radius_cache_node_t *cn = (radius_cache_node_t *) &node->color;
+            ngx_memcpy(&node->key, rec->key, sizeof(uint32_t));
+            ngx_memcpy(cn->key, rec->key, sizeof(cn->key));
+            cn->expires = rec->expires;
+            cn->stale_until = rec->stale_until;
+            cn->refreshing = 0;
+            cn->user_node.key = rec->user;
+            ngx_rbtree_insert(&cz->sh->rbtree, node);
+            ngx_rbtree_insert(&cz->sh->users, &cn->user_node);
+            // The file is most recently used first
+            ngx_queue_insert_tail(&cz->sh->queue, &cn->queue);
+            loaded++;
         }
+    }
 
-        if (ctx->timedout || ctx->connection_refused) {
-            if (ctx->timedout) {
-                LOG_INFO(log, "timedout r: 0x%xl", r);
-            } else {
-                LOG_INFO(log, "connection refused r: 0x%xl", r);
+full:
+
+    ngx_close_file(file.fd);
+
+    LOG_NOTICE(log, 0, "\"%V\" snapshot loaded, entries: %ui, skipped: %ui",
+               &shm_zone->shm.name, loaded, skipped);
+}
+
+// The key is the hash of the whole file, which should hold enough
+// random bytes, such as "openssl rand 32 > radius.key"
+static ngx_int_t
+read_radius_cache_snapshot_key(ngx_conf_t *cf,
+                               ngx_str_t *path,
+                               u_char *key)
+{
+    if (ngx_conf_full_name(cf->cycle, path, 1) != NGX_OK) {
+        CONF_LOG_EMERG(cf, 0, "invalid snapshot_key \"%V\"", path);
+        return NGX_ERROR;
+    }
+
+    ngx_file_t file;
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = *path;
+    file.log = cf->log;
+    file.fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        CONF_LOG_EMERG(cf, ngx_errno, ngx_open_file_n " \"%V\" failed", path);
+        return NGX_ERROR;
+    }
+
+    u_char buf[1024];
+    ngx_file_info_t fi;
+    ssize_t n = NGX_ERROR;
+    if (ngx_fd_info(file.fd, &fi) != NGX_FILE_ERROR
+        && ngx_file_size(&fi) >= 16
+        && ngx_file_size(&fi) <= (off_t) sizeof(buf))
+    {
+        n = ngx_read_file(&file, buf, ngx_file_size(&fi), 0);
+    }
+    ngx_close_file(file.fd);
+
+    if (n < 16) {
+        CONF_LOG_EMERG(cf, 0, "\"%V\" must have 16 to %uz bytes",
+                       path, sizeof(buf));
+        ngx_explicit_memzero(buf, sizeof(buf));
+        return NGX_ERROR;
+    }
+
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, buf, n);
+    ngx_md5_final(key, &md5);
+    ngx_explicit_memzero(buf, sizeof(buf));
+
+    return NGX_OK;
+}
+
+static void
+derive_radius_cache_salt(radius_cache_zone_t *cz)
+{
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, cz->snapshot_key, sizeof(cz->snapshot_key));
+    ngx_md5_update(&md5, cz->sh->nonce, sizeof(cz->sh->nonce));
+    ngx_md5_final(cz->sh->salt, &md5);
+}
+
+static void
+radius_limit_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+
+    for (;;) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            radius_limit_node_t *ln = (radius_limit_node_t *) &node->color;
+            radius_limit_node_t *lnt = (radius_limit_node_t *) &temp->color;
+            ngx_int_t rc = (ngx_int_t) ln->type - lnt->type;
+            if (rc == 0) {
+                rc = (ngx_int_t) ln->len - lnt->len;
             }
-            ctx->rs_idx++;
-            if (ctx->rs_idx >= lcf->server_ptrs->nelts) {
-                LOG_INFO(log, "no more servers r: 0x%xl", r);
-                return NGX_HTTP_SERVICE_UNAVAILABLE;
-            } else {
-                LOG_INFO(log, "try next server r: 0x%xl", r);
-                return select_radius_server(r, lcf->server_ptrs, ctx);
+            if (rc == 0) {
+                rc = ngx_memcmp(ln->data, lnt->data, ln->len);
             }
+            p = rc < 0 ? &temp->left : &temp->right;
         }
 
-        if (lcf->type == HEALTH) {
-            // Whatever accepted or rejected
-            LOG_INFO(log, "healthy r: 0x%xl", r);
-            return NGX_OK;
+        if (*p == sentinel) {
+            break;
         }
 
-        if (!ctx->accepted) {
-            LOG_INFO(log, "rejected r: 0x%xl", r);
-            return set_realm(r, &lcf->auth.realm);
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static radius_req_t *
+acquire_radius_req(radius_server_t* rs)
+{
+    if (rs->limit && rs->inflight >= rs->limit) {
+        return NULL;
+    }
+
+    radius_req_t *req = rs->req_free_list;
+    if (req) {
+        rs->inflight++;
+        rs->req_free_list = req->next;
+        req->next = NULL;
+        req->active = 1;
+        if (req->conn) {
+            req->conn->idle = 0;
         }
+    }
+    return req;
+}
 
-        LOG_INFO(log, "accepted r: 0x%xl", r);
+// Once some requests wait for a slot of the server, the slots are
+// granted by weighted fair queueing between the classes, see
+// grant_radius_slots. Returns NGX_AGAIN if the request waits,
+// NGX_DECLINED if the queue of its class is full, NGX_OK and NULL if
+// the server has no classes and no free slot, as acquire_radius_req.
+static ngx_int_t
+acquire_radius_slot(radius_server_t *rs,
+                    ngx_http_auth_radius_ctx_t *ctx,
+                    radius_req_t **reqp)
+{
+    if (rs->qos == NULL) {
+        *reqp = acquire_radius_req(rs);
         return NGX_OK;
     }
 
-    return select_radius_server(r, lcf->server_ptrs, ctx);
+    if (ctx->qos_granted) {
+        radius_server_t *grs = ctx->qos_rs;
+        ctx->qos_granted = 0;
+        grs->ngranted--;
+        if (grs == rs) {
+            *reqp = acquire_radius_req(rs);
+            if (*reqp) {
+                return NGX_OK;
+            }
+            // The limit has been cut since, wait again
+        } else {
+            // Failed over to another server since
+            grant_radius_slots(grs);
+        }
+    } else if (radius_slots_available(rs)) {
+        *reqp = acquire_radius_req(rs);
+        if (*reqp) {
+            return NGX_OK;
+        }
+    }
+
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+    radius_class_t *cls = mcf->classes->elts;
+    ngx_uint_t idx = ctx->lcf->qos;
+    radius_qos_t *qos = &rs->qos[idx];
+
+    if (cls[idx].queue && qos->nwaiting >= cls[idx].queue) {
+        qos->rejected++;
+        return NGX_DECLINED;
+    }
+
+    if (!ctx->qos_cleanup) {
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+        cln->handler = radius_qos_cleanup;
+        cln->data = ctx;
+        ctx->qos_cleanup = 1;
+    }
+
+    // Self-clocked fair queueing: a request finishes 1/weight after
+    // the later of the last one of its class and the one in service
+    uint64_t start = ngx_max(qos->finish, rs->vtime);
+    qos->finish = start + RADIUS_QOS_SCALE / cls[idx].weight;
+    ctx->qos_finish = qos->finish;
+    ctx->qos_since = ngx_current_msec;
+    ctx->qos_rs = rs;
+    ctx->qos_waiting = 1;
+    ngx_queue_insert_tail(&qos->waiting, &ctx->qos_link);
+    qos->nwaiting++;
+    qos->queued++;
+    rs->nwaiting++;
+    RADIUS_TRACE(ctx, RADIUS_TRACE_QUEUE, rs, -1, qos->nwaiting);
+
+    LOG_DEBUG(ctx->log, "\"%V\" waiting r: 0x%xl, class: %V, finish: %uL",
+              &rs->name, ctx->r, &cls[idx].name, ctx->qos_finish);
+
+    // Slots may be free, kept for the requests already granted one
+    grant_radius_slots(rs);
+
+    *reqp = NULL;
+    return NGX_AGAIN;
 }
 
-static ngx_int_t
-ngx_http_auth_radius_init(ngx_conf_t *cf)
+// Free slots not kept for granted requests, for requests that don't
+// wait, see acquire_radius_slot
+static ngx_uint_t
+radius_slots_available(radius_server_t *rs)
 {
-    ngx_http_core_main_conf_t *cmcf;
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    ngx_uint_t capacity = rs->limit ? rs->limit : rs->req_queue_size;
+    if (rs->nwaiting || capacity <= rs->inflight) {
+        return 0;
+    }
+    return capacity - rs->inflight > rs->ngranted;
+}
 
-    ngx_http_handler_pt *h;
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
-    if (h == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
-        return NGX_ERROR;
+// The waiting request with the smallest virtual finish time gets
+// each slot free
+static void
+grant_radius_slots(radius_server_t *rs)
+{
+    if (rs->qos == NULL) {
+        return;
     }
 
-    *h = ngx_http_auth_radius_handler;
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+    ngx_uint_t capacity = rs->limit ? rs->limit : rs->req_queue_size;
+
+    while (rs->nwaiting && capacity > rs->inflight + rs->ngranted) {
+        radius_qos_t *next = NULL;
+        ngx_http_auth_radius_ctx_t *ctx = NULL;
+        ngx_uint_t i;
+        for (i = 0; i < mcf->classes->nelts; i++) {
+            radius_qos_t *qos = &rs->qos[i];
+            if (ngx_queue_empty(&qos->waiting)) {
+                continue;
+            }
+            ngx_http_auth_radius_ctx_t *c = ngx_queue_data(
+                ngx_queue_head(&qos->waiting), ngx_http_auth_radius_ctx_t,
+                qos_link);
+            if (ctx == NULL || c->qos_finish < ctx->qos_finish) {
+                ctx = c;
+                next = qos;
+            }
+        }
 
-    return NGX_OK;
+        ngx_queue_remove(&ctx->qos_link);
+        next->nwaiting--;
+        next->granted++;
+        next->wait_time += ngx_current_msec - ctx->qos_since;
+        rs->nwaiting--;
+        rs->ngranted++;
+        rs->vtime = ctx->qos_finish;
+        ctx->qos_waiting = 0;
+        ctx->qos_granted = 1;
+        RADIUS_TRACE(ctx, RADIUS_TRACE_GRANT, rs, -1, rs->inflight);
+
+        ngx_post_event(ctx->r->connection->write, &ngx_posted_events);
+    }
 }
 
-static void *
-ngx_http_auth_radius_create_main_conf(ngx_conf_t *cf)
+// The request is finalized while waiting or before using its grant
+static void
+radius_qos_cleanup(void *data)
+{
+    ngx_http_auth_radius_ctx_t *ctx = data;
+    radius_server_t *rs = ctx->qos_rs;
+
+    if (ctx->qos_waiting) {
+        rs->qos[ctx->lcf->qos].nwaiting--;
+        ngx_queue_remove(&ctx->qos_link);
+        ctx->qos_waiting = 0;
+        rs->nwaiting--;
+    } else if (ctx->qos_granted) {
+        ctx->qos_granted = 0;
+        rs->ngranted--;
+        grant_radius_slots(rs);
+    }
+}
+
+static void
+release_radius_req(radius_req_t *req)
+{
+    radius_server_t *rs = req->rs;
+    RADIUS_PROBE_REQ(slot__release, req, req->accepted);
+    rs->inflight--;
+    req->active = 0;
+    // Dropped from the batch if not sent yet
+    req->encoding = 0;
+    req->ctx = NULL;
+    req->last_used = ngx_current_msec;
+    if (req->conn) {
+        req->conn->idle = 1;
+    }
+
+    radius_stream_t *stream = req->stream;
+    if (stream) {
+        // The peers are the connection's
+        req->stream = NULL;
+        req->peers = NULL;
+        req->peer = NULL;
+        if (--stream->pending == 0 && stream->conn) {
+            stream->conn->idle = 1;
+        }
+    }
+
+    req->next = rs->req_free_list;
+    rs->req_free_list = req;
+
+    grant_radius_slots(rs);
+
+    if (ngx_exiting) {
+        start_radius_shutdown(req->conn ? req->conn->log : ngx_cycle->log);
+    }
+}
+
+// The packet is created and sent at the end of the event loop
+// iteration, along with the packets of the other requests
+static void
+send_radius_pkg(radius_req_t *req,
+                ngx_msec_t timeout,
+                ngx_log_t *log)
 {
     ngx_http_auth_radius_main_conf_t *mcf;
-    mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_radius_main_conf_t));
-    if (mcf == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
-        return NGX_CONF_ERROR;
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                              ngx_http_auth_radius_module);
+
+    // A re-send of a request still queued is the same packet
+    if (!req->encoding) {
+        if (mcf->nencode == RADIUS_ENCODE_BATCH) {
+            flush_radius_pkgs(mcf, log);
+        }
+        req->encoding = 1;
+        mcf->encode[mcf->nencode++] = req;
+        RADIUS_TRACE_REQ(req, RADIUS_TRACE_ENQUEUE, mcf->nencode);
+        ngx_post_event(&mcf->encode_ev, &ngx_posted_events);
+    }
+
+    req->sent_at = ngx_current_msec;
+
+    // Subscribe to read timeout event
+    if (req->stream) {
+        ngx_add_timer(&req->timer, timeout);
+    } else {
+        ngx_add_timer(req->conn->read, timeout);
+    }
+}
+
+static void
+radius_encode_handler(ngx_event_t *ev)
+{
+    flush_radius_pkgs(ev->data, ev->log);
+}
+
+// The MD5 digests of all the packets are computed together,
+// see create_radius_pkgs
+static void
+flush_radius_pkgs(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
+{
+    radius_pkg_job_t jobs[RADIUS_ENCODE_BATCH];
+    radius_req_t *reqs[RADIUS_ENCODE_BATCH];
+    ngx_uint_t i, n = 0;
+
+    if (mcf->encode_ev.posted) {
+        ngx_delete_posted_event(&mcf->encode_ev);
+    }
+
+    for (i = 0; i < mcf->nencode; i++) {
+        radius_req_t *req = mcf->encode[i];
+        if (!req->encoding) {
+            // Released since
+            continue;
+        }
+        req->encoding = 0;
+
+        jobs[n].buf = req->buf;
+        jobs[n].len = sizeof(req->buf);
+        jobs[n].req_id = req->id;
+        jobs[n].user = &req->ctx->user;
+        jobs[n].passwd = &req->ctx->passwd;
+        jobs[n].secret = &req->rs->secret;
+        jobs[n].nas_id = &req->rs->nas_id;
+        jobs[n].attrs = &req->ctx->attrs;
+        jobs[n].req_auth = req->auth;
+        reqs[n++] = req;
+    }
+    mcf->nencode = 0;
+
+    create_radius_pkgs(jobs, n);
+
+    for (i = 0; i < n; i++) {
+        if (jobs[i].len == 0) {
+            // The attributes of the location don't fit with the
+            // credentials, which are checked by the handler
+            LOG_ERR(log, 0, "packet too long, r: 0x%xl", reqs[i]->ctx->r);
+            fail_radius_send(reqs[i], 0, log);
+            continue;
+        }
+        transmit_radius_pkg(reqs[i], jobs[i].len, log);
+    }
+}
+
+static void
+transmit_radius_pkg(radius_req_t *req, size_t len, ngx_log_t *log)
+{
+    RADIUS_PROBE_REQ(send, req, len);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_SEND, len);
+
+    if (req->stream) {
+        req->len = len;
+        queue_radius_stream(req->stream, req);
+        return;
+    }
+
+    int rc = send(req->conn->fd, req->buf, len, 0);
+    if (rc == -1) {
+        ngx_err_t err = ngx_errno;
+        LOG_ERR(log, err,
+                "send failed, fd: %d, r: 0x%xl, len: %uz",
+                req->conn->fd, req->ctx->r, len);
+        fail_radius_send(req, err, log);
+    }
+}
+
+// Fails fast if the peer is unreachable, see handle_radius_reply,
+// the request is an internal error otherwise
+static void
+fail_radius_send(radius_req_t *req, ngx_err_t err, ngx_log_t *log)
+{
+    // Not queued on its connection yet, nor has it a socket of its own
+    if (req->stream) {
+        if (req->timer.timer_set) {
+            ngx_del_timer(&req->timer);
+        }
+        req->ctx->done = 1;
+        req->ctx->internal_error = 1;
+        complete_radius_req(req);
+        return;
+    }
+
+    // The send error may be a previous ICMP error reported late
+    ngx_err_t ee = recv_radius_errqueue(req, log);
+    if (ee == 0 && err == ECONNREFUSED) {
+        ee = ECONNREFUSED;
+    }
+    if (ee) {
+        handle_radius_reply(req, -1, ee, log);
+        return;
+    }
+
+    if (req->conn->read->timer_set) {
+        ngx_del_timer(req->conn->read);
+    }
+    req->ctx->done = 1;
+    req->ctx->internal_error = 1;
+    complete_radius_req(req);
+}
+
+static int
+recv_radius_pkg(radius_req_t *req,
+                radius_server_t *rs,
+                ngx_log_t *log)
+{
+    // Read as much as possible
+    int prev_rc = -1;
+    for (;;) {
+        ssize_t len = recv(req->conn->fd,
+                           req->buf, sizeof(req->buf),
+                           MSG_TRUNC);
+        if (len == -1) {
+            if (ngx_errno != EAGAIN) {
+                LOG_ERR_LIMITED(&rs->log_limit, log, ngx_errno,
+                                "recv failed, r: 0x%xl, req: 0x%xl",
+                                req->ctx->r, req);
+            }
+            // Nothing can be received any more, exit
+            return prev_rc;
+        }
+
+        if (len > (ssize_t) sizeof(req->buf)) {
+            RADIUS_PROBE_REQ(reply, req, len);
+            RADIUS_TRACE_REQ(req, RADIUS_TRACE_REPLY, len);
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                            "recv buf too small, r: 0x%xl, req: 0x%xl",
+                            req->ctx->r, req);
+            continue;
+        }
+
+        int rc = parse_radius_reply(req, req->buf, len, log);
+        if (rc < 0) {
+            continue;
+        }
+
+        return rc;
+    }
+}
+
+static int
+parse_radius_reply(radius_req_t *req,
+                   const uint8_t *buf,
+                   size_t len,
+                   ngx_log_t *log)
+{
+    radius_server_t *rs = req->rs;
+
+    RADIUS_PROBE_REQ(reply, req, len);
+    int rc = parse_radius_pkg(buf, len,
+                              req->id,
+                              req->auth,
+                              &rs->secret);
+    return check_radius_reply(req, rc, len, log);
+}
+
+// Logs the errors of parse_radius_pkg
+static int
+check_radius_reply(radius_req_t *req,
+                   int rc,
+                   size_t len,
+                   ngx_log_t *log)
+{
+    radius_server_t *rs = req->rs;
+
+    RADIUS_PROBE_REQ(parse, req, rc);
+    RADIUS_TRACE_REQ(req, RADIUS_TRACE_PARSE, rc);
+    if (rc < 0) {
+        switch (rc) {
+        case -1:
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                    "parse pkg error: incorrect pkg len: %uz, r: 0x%xl, req: 0x%xl",
+                    len, req->ctx->r, req);
+            break;
+        case -2:
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                    "parse pkg error: req_id doesn't match, r: 0x%xl, req: 0x%xl",
+                    req->ctx->r, req);
+            break;
+        case -3:
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                    "parse pkg error: incorrect auth, r: 0x%xl, req: 0x%xl",
+                    req->ctx->r, req);
+            break;
+        default:
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                    "parse pkg error: unknown rc: %d, r: 0x%xl, req: 0x%xl",
+                    rc, req->ctx->r, req);
+            break;
+        }
+
+        return rc;
     }
 
-    return mcf;
+    req->accepted = rc == RADIUS_AUTH_ACCEPTED;
+    return rc;
 }
 
-static void *
-ngx_http_auth_radius_create_loc_conf(ngx_conf_t *cf)
+static ngx_err_t
+recv_radius_errqueue(radius_req_t *req, ngx_log_t *log)
 {
-    ngx_http_auth_radius_loc_conf_t *lcf;
-    lcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_radius_loc_conf_t));
-    if (lcf == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
-        return NGX_CONF_ERROR;
+    ngx_err_t err = 0;
+
+#if (NGX_LINUX)
+    // Drain the queue, otherwise the socket stays readable
+    for (;;) {
+        u_char control[512];
+        struct msghdr msg;
+        ngx_memzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(req->conn->fd, &msg, MSG_ERRQUEUE) == -1) {
+            break;
+        }
+
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == IPPROTO_IP
+                  && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == IPPROTO_IPV6
+                     && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            struct sock_extended_err *ee = (void *) CMSG_DATA(cmsg);
+            if (ee->ee_origin != SO_EE_ORIGIN_ICMP
+                && ee->ee_origin != SO_EE_ORIGIN_ICMP6)
+            {
+                continue;
+            }
+
+            LOG_NOTICE(log, ee->ee_errno,
+                       "\"%V\" icmp error, type: %d, code: %d, addr: %V",
+                       &req->rs->name, ee->ee_type, ee->ee_code,
+                       req->peer ? &req->peer->name : &req->rs->url);
+
+            switch (ee->ee_errno) {
+            case ECONNREFUSED:
+            case EHOSTUNREACH:
+            case ENETUNREACH:
+            case EHOSTDOWN:
+            case ENETDOWN:
+            case EACCES:
+                // The request can't get through, no point in waiting
+                err = ee->ee_errno;
+                break;
+            default:
+                break;
+            }
+        }
     }
+#endif
 
-    lcf->type = NONE;
-    return lcf;
+    return err;
 }
 
-static char*
-ngx_http_auth_radius_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+static void
+radius_reschedule_handler(ngx_event_t *ev)
 {
-    //ngx_http_auth_radius_loc_conf_t *prev = parent;
-    //ngx_http_auth_radius_loc_conf_t *conf = child;
-    //ngx_conf_merge_str_value(conf->realm, prev->realm, "");
-
-    return NGX_CONF_OK;
+    ngx_http_request_t *r = ev->data;
+    ngx_post_event(r->connection->write, &ngx_posted_events);
 }
 
-static char *
-ngx_http_auth_radius_set_radius_server_block(ngx_conf_t *cf,
-                                             ngx_command_t *cmd,
-                                             void *conf)
+static void
+radius_read_handler(ngx_event_t *ev)
 {
-    ngx_str_t *value = cf->args->elts;
+    ngx_log_t *log = ev->log;
 
-    ngx_str_t name = value[1];
+    ngx_connection_t *c = ev->data;
+    radius_req_t *req = c->data;
+    ngx_http_auth_radius_ctx_t *ctx = req->ctx;
 
-    if (ngx_strlen(name.data) == 0) {
-        CONF_LOG_EMERG(cf, 0, "missing server name in radius_server");
-        return NGX_CONF_ERROR;
+    if (c->close) {
+        // Graceful shutdown, the slot is free
+        start_radius_shutdown(log);
+        close_radius_req(req);
+        return;
     }
 
-    ngx_http_auth_radius_main_conf_t *mcf;
-    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
-
-    if (mcf->servers == NULL) {
-        mcf->servers = ngx_array_create(cf->pool, 5, sizeof(radius_server_t));
-        if (mcf->servers == NULL) {
-            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
-            return NGX_CONF_ERROR;
+    if (ctx == NULL) {
+        (void) recv_radius_errqueue(req, log);
+        LOG_ERR_LIMITED(&req->rs->log_limit, log, 0,
+                        "ctx == NULL, unexpected data received, flush it");
+        uint8_t buf[RADIUS_PKG_MAX];
+        for (;;) {
+            ssize_t len = recv(req->conn->fd,
+                               buf, sizeof(buf),
+                               MSG_TRUNC);
+            if (len == -1) {
+                if (ngx_errno != EAGAIN) {
+                    LOG_ERR(log, ngx_errno, "recv failed, req: 0x%xl", req);
+                }
+                break;
+            }
         }
+        return;
     }
 
-    radius_server_t *rs = ngx_array_push(mcf->servers);
-    if (rs == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
-        return NGX_CONF_ERROR;
-    }
+    ngx_http_request_t *r = ctx->r;
 
-    ngx_memzero(rs, sizeof(*rs));
-    rs->id = mcf->servers->nelts;
-    rs->name = name;
-    rs->auth_timeout = 5000;
-    rs->auth_retries = 3;
-    rs->health_timeout = 5000;
-    rs->health_retries = 1;
-    rs->req_queue_size = 10;
+    assert(ctx->req == req);
 
-    // Set ngx_http_auth_radius_set_radius_server as a handler
-    // for each value in the block
-    ngx_conf_t save = *cf;
-    cf->handler = ngx_http_auth_radius_set_radius_server;
-    cf->handler_conf = conf;
-    char *rc = ngx_conf_parse(cf, NULL);
-    *cf = save;
+    if (ev->timedout) {
+        ev->timedout = 0;
 
-    rs->req_queue = ngx_pcalloc(cf->pool,
-                                rs->req_queue_size * sizeof(radius_req_t));
-    if (rs->req_queue == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
-        return NGX_CONF_ERROR;
+        ctx->retries--;
+        LOG_DEBUG(log, "timedout r: 0x%xl, retries: %d", r, ctx->retries);
+        RADIUS_PROBE_REQ(timeout, req, ctx->retries);
+        RADIUS_TRACE_REQ(req, RADIUS_TRACE_TIMEOUT, ctx->retries);
+
+        if (!ctx->retries) {
+            mark_radius_peer_down(req, log);
+            ctx->done = 1;
+            ctx->timedout = 1;
+            goto auth_done;
+        }
+
+        // Re-send RADIUS Auth event
+        RADIUS_PROBE_REQ(retransmit, req, ctx->retries);
+        RADIUS_TRACE_REQ(req, RADIUS_TRACE_RETRANSMIT, ctx->retries);
+        send_radius_request(ctx, req);
+        return;
     }
 
-    size_t i;
-    radius_req_t *req = NULL;
-    for (i = 1; i < rs->req_queue_size; ++i) {
-        req = &rs->req_queue[i];
-        req->id = i;
-        rs->req_queue[i - 1].next = req;
+    // A reply received before the error still counts
+    ngx_err_t err = recv_radius_errqueue(req, log);
+    int rc = recv_radius_pkg(req, req->rs, log);
+    if (rc == -1 && !err && ngx_errno == ECONNREFUSED) {
+        err = ECONNREFUSED;
     }
-    rs->req_free_list = &rs->req_queue[0];
-    rs->req_last_list = req;
+    handle_radius_reply(req, rc, err, log);
+    return;
 
-    return rc;
+auth_done:
+    complete_radius_req(req);
 }
 
-static char*
-ngx_http_auth_radius_set_radius_server(ngx_conf_t *cf,
-                                       ngx_command_t *cmd,
-                                       void *conf)
+static void
+handle_radius_reply(radius_req_t *req,
+                    int rc,
+                    ngx_err_t err,
+                    ngx_log_t *log)
 {
-    ngx_http_auth_radius_main_conf_t *mcf = conf;
-
-    // Get latest server from servers array
-    assert(mcf->servers != NULL);
-
-    radius_server_t *rss = mcf->servers->elts; // [radius_server_t]
-    radius_server_t *rs = &rss[mcf->servers->nelts - 1];
+    ngx_http_auth_radius_ctx_t *ctx = req->ctx;
+    ngx_http_request_t *r = ctx->r;
 
-    ngx_str_t* value = cf->args->elts;
-
-    if (ngx_strncmp(value[0].data, "url", value[0].len) == 0) {
-        ngx_url_t u;
-        ngx_memzero(&u, sizeof(ngx_url_t));
-        u.url = value[1];
-        u.uri_part = 1;
-        u.default_port = RADIUS_DEFAULT_PORT;
-        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
-            if (u.err) {
-                CONF_LOG_EMERG(cf, ngx_errno,
-                               "invalid \"%V\" \"url\" value: \"%V\"",
-                               &value[0], &value[1]);
+    if (rc == -1) {
+        if (err) {
+            // Port, host or network unreachable, fail fast
+            LOG_ERR(log, err, "recv radius pkg: peer unreachable r: 0x%xl", r);
+            if (req->conn->read->timer_set) {
+                ngx_del_timer(req->conn->read);
             }
-            return NGX_CONF_ERROR;
-        }
-        rs->url = value[1];
-        rs->sockaddr = u.addrs[0].sockaddr;
-        rs->socklen = u.addrs[0].socklen;
-    } else if (ngx_strncmp(value[0].data, "secret", value[0].len) == 0) {
-        rs->secret = value[1];
-    } else if (ngx_strncmp(value[0].data, "nas_identifier", value[0].len) == 0) {
-        rs->nas_id = value[1];
-    } else if (ngx_strncmp(value[0].data, "auth_timeout", value[0].len) == 0) {
-        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
-        if (timeout == NGX_ERROR) {
-            CONF_LOG_EMERG(cf, ngx_errno,
-                           "invalid \"auth_timeout\" value: \"%V\"",
-                           &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        rs->auth_timeout = timeout;
-    } else if (ngx_strncmp(value[0].data, "auth_retries", value[0].len) == 0) {
-        ngx_int_t retries = ngx_atoi(value[1].data, value[1].len);
-        if (retries == NGX_ERROR) {
-            CONF_LOG_EMERG(cf, ngx_errno,
-                           "invalid \"auth_retries\" value: \"%V\"",
-                           &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        rs->auth_retries = retries;
-    } else if (ngx_strncmp(value[0].data, "health_timeout", value[0].len) == 0) {
-        ngx_int_t timeout = ngx_parse_time(&value[1], 0);
-        if (timeout == NGX_ERROR) {
-            CONF_LOG_EMERG(cf, ngx_errno,
-                           "invalid \"health_timeout\" value: \"%V\"",
-                           &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        rs->health_timeout = timeout;
-    } else if (ngx_strncmp(value[0].data, "health_retries", value[0].len) == 0) {
-        ngx_int_t retries = ngx_atoi(value[1].data, value[1].len);
-        if (retries == NGX_ERROR) {
-            CONF_LOG_EMERG(cf, ngx_errno,
-                           "invalid \"health_retries\" value: \"%V\"",
-                           &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        rs->health_retries = retries;
-    } else if (ngx_strncmp(value[0].data, "queue_size", value[0].len) == 0) {
-        ngx_int_t size = ngx_atoi(value[1].data, value[1].len);
-        if (size == NGX_ERROR) {
-            CONF_LOG_EMERG(cf, ngx_errno,
-                           "invalid \"queue_size\" value: \"%V\"",
-                           &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        if (size < 1 || size > 255) {
-            CONF_LOG_EMERG(cf, 0,
-                           "invalid \"queue_size\" value: \"%V\", "
-                           "expected value range [1, 255]",
-                           &value[1]);
-            return NGX_CONF_ERROR;
+            mark_radius_peer_down(req, log);
+            ctx->done = 1;
+            ctx->connection_refused = 1;
+            complete_radius_req(req);
+        } else {
+            LOG_ERR_LIMITED(&req->rs->log_limit, log, 0,
+                            "recv radius pkg: bad pkg r: 0x%xl", r);
+            // Handle error in read timeout
         }
-        rs->req_queue_size = size;
-    } else {
-        CONF_LOG_EMERG(cf, 0,
-                       "unknown option \"%V\"",
-                       &value[0]);
-        return NGX_CONF_ERROR;
+        return;
     }
 
-    return NGX_CONF_OK;
+    // Remove read timeout event
+    if (req->conn->read->timer_set) {
+        ngx_del_timer(req->conn->read);
+    }
+
+    LOG_DEBUG(log,
+              "accepted: %d, r: 0x%xl, req: 0x%xl, req_id: %d",
+              req->accepted, r, req, req->id);
+
+    ctx->done = 1;
+    ctx->accepted = req->accepted;
+
+    complete_radius_req(req);
 }
 
-static char *
-ngx_http_auth_radius_set_radius_servers(ngx_conf_t *cf,
-                                        ngx_command_t *cmd,
-                                        void *conf)
+static ngx_int_t
+ngx_http_auth_radius_log_handler(ngx_http_request_t *r)
 {
-    ngx_str_t *value = cf->args->elts;
-
-    ngx_http_auth_radius_main_conf_t *mcf;
-    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_radius_module);
+    ngx_http_auth_radius_ctx_t *ctx;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_radius_module);
 
-    if (mcf->servers == NULL) {
-        CONF_LOG_EMERG(cf, 0,
-                       "using \"radius_servers\" without \"radius_server\" defined");
-        return NGX_CONF_ERROR;
+    if (ctx && ctx->acct_started) {
+        record_radius_acct(r, ctx, RADIUS_ACCT_STOP);
     }
 
-    ngx_http_auth_radius_loc_conf_t *lcf;
-    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
+    return NGX_OK;
+}
 
-    if (lcf->server_ptrs == NULL) {
-        lcf->server_ptrs = ngx_array_create(cf->pool, 5, sizeof(radius_server_t *));
-        if (lcf->server_ptrs == NULL) {
-            CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_create failed");
-            return NGX_CONF_ERROR;
-        }
+static void
+start_radius_acct(ngx_http_request_t *r, ngx_http_auth_radius_ctx_t *ctx)
+{
+    if (ctx->lcf->acct == NULL || ctx->acct_started) {
+        return;
     }
 
-    assert(mcf->servers != NULL);
+    // Not stored yet if accepted from cache
+    ctx->acct_started = 1;
+    ngx_http_set_ctx(r, ctx, ngx_http_auth_radius_module);
 
-    radius_server_t *rss = mcf->servers->elts; // [radius_server_t]
-    radius_server_t *server = NULL;
+    if (ctx->lcf->acct_start) {
+        record_radius_acct(r, ctx, RADIUS_ACCT_START);
+    }
+}
 
-    // Search server by name
-    size_t i;
-    for (i = 0; i < mcf->servers->nelts; i++) {
-        radius_server_t *rs = &rss[i];
-        if (ngx_strncmp(rs->name.data, value[1].data, rs->name.len) == 0) {
-            server = rs;
-            break;
-        }
+// Only copies the record, it is sent by radius_acct_handler
+static void
+record_radius_acct(ngx_http_request_t *r,
+                   ngx_http_auth_radius_ctx_t *ctx,
+                   uint8_t status)
+{
+    ngx_http_auth_radius_main_conf_t *mcf;
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_auth_radius_module);
+
+    radius_acct_rec_t rec;
+    // Written to the spill file as is
+    ngx_memzero(&rec, sizeof(rec));
+    rec.magic = RADIUS_ACCT_MAGIC;
+    rec.server = ctx->lcf->acct->hash;
+    rec.status = status;
+    rec.user_len = ngx_min(ctx->user.len, RADIUS_ACCT_USER_MAX);
+    ngx_memcpy(rec.user, ctx->user.data, rec.user_len);
+    // The same for the Start and the Stop of a request
+    rec.session_len = ngx_snprintf(rec.session, sizeof(rec.session),
+                                   "%T%03M-%uA-%ui",
+                                   r->start_sec, r->start_msec,
+                                   r->connection->number,
+                                   r->connection->requests)
+                      - rec.session;
+    rec.recorded = ngx_time();
+    if (status == RADIUS_ACCT_STOP) {
+        rec.session_time = ngx_time() - r->start_sec;
+        rec.input_octets = r->request_length;
+        rec.output_octets = r->connection->sent;
     }
 
-    if (server == NULL) {
-        CONF_LOG_EMERG(cf, 0, "server \"%V\" is not defined", value);
-        return NGX_CONF_ERROR;
+    mcf->acct->recorded++;
+    push_radius_acct(mcf->acct, &rec, r->connection->log);
+}
+
+static void
+push_radius_acct(radius_acct_queue_t *q,
+                 const radius_acct_rec_t *rec,
+                 ngx_log_t *log)
+{
+    if (!q->ev.posted) {
+        ngx_post_event(&q->ev, &ngx_posted_events);
     }
 
-    radius_server_t **target = ngx_array_push(lcf->server_ptrs);
-    if (target == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_array_push failed");
-        return NGX_CONF_ERROR;
+    // Behind the records spilled already
+    if (q->spill_read < q->spill_write) {
+        spill_radius_acct(q, rec, 1, log);
+        return;
     }
 
-    *target = server;
+    if (q->count == q->size) {
+        if (q->overflow == RADIUS_ACCT_SPILL) {
+            spill_radius_acct(q, rec, 1, log);
+            return;
+        }
 
-    return NGX_CONF_OK;
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+        q->dropped++;
+        LOG_NOTICE_LIMITED(&q->log_limit, log, 0,
+                           "accounting queue is full, oldest record dropped");
+    }
+
+    q->ring[(q->head + q->count) % q->size] = *rec;
+    q->count++;
 }
 
-static char *
-ngx_http_auth_radius_set_radius_auth(ngx_conf_t *cf,
-                                     ngx_command_t *cmd,
-                                     void *conf)
+static void
+spill_radius_acct(radius_acct_queue_t *q,
+                  const radius_acct_rec_t *recs,
+                  ngx_uint_t n,
+                  ngx_log_t *log)
 {
-    ngx_str_t *value = cf->args->elts;
+    size_t size = n * sizeof(radius_acct_rec_t);
 
-    if (ngx_strncmp(value[1].data, "off", 3) == 0) {
-        return NGX_CONF_OK;
+    if (q->spill.fd == NGX_INVALID_FILE) {
+        q->dropped += n;
+        return;
     }
 
-    ngx_http_auth_radius_loc_conf_t *lcf;
-    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
-
-    if (lcf->type == HEALTH) {
-        CONF_LOG_EMERG(cf, 0,
-                       "\"radius_health\" already defined");
-        return NGX_CONF_ERROR;
+    if (q->spill_write == 0) {
+        radius_acct_spill_hdr_t hdr = {
+            .magic = RADIUS_ACCT_MAGIC,
+            .read = sizeof(hdr),
+        };
+        if (ngx_write_file(&q->spill, (u_char *) &hdr, sizeof(hdr), 0)
+            != (ssize_t) sizeof(hdr))
+        {
+            q->dropped += n;
+            return;
+        }
+        q->spill_read = sizeof(hdr);
+        q->spill_write = sizeof(hdr);
     }
 
-    lcf->type = AUTH;
-    lcf->auth.realm.len = sizeof("Basic realm=\"") - 1 + value[1].len + 1;
-    lcf->auth.realm.data = ngx_pcalloc(cf->pool, lcf->auth.realm.len);
-    if (lcf->auth.realm.data == NULL) {
-        CONF_LOG_EMERG(cf, ngx_errno, "ngx_pcalloc failed");
-        return NGX_CONF_ERROR;
+    if (q->spill_write + (off_t) size > q->spill_max) {
+        q->dropped += n;
+        LOG_ERR_LIMITED(&q->log_limit, log, 0,
+                        "accounting spill file is full, %ui records dropped",
+                        n);
+        return;
     }
 
-    uint8_t *p;
-    p = ngx_cpymem(lcf->auth.realm.data,
-                   "Basic realm=\"",
-                   sizeof("Basic realm=\"") - 1);
-    p = ngx_cpymem(p, value[1].data, value[1].len);
-    *p = '"';
+    if (ngx_write_file(&q->spill, (u_char *) recs, size, q->spill_write)
+        != (ssize_t) size)
+    {
+        q->dropped += n;
+        return;
+    }
 
-    return NGX_CONF_OK;
+    q->spill_write += size;
+    q->spilled += n;
 }
 
-static char *
-ngx_http_auth_radius_set_radius_health(ngx_conf_t *cf,
-                                       ngx_command_t *cmd,
-                                       void *conf)
+// Moves spilled records to the ring as it empties, the file is reset
+// once they are all read back
+static void
+replay_radius_acct(radius_acct_queue_t *q, ngx_log_t *log)
 {
-    ngx_str_t *value = cf->args->elts;
+    if (q->spill_read == q->spill_write || q->count == q->size) {
+        return;
+    }
 
-    ngx_http_auth_radius_loc_conf_t *lcf;
-    lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_auth_radius_module);
+    while (q->count < q->size) {
+        ngx_uint_t left = (q->spill_write - q->spill_read)
+                          / sizeof(radius_acct_rec_t);
+        if (left == 0) {
+            break;
+        }
 
-    if (lcf->type == AUTH) {
-        CONF_LOG_EMERG(cf, 0,
-                       "\"auth_radius\" or \"radius_auth\" already defined");
-        return NGX_CONF_ERROR;
-    }
+        ngx_uint_t tail = (q->head + q->count) % q->size;
+        ngx_uint_t n = ngx_min(q->size - q->count, q->size - tail);
+        n = ngx_min(n, left);
+        n = ngx_min(n, RADIUS_ACCT_REPLAY_BATCH);
+
+        size_t size = n * sizeof(radius_acct_rec_t);
+        if (ngx_read_file(&q->spill, (u_char *) &q->ring[tail], size,
+                          q->spill_read) != (ssize_t) size)
+        {
+            q->dropped += left;
+            reset_radius_acct_spill(q, log);
+            return;
+        }
 
-    lcf->type = HEALTH;
+        ngx_uint_t i;
+        for (i = 0; i < n; i++) {
+            if (q->ring[tail + i].magic != RADIUS_ACCT_MAGIC) {
+                LOG_ERR(log, 0, "corrupted accounting spill file \"%V\", "
+                        "%ui records dropped", &q->spill.name, left);
+                q->dropped += left;
+                reset_radius_acct_spill(q, log);
+                return;
+            }
+        }
 
-    if (cf->args->nelts >= 2) {
-        lcf->health.user = value[1];
+        q->count += n;
+        q->spill_read += size;
     }
 
-    if (cf->args->nelts == 3) {
-        lcf->health.passwd = value[2];
+    if (q->spill_write - q->spill_read < (off_t) sizeof(radius_acct_rec_t)) {
+        reset_radius_acct_spill(q, log);
+        return;
     }
 
-    return NGX_CONF_OK;
+    // Where a worker taking the file over resumes, see
+    // open_radius_acct_spill
+    uint64_t read = q->spill_read;
+    (void) ngx_write_file(&q->spill, (u_char *) &read, sizeof(read),
+                          offsetof(radius_acct_spill_hdr_t, read));
 }
 
-static ngx_int_t
-ngx_http_auth_radius_init_servers(ngx_cycle_t *cycle)
+static void
+reset_radius_acct_spill(radius_acct_queue_t *q, ngx_log_t *log)
 {
-    ngx_http_auth_radius_main_conf_t *mcf;
-    mcf = ngx_http_cycle_get_module_main_conf(cycle,
-                                              ngx_http_auth_radius_module);
-
-    if (mcf == NULL) {
-        return NGX_ERROR;
+    if (ftruncate(q->spill.fd, 0) == -1) {
+        LOG_ERR(log, ngx_errno, "ftruncate \"%V\" failed", &q->spill.name);
     }
 
-    ngx_log_t *log = cycle->log;
-    return init_radius_servers(mcf->servers, log);
+    q->spill_read = 0;
+    q->spill_write = 0;
 }
 
+// Sends the records in order, as long as the server of the oldest
+// one has a free slot
 static void
-ngx_http_auth_radius_destroy_servers(ngx_cycle_t *cycle)
+radius_acct_handler(ngx_event_t *ev)
 {
+    radius_acct_queue_t *q = ev->data;
+    ngx_log_t *log = ev->log;
+
     ngx_http_auth_radius_main_conf_t *mcf;
-    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
                                               ngx_http_auth_radius_module);
 
-    if (mcf == NULL) {
+    if (ngx_exiting) {
+        // Only the records in flight are waited for, the rest is
+        // spilled on exit, see destroy_radius_acct
         return;
     }
 
-    ngx_log_t *log = cycle->log;
-    destroy_radius_servers(mcf->servers, log);
-}
+    replay_radius_acct(q, log);
 
-static ngx_int_t
-init_radius_servers(ngx_array_t *servers, ngx_log_t *log)
-{
-    if (servers == NULL) {
-        LOG_EMERG(log, 0, "no radius servers");
-        return NGX_ERROR;
-    }
+    while (q->count) {
+        radius_acct_rec_t *rec = &q->ring[q->head];
 
-    assert(servers != NULL);
+        radius_server_t *rss = mcf->servers->elts;
+        radius_server_t *rs = NULL;
+        size_t i;
+        for (i = 0; i < mcf->servers->nelts; i++) {
+            if (rss[i].acct && rss[i].hash == rec->server) {
+                rs = &rss[i];
+                break;
+            }
+        }
 
-    size_t i, j;
-    radius_server_t *rss = servers->elts;
-    for (i = 0; i < servers->nelts; ++i) {
-        radius_server_t *rs = &rss[i];
+        radius_acct_slot_t *slot = NULL;
+        if (rs) {
+            radius_acct_chan_t *chan = rs->acct;
+            if (chan->nactive == chan->nslots) {
+                // Posted again once a slot is released
+                return;
+            }
 
-        sa_family_t family = rs->sockaddr->sa_family;
-        char host[INET6_ADDRSTRLEN] = "";
-        uint16_t port = 0;
-        if (family == AF_INET) {
-            struct sockaddr_in *sa = (struct sockaddr_in *)rs->sockaddr;
-            inet_ntop(family, &sa->sin_addr, host, sizeof(host)),
-            port = ntohs(sa->sin_port);
-        } else if (family == AF_INET6) {
-            struct sockaddr_in6 *sa = (struct sockaddr_in6 *)rs->sockaddr;
-            inet_ntop(family, &sa->sin6_addr, host, sizeof(host)),
-            port = ntohs(sa->sin6_port);
+            for (i = 0; i < chan->nslots; i++) {
+                slot = &chan->slots[(chan->next + i) % chan->nslots];
+                if (!slot->active) {
+                    break;
+                }
+            }
+            chan->next = slot->id + 1;
+            chan->nactive++;
+            slot->active = 1;
+            slot->tries = 0;
+            slot->rec = *rec;
         } else {
-            LOG_ERR(log, 0, "unknown family: %d", family);
+            // Spilled for a server not configured anymore
+            q->dropped++;
         }
-        LOG_DEBUG(log, "\"%V\", addr: %s:%d", &rs->name, host, port);
 
-        for (j = 0; j < rs->req_queue_size; ++j) {
-            radius_req_t *req = &rs->req_queue[j];
-            ngx_connection_t *c = create_radius_connection(rs->sockaddr,
-                                                           rs->socklen, log);
-            if (c == NULL) {
-                destroy_radius_servers(servers, log);
-                return NGX_ERROR;
-            }
-            req->conn = c;
-            c->data = req;
-            req->rs = rs;
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+
+        if (q->count == 0) {
+            replay_radius_acct(q, log);
         }
-    }
 
-    return NGX_OK;
+        if (slot == NULL) {
+            continue;
+        }
+
+        rec = &slot->rec;
+        ngx_str_t user = { rec->user_len, rec->user };
+        ngx_str_t session = { rec->session_len, rec->session };
+        radius_acct_t acct = {
+            .status_type = rec->status,
+            .user = &user,
+            .session_id = &session,
+            .session_time = rec->session_time,
+            .delay_time = ngx_time() - rec->recorded,
+            .input_octets = rec->input_octets,
+            .output_octets = rec->output_octets,
+        };
+        slot->len = create_radius_acct_pkg(slot->buf, sizeof(slot->buf),
+                                           slot->id, &acct, &rs->secret,
+                                           &rs->nas_id, slot->auth);
+        if (slot->len == 0) {
+            LOG_ERR_LIMITED(&rs->log_limit, log, 0,
+                            "\"%V\" Accounting-Request can't be encoded, "
+                            "record dropped", &rs->name);
+            q->failed++;
+            release_radius_acct_slot(slot);
+            continue;
+        }
+
+        q->sent++;
+        send_radius_acct(slot, log);
+    }
 }
 
+// Without a reply, the slot timer resends the same packet
 static void
-destroy_radius_servers(ngx_array_t* servers, ngx_log_t *log)
+send_radius_acct(radius_acct_slot_t *slot, ngx_log_t *log)
 {
-    if (servers == NULL) {
-        LOG_EMERG(log, 0, "no radius servers");
-        return;
-    }
+    radius_acct_chan_t *chan = slot->chan;
+    radius_server_t *rs = chan->rs;
 
-    assert(servers != NULL);
-
-    size_t i, j;
-    radius_server_t *rss = servers->elts;
-    for (i = 0; i < servers->nelts; ++i) {
-        radius_server_t *rs = &rss[i];
-        for (j = 0; j < rs->req_queue_size; ++j) {
-           radius_req_t *req = &rs->req_queue[j];
-            if (req->conn) {
-                close_radius_connection(req->conn);
-                req->conn = NULL;
-                req->rs = NULL;
-            }
+    if (chan->conn || connect_radius_acct(chan, log) == NGX_OK) {
+        if (send(chan->conn->fd, slot->buf, slot->len, 0) == -1) {
+            LOG_ERR_LIMITED(&rs->log_limit, log, ngx_errno,
+                            "\"%V\" accounting send failed", &rs->name);
         }
     }
 
-    // No need to free the array, since the pool
-    // should free it automatically
+    ngx_add_timer(&slot->timer, chan->q->timeout);
 }
 
-static ngx_connection_t *
-create_radius_connection(struct sockaddr *sockaddr,
-                         socklen_t socklen,
-                         ngx_log_t *log)
+static ngx_int_t
+connect_radius_acct(radius_acct_chan_t *chan, ngx_log_t *log)
 {
-    // Create UDP socket
-    int sockfd = ngx_socket(sockaddr->sa_family, SOCK_DGRAM, 0);
+    radius_server_t *rs = chan->rs;
+    radius_peers_t *peers = rs->peers;
+    radius_peer_t *peer = &peers->elts[chan->peer_idx % peers->nelts];
+
+    // The address of the Access-Requests, the accounting port
+    ngx_sockaddr_t sa;
+    ngx_memcpy(&sa, peer->sockaddr, peer->socklen);
+    ngx_inet_set_port(&sa.sockaddr, rs->acct_port);
+
+    int sockfd = ngx_socket(sa.sockaddr.sa_family, SOCK_DGRAM, 0);
     if (sockfd == -1) {
         LOG_ERR(log, ngx_errno, "ngx_socket failed");
-        return NULL;
+        return NGX_ERROR;
     }
 
-    // Set socket to non-blocking mode
     if (ngx_nonblocking(sockfd) == -1) {
         LOG_ERR(log, ngx_errno,
                 "ngx_nonblocking failed, sockfd: %d", sockfd);
         ngx_close_socket(sockfd);
-        return NULL;
+        return NGX_ERROR;
     }
 
-    // Connect socket to make it possible to use
-    // recv(2)/send(2) instead of recvfrom(2)/sendto(2)
-    if (connect(sockfd, sockaddr, socklen) == -1) {
-        LOG_ERR(log, ngx_errno, "connect failed");
+    // From the same addresses as the Access-Requests, a socket per
+    // worker doesn't need a port range
+    if (bind_radius_socket(rs, sockfd, sa.sockaddr.sa_family, ngx_worker,
+                           0, log) != NGX_OK)
+    {
         ngx_close_socket(sockfd);
-        return NULL;
+        return NGX_ERROR;
+    }
+
+    if (connect(sockfd, &sa.sockaddr, peer->socklen) == -1) {
+        LOG_ERR(log, ngx_errno, "\"%V\" accounting connect failed, addr: %V",
+                &rs->name, &peer->name);
+        ngx_close_socket(sockfd);
+        return NGX_ERROR;
     }
 
-    // Get connection around socket
     ngx_connection_t *c = ngx_get_connection(sockfd, log);
     if (c == NULL) {
         LOG_ERR(log, ngx_errno,
                 "ngx_get_connection failed, sockfd: %d", sockfd);
         ngx_close_socket(sockfd);
-        return NULL;
+        return NGX_ERROR;
     }
 
     c->log = log;
-    c->data = NULL;
-    c->read->handler = radius_read_handler;
-    c->read->log = c->log;
+    c->data = chan;
+    c->read->handler = radius_acct_read_handler;
+    c->read->log = log;
 
-    // Subscribe to read data event
     if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_LEVEL_EVENT) != NGX_OK) {
         LOG_ERR(log, ngx_errno,
                 "ngx_add_event failed, sockfd: %d", sockfd);
         ngx_close_connection(c);
-        return NULL;
+        return NGX_ERROR;
     }
 
-    sa_family_t family = sockaddr->sa_family;
-    char host[INET6_ADDRSTRLEN] = "";
-    uint16_t port = 0;
-    if (family == AF_INET) {
-        struct sockaddr_in sa;
-        ngx_memzero(&sa, sizeof(sa));
-        if (getsockname(sockfd, (struct sockaddr *)&sa, &socklen) != -1) {
-            inet_ntop(family, &sa.sin_addr, host, sizeof(host)),
-            port = ntohs(sa.sin_port);
-        } else {
-            LOG_ERR(log, ngx_errno, "getsockname sockaddr_in failed");
-        }
-    } else if (family == AF_INET6) {
-        struct sockaddr_in6 sa;
-        ngx_memzero(&sa, sizeof(sa));
-        if (getsockname(sockfd, (struct sockaddr *)&sa, &socklen) != -1) {
-            inet_ntop(family, &sa.sin6_addr, host, sizeof(host)),
-            port = ntohs(sa.sin6_port);
-        } else {
-            LOG_ERR(log, ngx_errno, "getsockname sockaddr_in6 failed");
-        }
-    } else {
-        LOG_ERR(log, 0, "unknown family: %d", family);
-    }
-    LOG_DEBUG(log, "sockfd: %d, addr: %s:%d", sockfd, host, port);
+    LOG_DEBUG(log, "\"%V\" accounting sockfd: %d, addr: %V",
+              &rs->name, sockfd, &peer->name);
 
-    return c;
+    chan->conn = c;
+    return NGX_OK;
 }
 
 static void
-close_radius_connection(ngx_connection_t *c)
+release_radius_acct_slot(radius_acct_slot_t *slot)
 {
-    ngx_close_connection(c);
+    radius_acct_chan_t *chan = slot->chan;
+
+    if (slot->timer.timer_set) {
+        ngx_del_timer(&slot->timer);
+    }
+
+    slot->active = 0;
+    chan->nactive--;
+
+    if (!chan->q->ev.posted) {
+        ngx_post_event(&chan->q->ev, &ngx_posted_events);
+    }
 }
 
-static ngx_int_t
-select_radius_server(ngx_http_request_t *r,
-                     const ngx_array_t *server_ptrs,
-                     ngx_http_auth_radius_ctx_t *ctx)
+static void
+radius_acct_read_handler(ngx_event_t *ev)
 {
-    ngx_log_t *log = r->connection->log;
+    ngx_connection_t *c = ev->data;
+    radius_acct_chan_t *chan = c->data;
+    radius_server_t *rs = chan->rs;
+    uint8_t buf[RADIUS_PKG_MAX];
 
-    assert(server_ptrs != NULL);
+    for (;;) {
+        ssize_t len = recv(c->fd, buf, sizeof(buf), 0);
+        if (len == -1) {
+            if (ngx_errno != NGX_EAGAIN) {
+                LOG_ERR_LIMITED(&rs->log_limit, ev->log, ngx_errno,
+                                "\"%V\" accounting recv failed", &rs->name);
+            }
+            return;
+        }
 
-    radius_server_t **rss = server_ptrs->elts; // [radius_server_t *]
-    radius_server_t *rs = rss[ctx->rs_idx];
+        if (len < RADIUS_PKG_MIN) {
+            continue;
+        }
 
-    radius_req_t *req = acquire_radius_req(rs);
-    if (req == NULL) {
-        LOG_NOTICE(log, 0, "requests queue is full, rescheduling...");
+        uint8_t id = buf[1];
+        radius_acct_slot_t *slot = id < chan->nslots ? &chan->slots[id] : NULL;
+        if (slot == NULL || !slot->active) {
+            LOG_ERR_LIMITED(&rs->log_limit, ev->log, 0,
+                            "\"%V\" unexpected Accounting-Response, "
+                            "req_id: %d", &rs->name, id);
+            continue;
+        }
 
-        // Subscribe to reschedule timeout event
-        ngx_event_t *ev = ngx_pcalloc(r->pool, sizeof(ngx_event_t));
-        if (ev == NULL) {
-            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed r: 0x%xl", r);
-            return NGX_ERROR;
+        int rc = parse_radius_acct_pkg(buf, len, id, slot->auth, &rs->secret);
+        if (rc < 0) {
+            LOG_ERR_LIMITED(&rs->log_limit, ev->log, 0,
+                            "\"%V\" parse Accounting-Response error: %d",
+                            &rs->name, rc);
+            continue;
         }
-        ev->data = r;
-        ev->handler = radius_reschedule_handler;
-        ev->log = r->connection->log;
-        ngx_add_timer(ev, 100);
 
-        return NGX_AGAIN;
+        chan->q->acked++;
+        release_radius_acct_slot(slot);
     }
+}
 
-    if (ctx->type == AUTH) {
-        ctx->timeout = rs->auth_timeout;
-        ctx->retries = rs->auth_retries;
-    } else {
-        ctx->timeout = rs->health_timeout;
-        ctx->retries = rs->health_retries;
+static void
+radius_acct_timeout_handler(ngx_event_t *ev)
+{
+    radius_acct_slot_t *slot = ev->data;
+    radius_acct_chan_t *chan = slot->chan;
+    radius_acct_queue_t *q = chan->q;
+
+    if (++slot->tries <= q->retries) {
+        q->retried++;
+        send_radius_acct(slot, ev->log);
+        return;
     }
-    ctx->req = req;
-    ctx->done = 0;
-    ctx->accepted = 0;
-    ctx->timedout = 0;
-    ctx->connection_refused = 0;
-    ctx->internal_error = 0;
 
-    req->http_req = r;
+    LOG_ERR_LIMITED(&chan->rs->log_limit, ev->log, 0,
+                    "\"%V\" no Accounting-Response, record dropped",
+                    &chan->rs->name);
+    q->failed++;
 
-    LOG_DEBUG(log, "r: 0x%xl, rs: 0x%xl, req: 0x%xl, req_id: %d",
-              r, rs, req, req->id);
-    int rc = send_radius_request(r, ctx, req);
-    if (rc == NGX_ERROR) {
-        LOG_INFO(log, "internal error r: 0x%xl", r);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    // The records in flight are resent to the next address
+    if (chan->conn) {
+        ngx_close_connection(chan->conn);
+        chan->conn = NULL;
     }
+    chan->peer_idx++;
 
-    return NGX_AGAIN;
+    release_radius_acct_slot(slot);
 }
 
 static ngx_int_t
-send_radius_request(ngx_http_request_t *r,
-                    ngx_http_auth_radius_ctx_t *ctx,
-                    radius_req_t *req)
+init_radius_acct(ngx_http_auth_radius_main_conf_t *mcf, ngx_cycle_t *cycle)
 {
-    ngx_log_t *log = r->connection->log;
+    radius_acct_queue_t *q = mcf->acct;
+    ngx_log_t *log = cycle->log;
 
-    int rc = send_radius_pkg(req, &ctx->user, &ctx->passwd, ctx->timeout, log);
-    if (rc == -1) {
-        LOG_ERR(log, 0, "req failed r: 0x%xl, req: 0x%xl, req_id: %d",
-                r, req, req->id);
+    if (q == NULL) {
+        return NGX_OK;
+    }
+
+    q->ring = ngx_palloc(cycle->pool, q->size * sizeof(radius_acct_rec_t));
+    if (q->ring == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_palloc failed");
         return NGX_ERROR;
     }
 
-    LOG_DEBUG(log,
-              "r: 0x%xl, req: 0x%xl, req_id: %d",
-              r, req, req->id);
+    q->ev.handler = radius_acct_handler;
+    q->ev.data = q;
+    q->ev.log = log;
 
-    return NGX_AGAIN;
-}
+    size_t i, j;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        if (!rss[i].accounting) {
+            continue;
+        }
 
-static ngx_int_t
-set_realm(ngx_http_request_t *r, const ngx_str_t *realm)
-{
-    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
-    if (r->headers_out.www_authenticate == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        radius_acct_chan_t *chan = ngx_pcalloc(cycle->pool, sizeof(*chan));
+        if (chan == NULL) {
+            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed");
+            return NGX_ERROR;
+        }
+        chan->slots = ngx_pcalloc(cycle->pool,
+                                  q->window * sizeof(radius_acct_slot_t));
+        if (chan->slots == NULL) {
+            LOG_ERR(log, ngx_errno, "ngx_pcalloc failed");
+            return NGX_ERROR;
+        }
+
+        chan->rs = &rss[i];
+        chan->q = q;
+        chan->nslots = q->window;
+        for (j = 0; j < chan->nslots; j++) {
+            radius_acct_slot_t *slot = &chan->slots[j];
+            slot->chan = chan;
+            slot->id = j;
+            // Graceful shutdown waits for the records in flight
+            slot->timer.handler = radius_acct_timeout_handler;
+            slot->timer.data = slot;
+            slot->timer.log = log;
+        }
+
+        rss[i].acct = chan;
     }
 
-    r->headers_out.www_authenticate->hash = 1;
-    r->headers_out.www_authenticate->key.len = sizeof("WWW-Authenticate") - 1;
-    r->headers_out.www_authenticate->key.data = (uint8_t *) "WWW-Authenticate";
-    r->headers_out.www_authenticate->value = *realm;
+    if (q->overflow == RADIUS_ACCT_SPILL) {
+        open_radius_acct_spill(q, cycle);
+    }
 
-    return NGX_HTTP_UNAUTHORIZED;
+    return NGX_OK;
 }
 
-static radius_req_t *
-acquire_radius_req(radius_server_t* rs)
+// The spill file of a worker is "<spill>.<pid>". The file of a worker
+// gone, with the records it couldn't send before exiting, is taken
+// over by the next one starting.
+static void
+open_radius_acct_spill(radius_acct_queue_t *q, ngx_cycle_t *cycle)
 {
-    radius_req_t *req = rs->req_free_list;
-    if (req) {
-        rs->req_free_list = req->next;
-        req->active = 1;
-        if (rs->req_free_list == NULL) {
-            rs->req_last_list = NULL;
+    ngx_log_t *log = cycle->log;
+    ngx_str_t *path = &q->spill_path;
+
+    u_char *name = ngx_pnalloc(cycle->pool, path->len + NGX_INT64_LEN + 3);
+    u_char *pattern = ngx_pnalloc(cycle->pool, path->len + 3);
+    if (name == NULL || pattern == NULL) {
+        LOG_ERR(log, ngx_errno, "ngx_pnalloc failed");
+        return;
+    }
+    q->spill.name.data = name;
+    q->spill.name.len = ngx_sprintf(name, "%V.%P%Z", path, ngx_pid) - name - 1;
+    q->spill.log = log;
+    ngx_sprintf(pattern, "%V.*%Z", path);
+
+    ngx_glob_t gl;
+    ngx_memzero(&gl, sizeof(ngx_glob_t));
+    gl.pattern = pattern;
+    gl.log = log;
+    gl.test = 1;
+
+    if (ngx_open_glob(&gl) == NGX_OK) {
+        ngx_str_t file;
+        while (ngx_read_glob(&gl, &file) == NGX_OK) {
+            ngx_pid_t pid = ngx_atoi(file.data + path->len + 1,
+                                     file.len - path->len - 1);
+            if (pid == NGX_ERROR || pid == ngx_pid
+                || kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH)
+            {
+                continue;
+            }
+
+            // Another worker starting may have taken it first
+            if (ngx_rename_file(file.data, name) == NGX_FILE_ERROR) {
+                continue;
+            }
+
+            LOG_NOTICE(log, 0, "accounting spill file \"%V\" taken over",
+                       &file);
+            break;
         }
+        ngx_close_glob(&gl);
     }
-    return req;
-}
 
-static void
-release_radius_req(radius_req_t *req)
-{
-    radius_server_t *rs = req->rs;
-    req->active = 0;
-    req->next = NULL;
-    req->http_req = NULL;
+    q->spill.fd = ngx_open_file(name, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN,
+                                NGX_FILE_OWNER_ACCESS);
+    if (q->spill.fd == NGX_INVALID_FILE) {
+        LOG_ERR(log, ngx_errno, ngx_open_file_n " \"%V\" failed, "
+                "overflowing records are dropped", &q->spill.name);
+        return;
+    }
 
-    if (rs->req_last_list) {
-        rs->req_last_list->next = req;
-        rs->req_last_list = req;
+    ngx_file_info_t fi;
+    radius_acct_spill_hdr_t hdr;
+    if (ngx_fd_info(q->spill.fd, &fi) == NGX_FILE_ERROR
+        || ngx_file_size(&fi) < (off_t) sizeof(hdr)
+        || ngx_read_file(&q->spill, (u_char *) &hdr, sizeof(hdr), 0)
+           != (ssize_t) sizeof(hdr)
+        || hdr.magic != RADIUS_ACCT_MAGIC
+        || hdr.read < sizeof(hdr)
+        || (off_t) hdr.read > ngx_file_size(&fi))
+    {
+        reset_radius_acct_spill(q, log);
         return;
     }
 
-    assert(rs->req_free_list == rs->req_last_list &&
-           rs->req_free_list == NULL);
-    rs->req_free_list = rs->req_last_list = req;
+    q->spill_read = hdr.read;
+    q->spill_write = ngx_file_size(&fi);
+    if (!q->ev.posted) {
+        ngx_post_event(&q->ev, &ngx_posted_events);
+    }
 }
 
-static int
-send_radius_pkg(radius_req_t *req,
-                const ngx_str_t *user,
-                const ngx_str_t *passwd,
-                ngx_msec_t timeout,
-                ngx_log_t *log)
+// The records not sent yet are spilled, if enabled, for the next
+// worker. They may be sent out of order then.
+static void
+destroy_radius_acct(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
 {
-    size_t len = create_radius_pkg(req->buf, sizeof(req->buf),
-                                   req->id,
-                                   user, passwd,
-                                   &req->rs->secret,
-                                   &req->rs->nas_id,
-                                   req->auth);
+    radius_acct_queue_t *q = mcf->acct;
 
-    int rc = send(req->conn->fd, req->buf, len, 0);
-    if (rc == -1) {
-        LOG_ERR(log, ngx_errno,
-                "send failed, fd: %d, r: 0x%xl, len: %u",
-                req->conn->fd, req->http_req, len);
-        return -1;
+    if (q == NULL || q->ring == NULL) {
+        return;
     }
 
-    // Subscribe to read timeout event
-    ngx_add_timer(req->conn->read, timeout);
+    if (q->ev.posted) {
+        ngx_delete_posted_event(&q->ev);
+    }
 
-    return 0;
-}
+    ngx_uint_t left = 0;
+    size_t i, j;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = 0; i < mcf->servers->nelts; i++) {
+        radius_acct_chan_t *chan = rss[i].acct;
+        if (chan == NULL) {
+            continue;
+        }
 
-static int
-recv_radius_pkg(radius_req_t *req,
-                radius_server_t *rs,
-                ngx_log_t *log)
-{
-    // Read as much as possible
-    int prev_rc = -1;
-    for (;;) {
-        ssize_t len = recv(req->conn->fd,
-                           req->buf, sizeof(req->buf),
-                           MSG_TRUNC);
-        if (len == -1) {
-            if (ngx_errno != EAGAIN) {
-                LOG_ERR(log, ngx_errno, "recv failed, r: 0x%xl, req: 0x%xl",
-                        req->http_req, req);
+        for (j = 0; j < chan->nslots; j++) {
+            radius_acct_slot_t *slot = &chan->slots[j];
+            if (!slot->active) {
+                continue;
             }
-            // Nothing can be received any more, exit
-            return prev_rc;
+            if (slot->timer.timer_set) {
+                ngx_del_timer(&slot->timer);
+            }
+            spill_radius_acct(q, &slot->rec, 1, log);
+            left++;
         }
 
-        if (len > (ssize_t) sizeof(req->buf)) {
-            LOG_ERR(log, 0, "recv buf too small, r: 0x%xl, req: 0x%xl",
-                    req->http_req, req);
-            continue;
+        if (chan->conn) {
+            ngx_close_connection(chan->conn);
+            chan->conn = NULL;
         }
+    }
 
-        int rc = parse_radius_pkg(req->buf, len,
-                                  req->id,
-                                  req->auth,
-                                  &req->rs->secret);
-        if (rc < 0) {
-            switch (rc) {
-            case -1:
-                LOG_ERR(log, 0,
-                        "parse pkg error: incorrect pkg len: %d, r: 0x%xl, req: 0x%xl",
-                        len, req->http_req, req);
-                break;
-            case -2:
-                LOG_ERR(log, 0,
-                        "parse pkg error: req_id doesn't match, r: 0x%xl, req: 0x%xl",
-                        req->http_req, req);
-                break;
-            case -3:
-                LOG_ERR(log, 0,
-                        "parse pkg error: incorrect auth, r: 0x%xl, req: 0x%xl",
-                        req->http_req, req);
-                break;
-            default:
-                LOG_ERR(log, 0,
-                        "parse pkg error: unknown rc: %d, r: 0x%xl, req: 0x%xl",
-                        rc, req->http_req, req);
-                break;
-            }
+    while (q->count) {
+        ngx_uint_t n = ngx_min(q->count, q->size - q->head);
+        spill_radius_acct(q, &q->ring[q->head], n, log);
+        q->head = (q->head + n) % q->size;
+        q->count -= n;
+        left += n;
+    }
 
-            continue;
+    if (q->spill.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(q->spill.fd) == NGX_FILE_ERROR) {
+            LOG_ERR(log, ngx_errno, ngx_close_file_n " \"%V\" failed",
+                    &q->spill.name);
         }
+        q->spill.fd = NGX_INVALID_FILE;
+    } else if (left) {
+        LOG_NOTICE(log, 0, "%ui accounting records not sent", left);
+    }
+}
 
-        req->accepted = rc == RADIUS_AUTH_ACCEPTED;
-        return rc;
+static ngx_int_t
+init_radius_dynauth(ngx_http_auth_radius_main_conf_t *mcf, ngx_log_t *log)
+{
+    radius_dynauth_t *da = mcf->dynauth;
+    if (da == NULL) {
+        return NGX_OK;
+    }
+
+    int sockfd = ngx_socket(da->addr.sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        LOG_ERR(log, ngx_errno, "ngx_socket failed");
+        return NGX_ERROR;
+    }
+
+    // The workers share the address, the kernel spreads the requests
+    int reuseport = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                   &reuseport, sizeof(reuseport)) == -1)
+    {
+        LOG_ERR(log, ngx_errno, "setsockopt(SO_REUSEPORT) failed");
+        ngx_close_socket(sockfd);
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(sockfd) == -1) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_nonblocking failed, sockfd: %d", sockfd);
+        ngx_close_socket(sockfd);
+        return NGX_ERROR;
+    }
+
+    if (bind(sockfd, da->addr.sockaddr, da->addr.socklen) == -1) {
+        LOG_EMERG(log, ngx_errno, "dynauth bind to %V failed",
+                  &da->addr.name);
+        ngx_close_socket(sockfd);
+        return NGX_ERROR;
+    }
+
+    ngx_connection_t *c = ngx_get_connection(sockfd, log);
+    if (c == NULL) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_get_connection failed, sockfd: %d", sockfd);
+        ngx_close_socket(sockfd);
+        return NGX_ERROR;
+    }
+
+    c->log = log;
+    c->data = mcf;
+    c->read->handler = radius_dynauth_read_handler;
+    c->read->log = log;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_LEVEL_EVENT) != NGX_OK) {
+        LOG_ERR(log, ngx_errno,
+                "ngx_add_event failed, sockfd: %d", sockfd);
+        ngx_close_connection(c);
+        return NGX_ERROR;
     }
+
+    LOG_DEBUG(log, "dynauth sockfd: %d, addr: %V", sockfd, &da->addr.name);
+
+    da->conn = c;
+    return NGX_OK;
 }
 
 static void
-radius_reschedule_handler(ngx_event_t *ev)
+destroy_radius_dynauth(ngx_http_auth_radius_main_conf_t *mcf)
 {
-    ngx_http_request_t *r = ev->data;
-    ngx_post_event(r->connection->write, &ngx_posted_events);
+    radius_dynauth_t *da = mcf->dynauth;
+    if (da && da->conn) {
+        ngx_close_connection(da->conn);
+        da->conn = NULL;
+    }
 }
 
+// The requests are answered right away: the users are evicted from
+// every cache zone, which is done whether they were cached or not, so
+// only the requests without a User-Name are NAKed. A CoA-Request
+// evicts too, the next request of the user is authenticated again.
+// Retransmissions are answered the same, nothing is left to undo.
 static void
-radius_read_handler(ngx_event_t *ev)
+radius_dynauth_read_handler(ngx_event_t *ev)
 {
-    ngx_log_t *log = ev->log;
-
     ngx_connection_t *c = ev->data;
-    radius_req_t *req = c->data;
-    ngx_http_request_t *r = req->http_req;
+    ngx_http_auth_radius_main_conf_t *mcf = c->data;
+    radius_dynauth_t *da = mcf->dynauth;
+    uint8_t buf[RADIUS_PKG_MAX];
+    uint8_t reply[RADIUS_PKG_MAX];
 
-    if (r == NULL) {
-        LOG_ERR(log, 0, "r == NULL, unexpected data received, flush it");
-        uint8_t buf[RADIUS_PKG_MAX];
-        for (;;) {
-            ssize_t len = recv(req->conn->fd,
-                               buf, sizeof(buf),
-                               MSG_TRUNC);
-            if (len == -1) {
-                if (ngx_errno != EAGAIN) {
-                    LOG_ERR(log, ngx_errno,
-                            "recv failed, r: 0x%xl, req: 0x%xl",
-                            req->http_req, req);
-                }
+    for (;;) {
+        ngx_sockaddr_t sa;
+        socklen_t socklen = sizeof(sa);
+        ssize_t len = recvfrom(c->fd, buf, sizeof(buf), 0,
+                               &sa.sockaddr, &socklen);
+        if (len == -1) {
+            if (ngx_errno != NGX_EAGAIN) {
+                LOG_ERR_LIMITED(&da->log_limit, ev->log, ngx_errno,
+                                "dynauth recvfrom failed");
+            }
+            return;
+        }
+        da->received++;
+
+        // Servers may share an address, the client is the one whose
+        // secret authenticates the request. Silently discarded if none
+        // does, see RFC 5176 section 3.
+        radius_server_t *rs, *known = NULL;
+        ngx_str_t user;
+        int code = -1;
+        ngx_uint_t next = 0;
+        while ((rs = find_radius_dynauth_client(mcf, &sa.sockaddr, socklen,
+                                                &next)))
+        {
+            known = rs;
+            code = parse_radius_dynauth_pkg(buf, len, &rs->secret, &user);
+            if (code >= 0) {
                 break;
             }
         }
-        return;
-    }
-
-    ngx_http_auth_radius_ctx_t *ctx;
-    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_radius_module);
-    if (ctx == NULL) {
-        LOG_EMERG(log, 0, "ctx not found r: 0x%xl", r);
-        release_radius_req(req);
-        return;
-    }
-
-    assert(ctx->req == req);
 
-    if (ev->timedout) {
-        ev->timedout = 0;
+        if (known == NULL) {
+            u_char text[NGX_SOCKADDR_STRLEN];
+            ngx_str_t addr;
+            addr.data = text;
+            addr.len = ngx_sock_ntop(&sa.sockaddr, socklen, text,
+                                     sizeof(text), 1);
+            da->invalid++;
+            LOG_ERR_LIMITED(&da->log_limit, ev->log, 0,
+                            "dynauth request from unknown client %V", &addr);
+            continue;
+        }
 
-        ctx->retries--;
-        LOG_DEBUG(log, "timedout r: 0x%xl, retries: %d", r, ctx->retries);
+        if (rs == NULL) {
+            da->invalid++;
+            LOG_ERR_LIMITED(&known->log_limit, ev->log, 0,
+                            "\"%V\" parse dynauth request error: %d",
+                            &known->name, code);
+            continue;
+        }
 
-        if (!ctx->retries) {
-            ctx->done = 1;
-            ctx->timedout = 1;
-            goto auth_done;
+        uint32_t error_cause = 0;
+        ngx_uint_t i, evicted = 0;
+        if (user.len == 0) {
+            error_cause = RADIUS_ERROR_MISSING_ATTRIBUTE;
+        } else if (mcf->caches) {
+            ngx_shm_zone_t **zones = mcf->caches->elts;
+            for (i = 0; i < mcf->caches->nelts; i++) {
+                evicted += evict_radius_cache_user(zones[i], &user);
+            }
         }
 
-        // Re-send RADIUS Auth event
-        ngx_int_t rc = send_radius_request(r, ctx, req);
-        if (rc == NGX_ERROR) {
-            ctx->done = 1;
-            ctx->internal_error = 1;
-            goto auth_done;
+        LOG_NOTICE(ev->log, 0, "\"%V\" %s for \"%V\", evicted: %ui",
+                   &rs->name,
+                   code == RADIUS_DISCONNECT_REQUEST
+                   ? "Disconnect-Request" : "CoA-Request",
+                   &user, evicted);
+
+        size_t n = create_radius_dynauth_reply(reply, sizeof(reply), buf,
+                                               error_cause, &rs->secret);
+        if (sendto(c->fd, reply, n, 0, &sa.sockaddr, socklen) == -1) {
+            LOG_ERR_LIMITED(&rs->log_limit, ev->log, ngx_errno,
+                            "\"%V\" dynauth sendto failed", &rs->name);
         }
-        return;
-    }
 
-    radius_server_t *rs = req->rs;
-    int rc = recv_radius_pkg(req, rs, log);
-    if (rc == -1) {
-        if (ngx_errno == ECONNREFUSED) {
-            LOG_ERR(log, 0, "recv radius pkg: connection refused r: 0x%xl", r);
-            ctx->done = 1;
-            ctx->connection_refused = 1;
-            goto auth_done;
+        if (error_cause) {
+            da->naked++;
         } else {
-            LOG_ERR(log, 0, "recv radius pkg: bad pkg r: 0x%xl", r);
-            // Handle error in read timeout
-            return;
-        }
-    } else {
-        // Remove read timeout event
-        if (req->conn->read->timer_set) {
-            req->conn->read->timer_set = 0;
-            ngx_del_timer(req->conn->read);
+            da->acked++;
         }
+        da->evicted += evicted;
     }
+}
 
-    LOG_DEBUG(log,
-              "accepted: %d, r: 0x%xl, req: 0x%xl, req_id: %d",
-              req->accepted, r, req, req->id);
+// The next server a request may come from, by address, the port is
+// any. The search starts at *next, which is set past the one found.
+static radius_server_t *
+find_radius_dynauth_client(ngx_http_auth_radius_main_conf_t *mcf,
+                           struct sockaddr *sockaddr,
+                           socklen_t socklen,
+                           ngx_uint_t *next)
+{
+    if (mcf->servers == NULL) {
+        return NULL;
+    }
 
-    ctx->done = 1;
-    ctx->accepted = req->accepted;
+    ngx_uint_t i, j;
+    radius_server_t *rss = mcf->servers->elts;
+    for (i = *next; i < mcf->servers->nelts; i++) {
+        radius_peers_t *peers = rss[i].peers;
+        for (j = 0; j < peers->nelts; j++) {
+            if (ngx_cmp_sockaddr(peers->elts[j].sockaddr,
+                                 peers->elts[j].socklen,
+                                 sockaddr, socklen, 0) == NGX_OK)
+            {
+                *next = i + 1;
+                return &rss[i];
+            }
+        }
+    }
 
-auth_done:
-    // Post RADIUS Auth done event
-    ngx_post_event(r->connection->write, &ngx_posted_events);
-    release_radius_req(req);
+    *next = mcf->servers->nelts;
+    return NULL;
 }
+
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <ngx_md5.h>
 #include "radius_lib.h"
+#include "radius_md5.h"
+#include "radius_rand.h"
 
 typedef struct {
     uint8_t         d[AUTH_BUF_SIZE];
@@ -26,61 +28,131 @@ typedef struct {
 typedef struct {
     radius_pkg_t   *pkg;
     uint8_t        *pos;
+    uint8_t        *passwd;         // User-Password value, see hide_passwds
+    uint8_t         passwd_blocks;
 } radius_pkg_builder_t;
 
-// Data Type Definitions
-// https://www.rfc-editor.org/rfc/rfc8044#section-3
-typedef enum {
-    radius_attr_type_integer,
-    radius_attr_type_string,
-} radius_attr_type_t;
-
 typedef enum {
     radius_err_ok,
     radius_err_range,
     radius_err_mem,
 } radius_error_t;
 
-typedef struct {
-    radius_attr_type_t type;
-    uint8_t            len_min;
-    uint8_t            len_max;
-} radius_attr_desc_t;
-
 // Packet Types
 // https://www.rfc-editor.org/rfc/rfc2865#section-4
 #define RADIUS_CODE_ACCESS_REQUEST      1
 #define RADIUS_CODE_ACCESS_ACCEPT       2
 #define RADIUS_CODE_ACCESS_REJECT       3
-
-// Attributes
+// https://www.rfc-editor.org/rfc/rfc2866#section-3
+#define RADIUS_CODE_ACCT_REQUEST        4
+#define RADIUS_CODE_ACCT_RESPONSE       5
+// https://www.rfc-editor.org/rfc/rfc5176#section-2
+#define RADIUS_CODE_DISCONNECT_REQUEST  RADIUS_DISCONNECT_REQUEST
+#define RADIUS_CODE_COA_REQUEST         RADIUS_COA_REQUEST
+// ACK and NAK follow the request code
+#define RADIUS_CODE_ACK_OFFSET          1
+#define RADIUS_CODE_NAK_OFFSET          2
+
+// Attributes, the ones set by the codec itself are in radius_lib.h
 // https://www.rfc-editor.org/rfc/rfc2865#section-5
-#define RADIUS_ATTR_USER_NAME           1
-#define RADIUS_ATTR_USER_PASSWORD       2
-#define RADIUS_ATTR_SERVICE_TYPE        6
-#define RADIUS_ATTR_NAS_IDENTIFIER      32
+#define RADIUS_ATTR_NAS_IP_ADDRESS      4
+#define RADIUS_ATTR_NAS_PORT            5
+#define RADIUS_ATTR_FILTER_ID           11
+#define RADIUS_ATTR_CLASS               25
+#define RADIUS_ATTR_CALLED_STATION_ID   30
+#define RADIUS_ATTR_CALLING_STATION_ID  31
+// https://www.rfc-editor.org/rfc/rfc2866#section-5
+#define RADIUS_ATTR_ACCT_STATUS_TYPE    40
+#define RADIUS_ATTR_ACCT_DELAY_TIME     41
+#define RADIUS_ATTR_ACCT_INPUT_OCTETS   42
+#define RADIUS_ATTR_ACCT_OUTPUT_OCTETS  43
+#define RADIUS_ATTR_ACCT_SESSION_ID     44
+#define RADIUS_ATTR_ACCT_SESSION_TIME   46
+// https://www.rfc-editor.org/rfc/rfc2869#section-5.1
+#define RADIUS_ATTR_ACCT_INPUT_GIGAWORDS  52
+#define RADIUS_ATTR_ACCT_OUTPUT_GIGAWORDS 53
+#define RADIUS_ATTR_NAS_PORT_TYPE       61
+#define RADIUS_ATTR_ERROR_CAUSE         101
+#define RADIUS_ATTR_NAS_PORT_ID         87
+// https://www.rfc-editor.org/rfc/rfc3162#section-2.1
+#define RADIUS_ATTR_NAS_IPV6_ADDRESS    95
 
 #define RADIUS_AUTHENTICATE_ONLY        8
 
-#define RADIUS_ATTR_DESC_ITEM(t, lmin, lmax) \
-    .type = t,                               \
-    .len_min = lmin,                         \
-    .len_max = lmax
+static ssize_t
+encode_integer(u_char *out, const ngx_str_t *value, size_t len_max);
+
+static ssize_t
+encode_string(u_char *out, const ngx_str_t *value, size_t len_max);
+
+static ssize_t
+encode_ipv4addr(u_char *out, const ngx_str_t *value, size_t len_max);
 
-static radius_attr_desc_t attrs_desc[] = {
+static ssize_t
+encode_ipv6addr(u_char *out, const ngx_str_t *value, size_t len_max);
+
+#define RADIUS_ATTR_DESC_ITEM(n, t, lmin, lmax) \
+    .name = n,                                  \
+    .type = radius_attr_type_##t,               \
+    .len_min = lmin,                            \
+    .len_max = lmax,                            \
+    .encode = encode_##t
+
+// The dictionary, the attributes of radius_attribute are looked up by
+// name in it, see radius_attr_lookup
+static radius_attr_desc_t attrs_desc[256] = {
     [RADIUS_ATTR_USER_NAME] {
-        RADIUS_ATTR_DESC_ITEM(radius_attr_type_string, 1, 63)
+        RADIUS_ATTR_DESC_ITEM("User-Name", string, 1, 63)
     },
     [RADIUS_ATTR_USER_PASSWORD] {
-        RADIUS_ATTR_DESC_ITEM(radius_attr_type_string, 16, 128)
+        RADIUS_ATTR_DESC_ITEM("User-Password", string, 16, 128)
+    },
+    [RADIUS_ATTR_NAS_IP_ADDRESS] {
+        RADIUS_ATTR_DESC_ITEM("NAS-IP-Address", ipv4addr, 4, 4)
+    },
+    [RADIUS_ATTR_NAS_PORT] {
+        RADIUS_ATTR_DESC_ITEM("NAS-Port", integer, 4, 4)
     },
     [RADIUS_ATTR_SERVICE_TYPE] {
-        RADIUS_ATTR_DESC_ITEM(radius_attr_type_integer,
-                              sizeof(uint32_t), sizeof(uint32_t))
+        RADIUS_ATTR_DESC_ITEM("Service-Type", integer, 4, 4)
+    },
+    [RADIUS_ATTR_FILTER_ID] {
+        RADIUS_ATTR_DESC_ITEM("Filter-Id", string, 1, 253)
+    },
+    [RADIUS_ATTR_CLASS] {
+        RADIUS_ATTR_DESC_ITEM("Class", string, 1, 253)
+    },
+    [RADIUS_ATTR_CALLED_STATION_ID] {
+        RADIUS_ATTR_DESC_ITEM("Called-Station-Id", string, 1, 253)
+    },
+    [RADIUS_ATTR_CALLING_STATION_ID] {
+        RADIUS_ATTR_DESC_ITEM("Calling-Station-Id", string, 1, 253)
     },
     [RADIUS_ATTR_NAS_IDENTIFIER] {
-        RADIUS_ATTR_DESC_ITEM(radius_attr_type_string, 3, 64)
+        RADIUS_ATTR_DESC_ITEM("NAS-Identifier", string, 3, 64)
+    },
+    [RADIUS_ATTR_ACCT_SESSION_ID] {
+        RADIUS_ATTR_DESC_ITEM("Acct-Session-Id", string, 1, 253)
+    },
+    [RADIUS_ATTR_NAS_PORT_TYPE] {
+        RADIUS_ATTR_DESC_ITEM("NAS-Port-Type", integer, 4, 4)
+    },
+    [RADIUS_ATTR_NAS_PORT_ID] {
+        RADIUS_ATTR_DESC_ITEM("NAS-Port-Id", string, 1, 253)
     },
+    [RADIUS_ATTR_NAS_IPV6_ADDRESS] {
+        RADIUS_ATTR_DESC_ITEM("NAS-IPv6-Address", ipv6addr, 16, 16)
+    },
+};
+
+// Attributes by number only, and the vendor ones, which are within the
+// Vendor-Id and the vendor type and length octets
+static radius_attr_desc_t attr_desc_any = {
+    RADIUS_ATTR_DESC_ITEM(NULL, string, 1, 253)
+};
+
+static radius_attr_desc_t attr_desc_vsa = {
+    RADIUS_ATTR_DESC_ITEM(NULL, string, 1, 247)
 };
 
 static void
@@ -101,14 +173,31 @@ check_string_attr_len_range(radius_pkg_builder_t *b,
 static radius_error_t
 make_access_request_pkg(radius_pkg_builder_t *b,
                         uint8_t req_id,
-                        const ngx_str_t *secret,
                         const ngx_str_t *user,
                         const ngx_str_t *passwd,
-                        const ngx_str_t *nas_id);
+                        const ngx_str_t *nas_id,
+                        const ngx_str_t *attrs);
 
 static radius_error_t
 update_pkg_len(radius_pkg_builder_t *b);
 
+static void
+hide_passwds(radius_pkg_builder_t *b, radius_pkg_job_t *jobs, ngx_uint_t n);
+
+static radius_error_t
+make_acct_request_pkg(radius_pkg_builder_t *b,
+                      uint8_t req_id,
+                      const radius_acct_t *acct,
+                      const ngx_str_t *nas_id);
+
+static int
+prepare_radius_reply(radius_reply_job_t *job, uint8_t *act_auth);
+
+static radius_error_t
+put_integer_attr(radius_pkg_builder_t *b,
+                 int radius_attr_id,
+                 uint32_t value);
+
 size_t
 create_radius_pkg(void *buf, size_t len,
                   uint8_t req_id,
@@ -117,19 +206,212 @@ create_radius_pkg(void *buf, size_t len,
                   const ngx_str_t *secret,
                   const ngx_str_t *nas_id,
                   uint8_t /*out*/ *req_auth)
+{
+    radius_pkg_job_t job = {
+        .buf = buf,
+        .len = len,
+        .req_id = req_id,
+        .user = user,
+        .passwd = passwd,
+        .secret = secret,
+        .nas_id = nas_id,
+        .req_auth = req_auth,
+    };
+
+    create_radius_pkgs(&job, 1);
+
+    return job.len;
+}
+
+void
+create_radius_pkgs(radius_pkg_job_t *jobs, ngx_uint_t n)
+{
+    radius_pkg_builder_t b[RADIUS_MD5_LANES];
+    ngx_uint_t base, i, m;
+
+    for (base = 0; base < n; base += m) {
+        m = ngx_min(n - base, RADIUS_MD5_LANES);
+
+        for (i = 0; i < m; i++) {
+            radius_pkg_job_t *job = &jobs[base + i];
+
+            init_radius_pkg(&b[i], job->buf, job->len);
+            gen_auth(&b[i].pkg->hdr.auth);
+            if (job->req_auth) {
+                ngx_memcpy(job->req_auth, &b[i].pkg->hdr.auth,
+                           sizeof(b[i].pkg->hdr.auth));
+            }
+            if (make_access_request_pkg(&b[i], job->req_id, job->user,
+                                        job->passwd, job->nas_id, job->attrs)
+                != radius_err_ok)
+            {
+                // Nothing to hide, the packet isn't sent
+                b[i].passwd_blocks = 0;
+                job->len = 0;
+                continue;
+            }
+
+            update_pkg_len(&b[i]);
+
+            job->len = b[i].pos - (uint8_t *)b[i].pkg;
+        }
+
+        hide_passwds(b, &jobs[base], m);
+    }
+}
+
+// The Request Authenticator is the MD5 of the packet with a zero one
+// and the secret
+// https://www.rfc-editor.org/rfc/rfc2866#section-3
+size_t
+create_radius_acct_pkg(void *buf, size_t len,
+                       uint8_t req_id,
+                       const radius_acct_t *acct,
+                       const ngx_str_t *secret,
+                       const ngx_str_t *nas_id,
+                       uint8_t /*out*/ *req_auth)
 {
     radius_pkg_builder_t b;
 
     init_radius_pkg(&b, buf, len);
-    gen_auth(&b.pkg->hdr.auth);
+    ngx_memzero(&b.pkg->hdr.auth, sizeof(b.pkg->hdr.auth));
+    if (make_acct_request_pkg(&b, req_id, acct, nas_id) != radius_err_ok) {
+        return 0;
+    }
+
+    update_pkg_len(&b);
+
+    size_t pkg_len = b.pos - (uint8_t *)b.pkg;
+    radius_md5_job_t md5 = {
+        .data = { (u_char *) b.pkg, secret->data },
+        .len = { pkg_len, secret->len },
+        .digest = b.pkg->hdr.auth.d,
+    };
+    radius_md5_batch(&md5, 1);
+
     if (req_auth) {
         ngx_memcpy(req_auth, &b.pkg->hdr.auth, sizeof(b.pkg->hdr.auth));
     }
-    make_access_request_pkg(&b, req_id, secret, user, passwd, nas_id);
+
+    return pkg_len;
+}
+
+int
+parse_radius_acct_pkg(const void *buf, size_t len,
+                      uint8_t req_id,
+                      const uint8_t *req_auth,
+                      const ngx_str_t *secret)
+{
+    radius_reply_job_t job = {
+        .buf = (void *) buf,
+        .len = len,
+        .req_id = req_id,
+        .req_auth = req_auth,
+        .secret = secret,
+    };
+
+    parse_radius_pkgs(&job, 1);
+    if (job.rc < 0) {
+        return job.rc;
+    }
+
+    // Authentic, but not a reply to an Accounting-Request
+    radius_pkg_t *pkg = job.buf;
+    if (pkg->hdr.code != RADIUS_CODE_ACCT_RESPONSE) {
+        return -4;
+    }
+
+    return 0;
+}
+
+// The Request Authenticator is computed as the one of an
+// Accounting-Request
+// https://www.rfc-editor.org/rfc/rfc5176#section-2.3
+int
+parse_radius_dynauth_pkg(void *buf, size_t len,
+                         const ngx_str_t *secret,
+                         ngx_str_t /*out*/ *user)
+{
+    radius_pkg_t *pkg = buf;
+    if (len < RADIUS_PKG_MIN || len != ntohs(pkg->hdr.len)) {
+        return -1;
+    }
+
+    if (pkg->hdr.code != RADIUS_CODE_DISCONNECT_REQUEST
+        && pkg->hdr.code != RADIUS_CODE_COA_REQUEST)
+    {
+        return -4;
+    }
+
+    // Attributes must fill the packet exactly
+    ngx_str_null(user);
+    uint8_t *p = pkg->attrs;
+    uint8_t *last = (uint8_t *) buf + len;
+    while (p < last) {
+        if (last - p < 2 || p[1] < 2 || p[1] > last - p) {
+            return -1;
+        }
+        if (p[0] == RADIUS_ATTR_USER_NAME) {
+            user->data = p + 2;
+            user->len = p[1] - 2;
+        }
+        p += p[1];
+    }
+
+    uint8_t act_auth[AUTH_BUF_SIZE];
+    uint8_t exp_auth[AUTH_BUF_SIZE];
+    ngx_memcpy(act_auth, &pkg->hdr.auth, sizeof(act_auth));
+    ngx_memzero(&pkg->hdr.auth, sizeof(pkg->hdr.auth));
+
+    radius_md5_job_t md5 = {
+        .data = { buf, secret->data },
+        .len = { len, secret->len },
+        .digest = exp_auth,
+    };
+    radius_md5_batch(&md5, 1);
+
+    // The reply is computed over it
+    ngx_memcpy(&pkg->hdr.auth, act_auth, sizeof(act_auth));
+
+    if (ngx_memcmp(act_auth, exp_auth, AUTH_BUF_SIZE) != 0) {
+        return -3;
+    }
+
+    return pkg->hdr.code;
+}
+
+// https://www.rfc-editor.org/rfc/rfc5176#section-3.5
+size_t
+create_radius_dynauth_reply(void *buf, size_t len,
+                            const void *req,
+                            uint32_t error_cause,
+                            const ngx_str_t *secret)
+{
+    const radius_pkg_t *req_pkg = req;
+    radius_pkg_builder_t b;
+
+    init_radius_pkg(&b, buf, len);
+    b.pkg->hdr.code = req_pkg->hdr.code + (error_cause
+                                           ? RADIUS_CODE_NAK_OFFSET
+                                           : RADIUS_CODE_ACK_OFFSET);
+    b.pkg->hdr.id = req_pkg->hdr.id;
+    ngx_memcpy(&b.pkg->hdr.auth, &req_pkg->hdr.auth, sizeof(b.pkg->hdr.auth));
+
+    if (error_cause) {
+        put_integer_attr(&b, RADIUS_ATTR_ERROR_CAUSE, error_cause);
+    }
 
     update_pkg_len(&b);
 
-    return b.pos - (uint8_t *)b.pkg;
+    size_t pkg_len = b.pos - (uint8_t *)b.pkg;
+    radius_md5_job_t md5 = {
+        .data = { (u_char *) b.pkg, secret->data },
+        .len = { pkg_len, secret->len },
+        .digest = b.pkg->hdr.auth.d,
+    };
+    radius_md5_batch(&md5, 1);
+
+    return pkg_len;
 }
 
 int
@@ -138,42 +420,168 @@ parse_radius_pkg(const void *buf, size_t len,
                  const uint8_t *req_auth,
                  const ngx_str_t *secret)
 {
-    radius_pkg_t *pkg = (radius_pkg_t *) buf;
+    radius_reply_job_t job = {
+        .buf = (void *) buf,
+        .len = len,
+        .req_id = req_id,
+        .req_auth = req_auth,
+        .secret = secret,
+    };
+
+    parse_radius_pkgs(&job, 1);
+
+    return job.rc;
+}
+
+void
+parse_radius_pkgs(radius_reply_job_t *jobs, ngx_uint_t n)
+{
+    radius_md5_job_t md5[RADIUS_MD5_LANES];
+    uint8_t act_auth[RADIUS_MD5_LANES][AUTH_BUF_SIZE];
+    uint8_t exp_auth[RADIUS_MD5_LANES][AUTH_BUF_SIZE];
+    radius_reply_job_t *todo[RADIUS_MD5_LANES];
+    ngx_uint_t i, m;
+
+    while (n) {
+        // Replies failing the cheap checks take no lane
+        for (m = 0; n && m < RADIUS_MD5_LANES; jobs++, n--) {
+            jobs->rc = prepare_radius_reply(jobs, act_auth[m]);
+            if (jobs->rc != 0) {
+                continue;
+            }
+
+            md5[m].data[0] = jobs->buf;
+            md5[m].len[0] = jobs->len;
+            md5[m].data[1] = jobs->secret->data;
+            md5[m].len[1] = jobs->secret->len;
+            md5[m].digest = exp_auth[m];
+            todo[m++] = jobs;
+        }
+
+        radius_md5_batch(md5, m);
+
+        for (i = 0; i < m; i++) {
+            radius_pkg_t *pkg = todo[i]->buf;
+
+            // Check actual and expected authenticators match
+            if (ngx_memcmp(act_auth[i], exp_auth[i], AUTH_BUF_SIZE) != 0) {
+                todo[i]->rc = -3;
+            } else if (pkg->hdr.code == RADIUS_CODE_ACCESS_ACCEPT) {
+                todo[i]->rc = RADIUS_AUTH_ACCEPTED;
+            } else {
+                todo[i]->rc = RADIUS_AUTH_REJECTED;
+            }
+        }
+    }
+}
+
+static int
+prepare_radius_reply(radius_reply_job_t *job, uint8_t *act_auth)
+{
+    radius_pkg_t *pkg = job->buf;
     uint16_t pkg_len = ntohs(pkg->hdr.len);
-    if (len != pkg_len) {
+    if (job->len != pkg_len) {
         return -1;
     }
 
     // Check correlation id matches
-    if (req_id != pkg->hdr.id) {
+    if (job->req_id != pkg->hdr.id) {
         return -2;
     }
 
     // Save actual response authenticator
-    uint8_t act_auth[sizeof(pkg->hdr.auth)];
-    ngx_memcpy(act_auth, &pkg->hdr.auth, sizeof(act_auth));
+    ngx_memcpy(act_auth, &pkg->hdr.auth, sizeof(pkg->hdr.auth));
+
+    // The expected one is calculated over the request authenticator
+    ngx_memcpy(&pkg->hdr.auth, job->req_auth, sizeof(pkg->hdr.auth));
+
+    return 0;
+}
 
-    // Calculate expected authenticator
-    ngx_memcpy(&pkg->hdr.auth, req_auth, sizeof(pkg->hdr.auth));
+const radius_attr_desc_t *
+radius_attr_lookup(const ngx_str_t *name, uint8_t *id)
+{
+    ngx_int_t n = ngx_atoi(name->data, name->len);
+    if (n != NGX_ERROR) {
+        if (n < 1 || n > 255) {
+            return NULL;
+        }
+        *id = n;
+        return attrs_desc[n].name ? &attrs_desc[n] : &attr_desc_any;
+    }
 
-    ngx_md5_t ctx;
-    ngx_md5_init(&ctx);
-    ngx_md5_update(&ctx, pkg, len);
-    ngx_md5_update(&ctx, secret->data, secret->len);
+    ngx_uint_t i;
+    for (i = 0; i < sizeof(attrs_desc) / sizeof(attrs_desc[0]); i++) {
+        const char *s = attrs_desc[i].name;
+        if (s && ngx_strlen(s) == name->len
+            && ngx_strncasecmp((u_char *) s, name->data, name->len) == 0)
+        {
+            *id = i;
+            return &attrs_desc[i];
+        }
+    }
 
-    uint8_t exp_auth[sizeof(pkg->hdr.auth)];
-    ngx_md5_final(exp_auth, &ctx);
+    return NULL;
+}
 
-    // Check actual and expected authenticators match
-    if (ngx_memcmp(act_auth, exp_auth, sizeof(act_auth)) != 0) {
-        return -3;
+const radius_attr_desc_t *
+radius_vsa_desc(void)
+{
+    return &attr_desc_vsa;
+}
+
+// Attribute Data Types
+// https://www.rfc-editor.org/rfc/rfc8044#section-3
+static ssize_t
+encode_integer(u_char *out, const ngx_str_t *value, size_t len_max)
+{
+    ngx_int_t n = ngx_atoi(value->data, value->len);
+    if (n == NGX_ERROR || (uint64_t) n > NGX_MAX_UINT32_VALUE) {
+        return -1;
     }
 
-    if (pkg->hdr.code == RADIUS_CODE_ACCESS_ACCEPT) {
-        return RADIUS_AUTH_ACCEPTED;
-    } else {
-        return RADIUS_AUTH_REJECTED;
+    uint32_t v = htonl((uint32_t) n);
+    ngx_memcpy(out, &v, sizeof(v));
+    return sizeof(v);
+}
+
+static ssize_t
+encode_string(u_char *out, const ngx_str_t *value, size_t len_max)
+{
+    if (value->len > len_max) {
+        return -1;
+    }
+
+    ngx_memcpy(out, value->data, value->len);
+    return value->len;
+}
+
+static ssize_t
+encode_ipv4addr(u_char *out, const ngx_str_t *value, size_t len_max)
+{
+    in_addr_t addr = ngx_inet_addr(value->data, value->len);
+    if (addr == INADDR_NONE) {
+        return -1;
     }
+
+    ngx_memcpy(out, &addr, sizeof(addr));
+    return sizeof(addr);
+}
+
+static ssize_t
+encode_ipv6addr(u_char *out, const ngx_str_t *value, size_t len_max)
+{
+#if (NGX_HAVE_INET6)
+    u_char addr[16];
+    if (ngx_inet6_addr(value->data, value->len, addr) != NGX_OK) {
+        return -1;
+    }
+
+    ngx_memcpy(out, addr, sizeof(addr));
+    return sizeof(addr);
+#else
+    return -1;
+#endif
 }
 
 static void
@@ -182,15 +590,16 @@ init_radius_pkg(radius_pkg_builder_t *b, void *buf, int len)
     b->pkg = buf;
     assert(len == RADIUS_PKG_MAX);
     b->pos = b->pkg->attrs;
+    b->passwd = NULL;
+    b->passwd_blocks = 0;
 }
 
+// Unpredictable, it's the IV of the User-Password hiding
+// https://www.rfc-editor.org/rfc/rfc2865#section-3
 static void
 gen_auth(radius_auth_t *auth)
 {
-    uint8_t i;
-    for (i = 0; i < sizeof(radius_auth_t); i++) {
-        auth->d[i] = (uint8_t)(random() & UCHAR_MAX);
-    }
+    radius_rand_bytes(auth->d, sizeof(auth->d));
 }
 
 static radius_error_t
@@ -219,11 +628,16 @@ check_string_attr_len_range(radius_pkg_builder_t *b,
     return check_attr_len_needed(b, len);
 }
 
+// The value is put in clear and hidden by hide_passwds once all
+// the packets of a batch are built
 static radius_error_t
-put_passwd_crypt(radius_pkg_builder_t *b,
-                 const ngx_str_t *secret,
-                 const ngx_str_t *passwd)
+put_passwd_attr(radius_pkg_builder_t *b,
+                const ngx_str_t *passwd)
 {
+    if (passwd->len > RADIUS_PASSWD_MAX) {
+        return radius_err_range;
+    }
+
     uint8_t pwd_padded_len = 16 * (1 + passwd->len / 16);
     radius_error_t rc = check_string_attr_len_range(b,
                                                     RADIUS_ATTR_USER_PASSWORD,
@@ -232,49 +646,62 @@ put_passwd_crypt(radius_pkg_builder_t *b,
         return rc;
     }
 
-    ngx_md5_t ctx;
-    ngx_md5_t s_ctx;
-
-    ngx_md5_init(&s_ctx);
-    ngx_md5_update(&s_ctx, secret->data, secret->len);
-
-    ctx = s_ctx;
-    ngx_md5_update(&ctx, &b->pkg->hdr.auth, sizeof(b->pkg->hdr.auth));
-
     radius_attr_hdr_t *ah = (radius_attr_hdr_t *) b->pos;
 
     ah->type = RADIUS_ATTR_USER_PASSWORD;
+    ah->len = sizeof(radius_attr_hdr_t) + pwd_padded_len;
     b->pos += sizeof(radius_attr_hdr_t);
 
-    ngx_md5_final(b->pos, &ctx);
+    ngx_memcpy(b->pos, passwd->data, passwd->len);
+    ngx_memzero(b->pos + passwd->len, pwd_padded_len - passwd->len);
 
-    uint8_t pwd_remain = passwd->len;
-    uint8_t pwd_padded_remain = pwd_padded_len;
-    uint8_t *p = passwd->data;
-    uint8_t *c = b->pos;
+    b->passwd = b->pos;
+    b->passwd_blocks = pwd_padded_len / 16;
+    b->pos += pwd_padded_len;
 
-    ah->len = sizeof(radius_attr_hdr_t) + pwd_padded_remain;
+    return radius_err_ok;
+}
 
-    uint8_t i;
-    while (pwd_padded_remain) {
-        for(i = 0; i < 16; i++) {
-            *c++ ^= pwd_remain ? *p++ : 0;
-            if (pwd_remain) {
-                pwd_remain--;
+// c(1) = p(1) xor MD5(S + RA), c(i) = p(i) xor MD5(S + c(i-1))
+// https://www.rfc-editor.org/rfc/rfc2865#section-5.2
+// The chains of the packets are independent, so step i of all
+// of them is one batch.
+static void
+hide_passwds(radius_pkg_builder_t *b, radius_pkg_job_t *jobs, ngx_uint_t n)
+{
+    radius_md5_job_t md5[RADIUS_MD5_LANES];
+    uint8_t digest[RADIUS_MD5_LANES][AUTH_BUF_SIZE];
+    uint8_t *block[RADIUS_MD5_LANES];
+    ngx_uint_t i, j, k, m;
+
+    for (k = 0; ; k++) {
+        m = 0;
+        for (i = 0; i < n; i++) {
+            if (k >= b[i].passwd_blocks) {
+                continue;
             }
+
+            block[m] = b[i].passwd + 16 * k;
+            md5[m].data[0] = jobs[i].secret->data;
+            md5[m].len[0] = jobs[i].secret->len;
+            md5[m].data[1] = k ? block[m] - 16 : b[i].pkg->hdr.auth.d;
+            md5[m].len[1] = 16;
+            md5[m].digest = digest[m];
+            m++;
         }
-        ctx = s_ctx;
-        pwd_padded_remain -= 16;
-        if (!pwd_padded_remain) {
-            b->pos += 16;
+
+        if (m == 0) {
             break;
         }
-        ngx_md5_update(&ctx, b->pos, c - b->pos);
-        b->pos += 16;
-        ngx_md5_final(b->pos, &ctx);
-    }
 
-    return radius_err_ok;
+        radius_md5_batch(md5, m);
+
+        for (j = 0; j < m; j++) {
+            for (i = 0; i < 16; i++) {
+                block[j][i] ^= digest[j][i];
+            }
+        }
+    }
 }
 
 static int
@@ -314,7 +741,7 @@ put_integer_attr(radius_pkg_builder_t* b,
     ah->len = sizeof(radius_attr_hdr_t) + sizeof(value);
     b->pos += sizeof(radius_attr_hdr_t);
     uint32_t *v = (uint32_t *)b->pos;
-    *v = htobe32(value);
+    *v = htonl(value);
     b->pos += sizeof(value);
 
     return radius_err_ok;
@@ -323,10 +750,10 @@ put_integer_attr(radius_pkg_builder_t* b,
 static radius_error_t
 make_access_request_pkg(radius_pkg_builder_t *b,
                         uint8_t req_id,
-                        const ngx_str_t *secret,
                         const ngx_str_t *user,
                         const ngx_str_t *passwd,
-                        const ngx_str_t *nas_id)
+                        const ngx_str_t *nas_id,
+                        const ngx_str_t *attrs)
 {
     assert(b && user && passwd);
     b->pkg->hdr.code = RADIUS_CODE_ACCESS_REQUEST;
@@ -345,7 +772,7 @@ make_access_request_pkg(radius_pkg_builder_t *b,
     // User-Password
     // https://www.rfc-editor.org/rfc/rfc2865#section-5.2
     if (passwd->len > 0) {
-        rc = put_passwd_crypt(b, secret, passwd);
+        rc = put_passwd_attr(b, passwd);
         if (rc != radius_err_ok) {
             return rc;
         }
@@ -368,6 +795,109 @@ make_access_request_pkg(radius_pkg_builder_t *b,
         }
     }
 
+    // Encoded by the caller, see radius_attr_lookup
+    if (attrs && attrs->len > 0) {
+        rc = check_attr_len_needed(b, attrs->len);
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+        b->pos = ngx_cpymem(b->pos, attrs->data, attrs->len);
+    }
+
+    return radius_err_ok;
+}
+
+static radius_error_t
+make_acct_request_pkg(radius_pkg_builder_t *b,
+                      uint8_t req_id,
+                      const radius_acct_t *acct,
+                      const ngx_str_t *nas_id)
+{
+    b->pkg->hdr.code = RADIUS_CODE_ACCT_REQUEST;
+    b->pkg->hdr.id = req_id;
+
+    radius_error_t rc;
+    // User-Name
+    if (acct->user->len > 0) {
+        rc = put_string_attr(b, RADIUS_ATTR_USER_NAME, acct->user);
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+    }
+
+    // NAS-Identifier
+    if (nas_id->len >= 3) {
+        rc = put_string_attr(b, RADIUS_ATTR_NAS_IDENTIFIER, nas_id);
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+    }
+
+    // Acct-Status-Type
+    // https://www.rfc-editor.org/rfc/rfc2866#section-5.1
+    rc = put_integer_attr(b, RADIUS_ATTR_ACCT_STATUS_TYPE, acct->status_type);
+    if (rc != radius_err_ok) {
+        return rc;
+    }
+
+    // Acct-Session-Id
+    // https://www.rfc-editor.org/rfc/rfc2866#section-5.5
+    rc = put_string_attr(b, RADIUS_ATTR_ACCT_SESSION_ID, acct->session_id);
+    if (rc != radius_err_ok) {
+        return rc;
+    }
+
+    // Acct-Delay-Time
+    // https://www.rfc-editor.org/rfc/rfc2866#section-5.2
+    if (acct->delay_time) {
+        rc = put_integer_attr(b, RADIUS_ATTR_ACCT_DELAY_TIME,
+                              acct->delay_time);
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+    }
+
+    if (acct->status_type == RADIUS_ACCT_START) {
+        return radius_err_ok;
+    }
+
+    // Acct-Session-Time, Acct-Input-Octets and Acct-Output-Octets,
+    // the Gigawords count how many times the octets have wrapped
+    // https://www.rfc-editor.org/rfc/rfc2866#section-5.7
+    rc = put_integer_attr(b, RADIUS_ATTR_ACCT_SESSION_TIME,
+                          acct->session_time);
+    if (rc != radius_err_ok) {
+        return rc;
+    }
+
+    rc = put_integer_attr(b, RADIUS_ATTR_ACCT_INPUT_OCTETS,
+                          (uint32_t) acct->input_octets);
+    if (rc != radius_err_ok) {
+        return rc;
+    }
+
+    rc = put_integer_attr(b, RADIUS_ATTR_ACCT_OUTPUT_OCTETS,
+                          (uint32_t) acct->output_octets);
+    if (rc != radius_err_ok) {
+        return rc;
+    }
+
+    if (acct->input_octets >> 32) {
+        rc = put_integer_attr(b, RADIUS_ATTR_ACCT_INPUT_GIGAWORDS,
+                              (uint32_t) (acct->input_octets >> 32));
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+    }
+
+    if (acct->output_octets >> 32) {
+        rc = put_integer_attr(b, RADIUS_ATTR_ACCT_OUTPUT_GIGAWORDS,
+                              (uint32_t) (acct->output_octets >> 32));
+        if (rc != radius_err_ok) {
+            return rc;
+        }
+    }
+
     return radius_err_ok;
 }
 
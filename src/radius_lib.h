@@ -3,10 +3,16 @@
 
 // https://www.rfc-editor.org/rfc/rfc2865#section-3
 // The minimum length is 20 and maximum length is 4096.
+#define RADIUS_PKG_MIN 20
 #define RADIUS_PKG_MAX 4096
 
 #define AUTH_BUF_SIZE 16 // MD5_DIGEST_LENGTH
 
+// Longest credentials the codec encodes, User-Name is at most 63
+// octets and User-Password 128 once padded
+#define RADIUS_USER_MAX   63
+#define RADIUS_PASSWD_MAX 127
+
 size_t
 create_radius_pkg(void *buf, size_t len,
                   uint8_t req_id,
@@ -16,6 +22,124 @@ create_radius_pkg(void *buf, size_t len,
                   const ngx_str_t *nas_id,
                   uint8_t /*out*/ *req_auth);
 
+// Arguments of create_radius_pkg, for create_radius_pkgs
+typedef struct {
+    void *buf;
+    size_t len; // in: buffer size, out: packet length, 0 if too long
+    uint8_t req_id;
+    const ngx_str_t *user;
+    const ngx_str_t *passwd;
+    const ngx_str_t *secret;
+    const ngx_str_t *nas_id;
+    // Encoded attributes appended as is, can be NULL
+    const ngx_str_t *attrs;
+    uint8_t *req_auth; // out, can be NULL
+} radius_pkg_job_t;
+
+// Creates the packets at once, the MD5 digests of all of them are
+// computed together, see radius_md5_batch
+void
+create_radius_pkgs(radius_pkg_job_t *jobs, ngx_uint_t n);
+
+// Accounting-Request, see create_radius_acct_pkg
+// https://www.rfc-editor.org/rfc/rfc2866#section-5.1
+#define RADIUS_ACCT_START   1
+#define RADIUS_ACCT_STOP    2
+#define RADIUS_ACCT_INTERIM 3
+
+typedef struct {
+    uint32_t status_type;
+    const ngx_str_t *user;
+    const ngx_str_t *session_id;
+    uint32_t session_time;
+    uint32_t delay_time;
+    uint64_t input_octets;
+    uint64_t output_octets;
+} radius_acct_t;
+
+// The packet length, 0 if it can't be encoded, e.g. it doesn't fit
+size_t
+create_radius_acct_pkg(void *buf, size_t len,
+                       uint8_t req_id,
+                       const radius_acct_t *acct,
+                       const ngx_str_t *secret,
+                       const ngx_str_t *nas_id,
+                       uint8_t /*out*/ *req_auth);
+
+// 0 for a valid Accounting-Response, negative as parse_radius_pkg
+int
+parse_radius_acct_pkg(const void *buf, size_t len,
+                      uint8_t req_id,
+                      const uint8_t *req_auth,
+                      const ngx_str_t *secret);
+
+// Disconnect-Request and CoA-Request, see parse_radius_dynauth_pkg
+// https://www.rfc-editor.org/rfc/rfc5176#section-2
+#define RADIUS_DISCONNECT_REQUEST 40
+#define RADIUS_COA_REQUEST        43
+
+// Error-Cause of the NAKs
+// https://www.rfc-editor.org/rfc/rfc5176#section-3.5
+#define RADIUS_ERROR_MISSING_ATTRIBUTE 402
+#define RADIUS_ERROR_INVALID_REQUEST   404
+
+// Verifies a request sent by a server with its secret, returns its code
+// or negative as parse_radius_pkg, -4 if it's neither of the above.
+// user is the User-Name, empty if there is none.
+int
+parse_radius_dynauth_pkg(void *buf, size_t len,
+                         const ngx_str_t *secret,
+                         ngx_str_t /*out*/ *user);
+
+// ACK of the request, NAK if error_cause is not 0
+size_t
+create_radius_dynauth_reply(void *buf, size_t len,
+                            const void *req,
+                            uint32_t error_cause,
+                            const ngx_str_t *secret);
+
+// Data Type Definitions
+// https://www.rfc-editor.org/rfc/rfc8044#section-3
+typedef enum {
+    radius_attr_type_integer,
+    radius_attr_type_string,
+    radius_attr_type_ipv4addr,
+    radius_attr_type_ipv6addr,
+} radius_attr_type_t;
+
+// Writes the value of an attribute of the type, at most len_max octets,
+// returns the length or -1 if the value is invalid
+typedef ssize_t (*radius_attr_encode_pt)(u_char *out,
+                                         const ngx_str_t *value,
+                                         size_t len_max);
+
+typedef struct {
+    const char *name;
+    radius_attr_type_t type;
+    uint8_t len_min;
+    uint8_t len_max;
+    radius_attr_encode_pt encode;
+} radius_attr_desc_t;
+
+// Attribute of the dictionary by name or number, NULL if unknown. The
+// attributes without a name are strings.
+const radius_attr_desc_t *
+radius_attr_lookup(const ngx_str_t *name, uint8_t *id);
+
+// Set by the codec itself, from the request and the server
+// https://www.rfc-editor.org/rfc/rfc2865#section-5
+#define RADIUS_ATTR_USER_NAME           1
+#define RADIUS_ATTR_USER_PASSWORD       2
+#define RADIUS_ATTR_SERVICE_TYPE        6
+#define RADIUS_ATTR_NAS_IDENTIFIER      32
+
+// Vendor-Specific, a string value of the vendor type
+// https://www.rfc-editor.org/rfc/rfc2865#section-5.26
+#define RADIUS_ATTR_VENDOR_SPECIFIC 26
+
+const radius_attr_desc_t *
+radius_vsa_desc(void);
+
 #define RADIUS_AUTH_ACCEPTED 0
 #define RADIUS_AUTH_REJECTED 1
 
@@ -25,4 +149,18 @@ parse_radius_pkg(const void *buf, size_t len,
                  const uint8_t *req_auth,
                  const ngx_str_t *secret);
 
+// Arguments and result of parse_radius_pkg, for parse_radius_pkgs
+typedef struct {
+    void *buf;
+    size_t len;
+    uint8_t req_id;
+    const uint8_t *req_auth;
+    const ngx_str_t *secret;
+    int rc; // out
+} radius_reply_job_t;
+
+// Verifies the replies at once, see create_radius_pkgs
+void
+parse_radius_pkgs(radius_reply_job_t *jobs, ngx_uint_t n);
+
 #endif // __RADIUS_LIB_H__
@@ -0,0 +1,346 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_md5.h>
+#include "radius_md5.h"
+
+// Multi-buffer MD5: independent messages are hashed in the lanes of
+// SIMD registers, one 64-byte block of every message per compression.
+// Lanes with fewer blocks are fed zeros and their results dropped.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RADIUS_MD5_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*radius_md5_compress_pt)(uint32_t state[4][RADIUS_MD5_LANES],
+                                       uint32_t w[RADIUS_MD5_LANES][16]);
+
+static void
+radius_md5_scalar(radius_md5_job_t *jobs, ngx_uint_t n);
+
+static void
+radius_md5_lanes(radius_md5_job_t *jobs, ngx_uint_t n);
+
+static ngx_uint_t radius_md5_width;
+static radius_md5_compress_pt radius_md5_compress;
+
+#if (RADIUS_MD5_X86)
+
+// https://www.rfc-editor.org/rfc/rfc1321#section-3.4
+#define VF(x, y, z) VOR(VAND(x, y), VANDNOT(x, z))
+#define VG(x, y, z) VOR(VAND(z, x), VANDNOT(z, y))
+#define VH(x, y, z) VXOR(VXOR(x, y), z)
+#define VI(x, y, z) VXOR(y, VOR(x, VXOR(z, VSET1(-1))))
+
+#define RADIUS_MD5_STEP(f, a, b, c, d, x, s, t)                        \
+    a = VADD(a, VADD(VADD(f(b, c, d), x), VSET1(t)));                  \
+    a = VADD(VOR(VSLL(a, s), VSRL(a, 32 - (s))), b);
+
+// The rounds over the vector type of the including function,
+// see radius_md5_compress_sse2 and radius_md5_compress_avx2
+#define RADIUS_MD5_ROUNDS                                              \
+    V a = VLOAD(state[0]), b = VLOAD(state[1]);                        \
+    V c = VLOAD(state[2]), d = VLOAD(state[3]);                        \
+    V a0 = a, b0 = b, c0 = c, d0 = d;                                  \
+    RADIUS_MD5_STEP(VF, a, b, c, d, m[ 0],  7, 0xd76aa478);            \
+    RADIUS_MD5_STEP(VF, d, a, b, c, m[ 1], 12, 0xe8c7b756);            \
+    RADIUS_MD5_STEP(VF, c, d, a, b, m[ 2], 17, 0x242070db);            \
+    RADIUS_MD5_STEP(VF, b, c, d, a, m[ 3], 22, 0xc1bdceee);            \
+    RADIUS_MD5_STEP(VF, a, b, c, d, m[ 4],  7, 0xf57c0faf);            \
+    RADIUS_MD5_STEP(VF, d, a, b, c, m[ 5], 12, 0x4787c62a);            \
+    RADIUS_MD5_STEP(VF, c, d, a, b, m[ 6], 17, 0xa8304613);            \
+    RADIUS_MD5_STEP(VF, b, c, d, a, m[ 7], 22, 0xfd469501);            \
+    RADIUS_MD5_STEP(VF, a, b, c, d, m[ 8],  7, 0x698098d8);            \
+    RADIUS_MD5_STEP(VF, d, a, b, c, m[ 9], 12, 0x8b44f7af);            \
+    RADIUS_MD5_STEP(VF, c, d, a, b, m[10], 17, 0xffff5bb1);            \
+    RADIUS_MD5_STEP(VF, b, c, d, a, m[11], 22, 0x895cd7be);            \
+    RADIUS_MD5_STEP(VF, a, b, c, d, m[12],  7, 0x6b901122);            \
+    RADIUS_MD5_STEP(VF, d, a, b, c, m[13], 12, 0xfd987193);            \
+    RADIUS_MD5_STEP(VF, c, d, a, b, m[14], 17, 0xa679438e);            \
+    RADIUS_MD5_STEP(VF, b, c, d, a, m[15], 22, 0x49b40821);            \
+    RADIUS_MD5_STEP(VG, a, b, c, d, m[ 1],  5, 0xf61e2562);            \
+    RADIUS_MD5_STEP(VG, d, a, b, c, m[ 6],  9, 0xc040b340);            \
+    RADIUS_MD5_STEP(VG, c, d, a, b, m[11], 14, 0x265e5a51);            \
+    RADIUS_MD5_STEP(VG, b, c, d, a, m[ 0], 20, 0xe9b6c7aa);            \
+    RADIUS_MD5_STEP(VG, a, b, c, d, m[ 5],  5, 0xd62f105d);            \
+    RADIUS_MD5_STEP(VG, d, a, b, c, m[10],  9, 0x02441453);            \
+    RADIUS_MD5_STEP(VG, c, d, a, b, m[15], 14, 0xd8a1e681);            \
+    RADIUS_MD5_STEP(VG, b, c, d, a, m[ 4], 20, 0xe7d3fbc8);            \
+    RADIUS_MD5_STEP(VG, a, b, c, d, m[ 9],  5, 0x21e1cde6);            \
+    RADIUS_MD5_STEP(VG, d, a, b, c, m[14],  9, 0xc33707d6);            \
+    RADIUS_MD5_STEP(VG, c, d, a, b, m[ 3], 14, 0xf4d50d87);            \
+    RADIUS_MD5_STEP(VG, b, c, d, a, m[ 8], 20, 0x455a14ed);            \
+    RADIUS_MD5_STEP(VG, a, b, c, d, m[13],  5, 0xa9e3e905);            \
+    RADIUS_MD5_STEP(VG, d, a, b, c, m[ 2],  9, 0xfcefa3f8);            \
+    RADIUS_MD5_STEP(VG, c, d, a, b, m[ 7], 14, 0x676f02d9);            \
+    RADIUS_MD5_STEP(VG, b, c, d, a, m[12], 20, 0x8d2a4c8a);            \
+    RADIUS_MD5_STEP(VH, a, b, c, d, m[ 5],  4, 0xfffa3942);            \
+    RADIUS_MD5_STEP(VH, d, a, b, c, m[ 8], 11, 0x8771f681);            \
+    RADIUS_MD5_STEP(VH, c, d, a, b, m[11], 16, 0x6d9d6122);            \
+    RADIUS_MD5_STEP(VH, b, c, d, a, m[14], 23, 0xfde5380c);            \
+    RADIUS_MD5_STEP(VH, a, b, c, d, m[ 1],  4, 0xa4beea44);            \
+    RADIUS_MD5_STEP(VH, d, a, b, c, m[ 4], 11, 0x4bdecfa9);            \
+    RADIUS_MD5_STEP(VH, c, d, a, b, m[ 7], 16, 0xf6bb4b60);            \
+    RADIUS_MD5_STEP(VH, b, c, d, a, m[10], 23, 0xbebfbc70);            \
+    RADIUS_MD5_STEP(VH, a, b, c, d, m[13],  4, 0x289b7ec6);            \
+    RADIUS_MD5_STEP(VH, d, a, b, c, m[ 0], 11, 0xeaa127fa);            \
+    RADIUS_MD5_STEP(VH, c, d, a, b, m[ 3], 16, 0xd4ef3085);            \
+    RADIUS_MD5_STEP(VH, b, c, d, a, m[ 6], 23, 0x04881d05);            \
+    RADIUS_MD5_STEP(VH, a, b, c, d, m[ 9],  4, 0xd9d4d039);            \
+    RADIUS_MD5_STEP(VH, d, a, b, c, m[12], 11, 0xe6db99e5);            \
+    RADIUS_MD5_STEP(VH, c, d, a, b, m[15], 16, 0x1fa27cf8);            \
+    RADIUS_MD5_STEP(VH, b, c, d, a, m[ 2], 23, 0xc4ac5665);            \
+    RADIUS_MD5_STEP(VI, a, b, c, d, m[ 0],  6, 0xf4292244);            \
+    RADIUS_MD5_STEP(VI, d, a, b, c, m[ 7], 10, 0x432aff97);            \
+    RADIUS_MD5_STEP(VI, c, d, a, b, m[14], 15, 0xab9423a7);            \
+    RADIUS_MD5_STEP(VI, b, c, d, a, m[ 5], 21, 0xfc93a039);            \
+    RADIUS_MD5_STEP(VI, a, b, c, d, m[12],  6, 0x655b59c3);            \
+    RADIUS_MD5_STEP(VI, d, a, b, c, m[ 3], 10, 0x8f0ccc92);            \
+    RADIUS_MD5_STEP(VI, c, d, a, b, m[10], 15, 0xffeff47d);            \
+    RADIUS_MD5_STEP(VI, b, c, d, a, m[ 1], 21, 0x85845dd1);            \
+    RADIUS_MD5_STEP(VI, a, b, c, d, m[ 8],  6, 0x6fa87e4f);            \
+    RADIUS_MD5_STEP(VI, d, a, b, c, m[15], 10, 0xfe2ce6e0);            \
+    RADIUS_MD5_STEP(VI, c, d, a, b, m[ 6], 15, 0xa3014314);            \
+    RADIUS_MD5_STEP(VI, b, c, d, a, m[13], 21, 0x4e0811a1);            \
+    RADIUS_MD5_STEP(VI, a, b, c, d, m[ 4],  6, 0xf7537e82);            \
+    RADIUS_MD5_STEP(VI, d, a, b, c, m[11], 10, 0xbd3af235);            \
+    RADIUS_MD5_STEP(VI, c, d, a, b, m[ 2], 15, 0x2ad7d2bb);            \
+    RADIUS_MD5_STEP(VI, b, c, d, a, m[ 9], 21, 0xeb86d391);            \
+    VSTORE(state[0], VADD(a, a0));                                     \
+    VSTORE(state[1], VADD(b, b0));                                     \
+    VSTORE(state[2], VADD(c, c0));                                     \
+    VSTORE(state[3], VADD(d, d0));
+
+__attribute__((target("sse2")))
+static void
+radius_md5_compress_sse2(uint32_t state[4][RADIUS_MD5_LANES],
+                         uint32_t w[RADIUS_MD5_LANES][16])
+{
+#define V __m128i
+#define VLOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *) (p), v)
+#define VADD _mm_add_epi32
+#define VAND _mm_and_si128
+#define VOR _mm_or_si128
+#define VXOR _mm_xor_si128
+#define VANDNOT _mm_andnot_si128
+#define VSET1(x) _mm_set1_epi32((int) (x))
+#define VSLL _mm_slli_epi32
+#define VSRL _mm_srli_epi32
+
+    V m[16];
+    ngx_uint_t j;
+    for (j = 0; j < 16; j++) {
+        m[j] = _mm_set_epi32(w[3][j], w[2][j], w[1][j], w[0][j]);
+    }
+
+    RADIUS_MD5_ROUNDS
+
+#undef V
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VANDNOT
+#undef VSET1
+#undef VSLL
+#undef VSRL
+}
+
+__attribute__((target("avx2")))
+static void
+radius_md5_compress_avx2(uint32_t state[4][RADIUS_MD5_LANES],
+                         uint32_t w[RADIUS_MD5_LANES][16])
+{
+#define V __m256i
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *) (p), v)
+#define VADD _mm256_add_epi32
+#define VAND _mm256_and_si256
+#define VOR _mm256_or_si256
+#define VXOR _mm256_xor_si256
+#define VANDNOT _mm256_andnot_si256
+#define VSET1(x) _mm256_set1_epi32((int) (x))
+#define VSLL _mm256_slli_epi32
+#define VSRL _mm256_srli_epi32
+
+    V m[16];
+    ngx_uint_t j;
+    for (j = 0; j < 16; j++) {
+        m[j] = _mm256_set_epi32(w[7][j], w[6][j], w[5][j], w[4][j],
+                                w[3][j], w[2][j], w[1][j], w[0][j]);
+    }
+
+    RADIUS_MD5_ROUNDS
+
+#undef V
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VANDNOT
+#undef VSET1
+#undef VSLL
+#undef VSRL
+}
+
+#endif
+
+const char *
+radius_md5_init(void)
+{
+#if (RADIUS_MD5_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        radius_md5_width = 8;
+        radius_md5_compress = radius_md5_compress_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        radius_md5_width = 4;
+        radius_md5_compress = radius_md5_compress_sse2;
+        return "sse2";
+    }
+#endif
+
+    radius_md5_width = 1;
+    return "scalar";
+}
+
+void
+radius_md5_batch(radius_md5_job_t *jobs, ngx_uint_t n)
+{
+    if (radius_md5_width == 0) {
+        (void) radius_md5_init();
+    }
+
+    if (radius_md5_width == 1 || n < 2) {
+        radius_md5_scalar(jobs, n);
+        return;
+    }
+
+    radius_md5_lanes(jobs, n);
+}
+
+static void
+radius_md5_scalar(radius_md5_job_t *jobs, ngx_uint_t n)
+{
+    ngx_uint_t i;
+    for (i = 0; i < n; i++) {
+        ngx_md5_t ctx;
+        ngx_md5_init(&ctx);
+        ngx_md5_update(&ctx, jobs[i].data[0], jobs[i].len[0]);
+        ngx_md5_update(&ctx, jobs[i].data[1], jobs[i].len[1]);
+        ngx_md5_final(jobs[i].digest, &ctx);
+    }
+}
+
+// Block k of the padded message, as little-endian words
+static void
+radius_md5_block(radius_md5_job_t *job,
+                 size_t total,
+                 ngx_uint_t k,
+                 ngx_uint_t nblocks,
+                 uint32_t w[16])
+{
+    u_char block[64];
+    size_t pos = k * 64;
+    size_t n = 0;
+
+    if (pos < job->len[0]) {
+        n = ngx_min(job->len[0] - pos, 64);
+        ngx_memcpy(block, job->data[0] + pos, n);
+    }
+    if (n < 64 && pos + n < total) {
+        size_t off = pos + n - job->len[0];
+        size_t m = ngx_min(job->len[1] - off, 64 - n);
+        ngx_memcpy(block + n, job->data[1] + off, m);
+        n += m;
+    }
+    if (n < 64) {
+        ngx_memzero(block + n, 64 - n);
+        if (pos + n == total) {
+            block[n] = 0x80;
+        }
+    }
+
+    if (k == nblocks - 1) {
+        uint64_t bits = (uint64_t) total * 8;
+        ngx_uint_t i;
+        for (i = 0; i < 8; i++) {
+            block[56 + i] = (u_char) (bits >> (8 * i));
+        }
+    }
+
+    ngx_uint_t i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i]
+               | (uint32_t) block[4 * i + 1] << 8
+               | (uint32_t) block[4 * i + 2] << 16
+               | (uint32_t) block[4 * i + 3] << 24;
+    }
+}
+
+static void
+radius_md5_lanes(radius_md5_job_t *jobs, ngx_uint_t n)
+{
+    ngx_uint_t width = radius_md5_width;
+    ngx_uint_t base, i, j, k;
+
+    for (base = 0; base < n; base += width) {
+        ngx_uint_t m = ngx_min(width, n - base);
+        if (m == 1) {
+            radius_md5_scalar(&jobs[base], 1);
+            break;
+        }
+
+        uint32_t state[4][RADIUS_MD5_LANES];
+        uint32_t w[RADIUS_MD5_LANES][16];
+        size_t total[RADIUS_MD5_LANES];
+        ngx_uint_t nblocks[RADIUS_MD5_LANES];
+        ngx_uint_t max = 0;
+
+        ngx_memzero(w, sizeof(w));
+        for (j = 0; j < width; j++) {
+            state[0][j] = 0x67452301;
+            state[1][j] = 0xefcdab89;
+            state[2][j] = 0x98badcfe;
+            state[3][j] = 0x10325476;
+            if (j < m) {
+                radius_md5_job_t *job = &jobs[base + j];
+                total[j] = job->len[0] + job->len[1];
+                nblocks[j] = (total[j] + 8) / 64 + 1;
+                max = ngx_max(max, nblocks[j]);
+            }
+        }
+
+        for (k = 0; k < max; k++) {
+            for (j = 0; j < m; j++) {
+                if (k < nblocks[j]) {
+                    radius_md5_block(&jobs[base + j], total[j], k, nblocks[j],
+                                     w[j]);
+                }
+            }
+
+            radius_md5_compress(state, w);
+
+            for (j = 0; j < m; j++) {
+                if (k != nblocks[j] - 1) {
+                    continue;
+                }
+                u_char *p = jobs[base + j].digest;
+                for (i = 0; i < 4; i++) {
+                    uint32_t v = state[i][j];
+                    *p++ = (u_char) v;
+                    *p++ = (u_char) (v >> 8);
+                    *p++ = (u_char) (v >> 16);
+                    *p++ = (u_char) (v >> 24);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef __RADIUS_MD5_H__
+#define __RADIUS_MD5_H__
+
+// Digests computed at once by the widest implementation
+#define RADIUS_MD5_LANES 8
+
+// MD5 of data[0] followed by data[1], the codec always hashes
+// a packet part and the secret
+typedef struct {
+    const u_char *data[2];
+    size_t len[2];
+    u_char *digest;
+} radius_md5_job_t;
+
+// Selects the implementation the CPU supports, returns its name
+const char *
+radius_md5_init(void);
+
+void
+radius_md5_batch(radius_md5_job_t *jobs, ngx_uint_t n);
+
+#endif // __RADIUS_MD5_H__
@@ -0,0 +1,41 @@
+#ifndef __RADIUS_PROBES_H__
+#define __RADIUS_PROBES_H__
+
+// Static probes of the auth path, see "nginx_radius" probes in
+// `bpftrace -l 'usdt:/path/to/nginx:nginx_radius:*'`.
+// Compiled in with RADIUS_USDT=YES at configure time only, otherwise
+// they are no-ops.
+//
+// All the probes have the same arguments:
+//   arg0 - HTTP request, NULL for background refreshes or if unknown
+//   arg1 - request slot (radius_req_t), NULL if none
+//   arg2 - server id
+//   arg3 - Identifier, the slot id, -1 if no slot
+//   arg4 - ngx_current_msec, the event loop time
+//   arg5 - ngx_current_msec of the last send of the slot, 0 if none
+//   arg6 - probe specific value, see the call sites
+// The event loop time is cached, use the tracer's own clock
+// (nsecs in bpftrace) for sub-millisecond timings.
+
+#if (NGX_RADIUS_USDT)
+
+#include <sys/sdt.h>
+
+#define RADIUS_PROBE(name, r, req, rs, ident, sent_at, arg)       \
+    DTRACE_PROBE7(nginx_radius, name,                             \
+                  (void *) (r), (void *) (req), (int) (rs)->id,   \
+                  (int) (ident), (ngx_msec_t) ngx_current_msec,   \
+                  (ngx_msec_t) (sent_at), (intptr_t) (arg))
+
+#else
+
+#define RADIUS_PROBE(name, r, req, rs, ident, sent_at, arg)
+
+#endif
+
+// Probe of a slot in use
+#define RADIUS_PROBE_REQ(name, req, arg)                               \
+    RADIUS_PROBE(name, (req)->ctx ? (req)->ctx->r : NULL, (req),       \
+                 (req)->rs, (req)->id, (req)->sent_at, arg)
+
+#endif // __RADIUS_PROBES_H__
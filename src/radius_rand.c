@@ -0,0 +1,183 @@
+#include <assert.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#if (NGX_LINUX)
+#include <sys/random.h>
+#endif
+#include "radius_rand.h"
+
+// Buffered ChaCha20 generator with fast key erasure: a refill runs
+// the keystream of the current key over the whole buffer and its
+// first bytes become the next key, so what was handed out before
+// can't be recomputed from the state. Bytes are wiped once handed
+// out. The kernel is asked for a new seed every RADIUS_RAND_RESEED
+// refills only.
+// https://blog.cr.yp.to/20170723-random.html
+// https://www.rfc-editor.org/rfc/rfc8439#section-2.3
+
+#define RADIUS_RAND_KEY_SIZE 32
+#define RADIUS_RAND_BLOCK_SIZE 64
+// 4k per refill, 254 Request Authenticators
+#define RADIUS_RAND_BLOCKS 64
+// A new seed every 4M
+#define RADIUS_RAND_RESEED 1024
+
+static struct {
+    uint32_t key[RADIUS_RAND_KEY_SIZE / 4];
+    u_char buf[RADIUS_RAND_BLOCKS * RADIUS_RAND_BLOCK_SIZE];
+    // Next byte not handed out
+    size_t pos;
+    ngx_uint_t refills;
+} radius_rand;
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d)                  \
+    a += b; d ^= a; d = ROTL(d, 16);               \
+    c += d; b ^= c; b = ROTL(b, 12);               \
+    a += b; d ^= a; d = ROTL(d, 8);                \
+    c += d; b ^= c; b = ROTL(b, 7);
+
+// Without getrandom(2), /dev/urandom doesn't block once seeded
+static ngx_err_t
+radius_rand_seed(u_char *seed, size_t len, ngx_uint_t nonblock)
+{
+#if (NGX_LINUX)
+    int flags = nonblock ? GRND_NONBLOCK : 0;
+#else
+    ngx_fd_t fd = ngx_open_file("/dev/urandom", NGX_FILE_RDONLY,
+                                NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return ngx_errno;
+    }
+#endif
+
+    ngx_err_t err = 0;
+    size_t got = 0;
+    while (got < len) {
+#if (NGX_LINUX)
+        ssize_t n = getrandom(seed + got, len - got, flags);
+#else
+        ssize_t n = ngx_read_fd(fd, seed + got, len - got);
+        if (n == 0) {
+            err = EIO;
+            break;
+        }
+#endif
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+            err = ngx_errno;
+            break;
+        }
+        got += n;
+    }
+
+#if !(NGX_LINUX)
+    ngx_close_file(fd);
+#endif
+
+    return err;
+}
+
+static void
+radius_rand_block(const uint32_t key[8], uint32_t counter, u_char *out)
+{
+    // "expand 32-byte k", zero nonce: the key is never reused
+    uint32_t s[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3],
+        key[4], key[5], key[6], key[7],
+        counter, 0, 0, 0
+    };
+    uint32_t x[16];
+    ngx_uint_t i;
+
+    ngx_memcpy(x, s, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    // Little-endian words, whatever the host
+    for (i = 0; i < 16; i++) {
+        uint32_t v = x[i] + s[i];
+        out[i * 4] = (u_char) v;
+        out[i * 4 + 1] = (u_char) (v >> 8);
+        out[i * 4 + 2] = (u_char) (v >> 16);
+        out[i * 4 + 3] = (u_char) (v >> 24);
+    }
+}
+
+static void
+radius_rand_refill(void)
+{
+    if (++radius_rand.refills % RADIUS_RAND_RESEED == 0) {
+        u_char seed[RADIUS_RAND_KEY_SIZE];
+        // Mixed into the key, if the kernel can't answer right away
+        // the current key is good enough until the next time
+        if (radius_rand_seed(seed, sizeof(seed), 1) == 0) {
+            u_char *k = (u_char *) radius_rand.key;
+            ngx_uint_t i;
+            for (i = 0; i < sizeof(seed); i++) {
+                k[i] ^= seed[i];
+            }
+        }
+        ngx_explicit_memzero(seed, sizeof(seed));
+    }
+
+    uint32_t i;
+    for (i = 0; i < RADIUS_RAND_BLOCKS; i++) {
+        radius_rand_block(radius_rand.key, i,
+                          radius_rand.buf + i * RADIUS_RAND_BLOCK_SIZE);
+    }
+
+    ngx_memcpy(radius_rand.key, radius_rand.buf, RADIUS_RAND_KEY_SIZE);
+    ngx_memzero(radius_rand.buf, RADIUS_RAND_KEY_SIZE);
+    radius_rand.pos = RADIUS_RAND_KEY_SIZE;
+}
+
+ngx_err_t
+radius_rand_init(void)
+{
+    ngx_err_t err = radius_rand_seed((u_char *) radius_rand.key,
+                                     RADIUS_RAND_KEY_SIZE, 0);
+    if (err) {
+        return err;
+    }
+
+    // Nothing left from the parent
+    ngx_memzero(radius_rand.buf, sizeof(radius_rand.buf));
+    radius_rand.pos = sizeof(radius_rand.buf);
+    radius_rand.refills = 0;
+
+    return 0;
+}
+
+ngx_err_t
+radius_rand_kernel(void *buf, size_t len)
+{
+    return radius_rand_seed(buf, len, 0);
+}
+
+void
+radius_rand_bytes(void *buf, size_t len)
+{
+    assert(len <= RADIUS_RAND_MAX);
+
+    if (len > sizeof(radius_rand.buf) - radius_rand.pos) {
+        radius_rand_refill();
+    }
+
+    u_char *p = radius_rand.buf + radius_rand.pos;
+    ngx_memcpy(buf, p, len);
+    ngx_memzero(p, len);
+    radius_rand.pos += len;
+}
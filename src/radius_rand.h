@@ -0,0 +1,21 @@
+#ifndef __RADIUS_RAND_H__
+#define __RADIUS_RAND_H__
+
+// Seeds the generator of the process from getrandom(2), or
+// /dev/urandom outside of Linux, returns 0 or the error. Must be
+// called in every worker, the state isn't shared.
+ngx_err_t
+radius_rand_init(void);
+
+// At most RADIUS_RAND_MAX bytes at once
+#define RADIUS_RAND_MAX 1024
+
+void
+radius_rand_bytes(void *buf, size_t len);
+
+// Straight from the kernel, for the secrets set up by the master
+// before the generator is seeded, returns 0 or the error
+ngx_err_t
+radius_rand_kernel(void *buf, size_t len);
+
+#endif // __RADIUS_RAND_H__
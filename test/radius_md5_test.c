@@ -0,0 +1,248 @@
+// Known-answer tests of the MD5 batches against ngx_md5, for each
+// implementation the CPU supports, and a benchmark with "-b".
+// Built against a configured nginx tree, see "make test".
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// The implementation is selected through its statics
+#include "../src/radius_md5.c"
+
+typedef struct {
+    const char *name;
+    ngx_uint_t width;
+    radius_md5_compress_pt compress;
+    ngx_uint_t supported;
+} radius_md5_impl_t;
+
+// RFC 1321, appendix A.5
+static const struct {
+    const char *data;
+    const char *digest;
+} radius_md5_kats[] = {
+    { "", "d41d8cd98f00b204e9800998ecf8427e" },
+    { "a", "0cc175b9c0f1b6a831c399e269772661" },
+    { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+    { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+    { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+    { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+      "d174ab98d277d9f5a5611c2c9f419d9f" },
+    { "1234567890123456789012345678901234567890"
+      "1234567890123456789012345678901234567890",
+      "57edf4a22be3c955ac49da2e2107b67a" },
+};
+
+#define RADIUS_MD5_TEST_KATS \
+    (sizeof(radius_md5_kats) / sizeof(radius_md5_kats[0]))
+#define RADIUS_MD5_TEST_JOBS 64
+// Covers the padding edge cases around 56 and 64 bytes, and the sizes
+// of the packets: the codec hashes up to 4096 bytes and a secret
+#define RADIUS_MD5_TEST_MAX_LEN 300
+
+static u_char radius_md5_test_data[2][RADIUS_MD5_TEST_MAX_LEN];
+static ngx_uint_t radius_md5_test_failed;
+
+// Only ngx_md5.o is linked, so no ngx_hex_dump
+static void
+radius_md5_test_hex(u_char *hex, const u_char *digest)
+{
+    static const char xdigits[] = "0123456789abcdef";
+    ngx_uint_t i;
+    for (i = 0; i < 16; i++) {
+        *hex++ = xdigits[digest[i] >> 4];
+        *hex++ = xdigits[digest[i] & 0xf];
+    }
+    *hex = '\0';
+}
+
+static void
+radius_md5_test_select(radius_md5_impl_t *impl)
+{
+    radius_md5_width = impl->width;
+    radius_md5_compress = impl->compress;
+}
+
+static void
+radius_md5_test_kats(radius_md5_impl_t *impl)
+{
+    radius_md5_job_t jobs[RADIUS_MD5_TEST_KATS];
+    u_char digests[RADIUS_MD5_TEST_KATS][16];
+    ngx_uint_t i, n = RADIUS_MD5_TEST_KATS;
+
+    // All at once, then split in two parts at every position
+    for (i = 0; i < n; i++) {
+        jobs[i].data[0] = (u_char *) radius_md5_kats[i].data;
+        jobs[i].len[0] = strlen(radius_md5_kats[i].data);
+        jobs[i].data[1] = NULL;
+        jobs[i].len[1] = 0;
+        jobs[i].digest = digests[i];
+    }
+    radius_md5_batch(jobs, n);
+
+    for (i = 0; i < n; i++) {
+        u_char hex[33];
+        radius_md5_test_hex(hex, digests[i]);
+        if (strcmp((char *) hex, radius_md5_kats[i].digest) != 0) {
+            printf("%s: kat %u: %s, expected %s\n", impl->name,
+                   (unsigned) i, hex, radius_md5_kats[i].digest);
+            radius_md5_test_failed++;
+        }
+    }
+
+    size_t len = strlen(radius_md5_kats[n - 1].data);
+    size_t split;
+    for (split = 0; split <= len; split++) {
+        radius_md5_job_t job[2];
+        u_char digest[2][16];
+        for (i = 0; i < 2; i++) {
+            job[i].data[0] = (u_char *) radius_md5_kats[n - 1].data;
+            job[i].len[0] = split;
+            job[i].data[1] = job[i].data[0] + split;
+            job[i].len[1] = len - split;
+            job[i].digest = digest[i];
+        }
+        radius_md5_batch(job, 2);
+
+        u_char hex[33];
+        radius_md5_test_hex(hex, digest[1]);
+        if (strcmp((char *) hex, radius_md5_kats[n - 1].digest) != 0
+            || memcmp(digest[0], digest[1], 16) != 0)
+        {
+            printf("%s: kat split at %u: %s\n", impl->name,
+                   (unsigned) split, hex);
+            radius_md5_test_failed++;
+        }
+    }
+}
+
+// Every lane count with lanes of different lengths, so that they end
+// in different blocks
+static void
+radius_md5_test_lanes(radius_md5_impl_t *impl)
+{
+    radius_md5_job_t jobs[RADIUS_MD5_TEST_JOBS];
+    u_char digests[RADIUS_MD5_TEST_JOBS][16];
+    ngx_uint_t n, i, round;
+
+    for (round = 0; round < 200; round++) {
+        for (n = 1; n <= RADIUS_MD5_TEST_JOBS; n++) {
+            for (i = 0; i < n; i++) {
+                size_t len0 = (round * 7 + i * 13) % RADIUS_MD5_TEST_MAX_LEN;
+                size_t len1 = (round + i * 5) % 33;
+                jobs[i].data[0] = radius_md5_test_data[0];
+                jobs[i].len[0] = len0;
+                jobs[i].data[1] = radius_md5_test_data[1];
+                jobs[i].len[1] = len1;
+                jobs[i].digest = digests[i];
+            }
+            radius_md5_batch(jobs, n);
+
+            for (i = 0; i < n; i++) {
+                u_char expected[16];
+                ngx_md5_t md5;
+                ngx_md5_init(&md5);
+                ngx_md5_update(&md5, jobs[i].data[0], jobs[i].len[0]);
+                ngx_md5_update(&md5, jobs[i].data[1], jobs[i].len[1]);
+                ngx_md5_final(expected, &md5);
+                if (memcmp(expected, digests[i], 16) != 0) {
+                    printf("%s: %u jobs, job %u, lengths %u+%u differ\n",
+                           impl->name, (unsigned) n, (unsigned) i,
+                           (unsigned) jobs[i].len[0],
+                           (unsigned) jobs[i].len[1]);
+                    radius_md5_test_failed++;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static double
+radius_md5_test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A response authenticator: a packet and a 16 bytes secret, in
+// batches of a full event loop iteration
+static void
+radius_md5_test_bench(radius_md5_impl_t *impl, size_t len)
+{
+    radius_md5_job_t jobs[RADIUS_MD5_TEST_JOBS];
+    u_char digests[RADIUS_MD5_TEST_JOBS][16];
+    ngx_uint_t i, iterations = 20000;
+
+    for (i = 0; i < RADIUS_MD5_TEST_JOBS; i++) {
+        jobs[i].data[0] = radius_md5_test_data[0];
+        jobs[i].len[0] = len;
+        jobs[i].data[1] = radius_md5_test_data[1];
+        jobs[i].len[1] = 16;
+        jobs[i].digest = digests[i];
+    }
+
+    double start = radius_md5_test_now();
+    for (i = 0; i < iterations; i++) {
+        radius_md5_batch(jobs, RADIUS_MD5_TEST_JOBS);
+        radius_md5_test_data[0][0] = digests[i % RADIUS_MD5_TEST_JOBS][0];
+    }
+    double elapsed = radius_md5_test_now() - start;
+
+    printf("%-8s %4u bytes: %8.0f digests/ms\n", impl->name,
+           (unsigned) len, iterations * RADIUS_MD5_TEST_JOBS / elapsed / 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+    radius_md5_impl_t impls[] = {
+        { "scalar", 1, NULL, 1 },
+#if (RADIUS_MD5_X86)
+        { "sse2", 4, radius_md5_compress_sse2, 0 },
+        { "avx2", 8, radius_md5_compress_avx2, 0 },
+#endif
+    };
+    ngx_uint_t bench = argc > 1 && strcmp(argv[1], "-b") == 0;
+    ngx_uint_t i;
+
+#if (RADIUS_MD5_X86)
+    __builtin_cpu_init();
+    impls[1].supported = __builtin_cpu_supports("sse2");
+    impls[2].supported = __builtin_cpu_supports("avx2");
+#endif
+
+    for (i = 0; i < sizeof(radius_md5_test_data); i++) {
+        radius_md5_test_data[i / RADIUS_MD5_TEST_MAX_LEN]
+                            [i % RADIUS_MD5_TEST_MAX_LEN] = (u_char) (i * 131);
+    }
+
+    printf("selected: %s\n", radius_md5_init());
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!impls[i].supported) {
+            printf("%s: not supported, skipped\n", impls[i].name);
+            continue;
+        }
+        radius_md5_test_select(&impls[i]);
+
+        if (bench) {
+            radius_md5_test_bench(&impls[i], 20);
+            radius_md5_test_bench(&impls[i], 100);
+            radius_md5_test_bench(&impls[i], 250);
+            continue;
+        }
+
+        radius_md5_test_kats(&impls[i]);
+        radius_md5_test_lanes(&impls[i]);
+        printf("%s: done\n", impls[i].name);
+    }
+
+    if (radius_md5_test_failed) {
+        printf("failed: %u\n", (unsigned) radius_md5_test_failed);
+        return 1;
+    }
+
+    return 0;
+}